@@ -0,0 +1,59 @@
+#ifndef LICENSE_ASYNC_SERVER_HH
+#define LICENSE_ASYNC_SERVER_HH
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <grpcpp/grpcpp.h>
+
+#include "license.grpc.pb.h"
+
+class LicsServer;
+
+// every in-flight rpc of the async server is a AsyncCall object, its address is the completion queue tag.
+class AsyncCall {
+public:
+    virtual ~AsyncCall() {}
+
+    // called by poller thread when the last operation of the call completes.
+    virtual void Proceed(bool ok) = 0;
+};
+
+// LicsAsyncServer serves the License service over the completion queue api. rpcs are
+// dispatched to the same LicsServer handlers as the synchronous service, but no rpc
+// occupies a thread while it waits: a fixed set of poller threads drains the queues.
+class LicsAsyncServer {
+public:
+    // cpus is optional, poller threads are pinned to it round robin.
+    LicsAsyncServer(LicsServer* handler, int cqNum, int pollerNum, const std::vector<int>& cpus);
+    ~LicsAsyncServer();
+
+    // register the async service, create completion queues and start the server, which it owns.
+    bool BuildAndStart(grpc::ServerBuilder& builder);
+
+    // arm every rpc on every queue, start pollers and block until Shutdown.
+    void Run();
+
+    // shut the server down, rpcs in flight get ASYNC_SHUTDOWN_GRACE_MS to finish, then the queues,
+    // every pending call is deleted by the pollers as they drain, and Run returns. any thread.
+    void Shutdown();
+
+private:
+    void armAll(grpc::ServerCompletionQueue* cq);
+    void poll(grpc::ServerCompletionQueue* cq, int cpu);
+
+private:
+    LicsServer* handler_;
+    int cqNum_;
+    int pollerNum_;
+    std::vector<int> cpus_;
+    UnisAlgoLics::License::AsyncService service_;
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+    std::unique_ptr<grpc::Server> server_;
+    std::vector<std::thread> pollers_;
+    std::atomic<bool> stopping_{false}; // calls arm no successor once set
+    std::atomic<bool> stopped_{false}; // Shutdown ran
+};
+
+#endif
@@ -11,11 +11,16 @@
 #include <memory>
 #include <string>
 #include <map>
+#include <vector>
+#include <functional>
+#include <chrono>
+#include <random>
 #include <grpcpp/grpcpp.h>
 #include <unistd.h>
 #include "license.grpc.pb.h"
 #include "lics_error.h"
 #include "lics_interface.h"
+#include "reservoir.h"
 
 #include "spdlog/spdlog.h"
 #include "spdlog/cfg/env.h"
@@ -24,11 +29,16 @@
 
 using grpc::Channel;
 using grpc::ClientContext;
+using grpc::ClientReaderWriter;
 using grpc::Status;
 using UnisAlgoLics::CreateLicsRequest;
 using UnisAlgoLics::CreateLicsResponse;
 using UnisAlgoLics::DeleteLicsRequest;
 using UnisAlgoLics::DeleteLicsResponse;
+using UnisAlgoLics::BatchCreateLicsRequest;
+using UnisAlgoLics::BatchCreateLicsResponse;
+using UnisAlgoLics::BatchDeleteLicsRequest;
+using UnisAlgoLics::BatchDeleteLicsResponse;
 using UnisAlgoLics::QueryLicsRequest;
 using UnisAlgoLics::QueryLicsResponse;
 using UnisAlgoLics::GetAuthAccessRequest;
@@ -43,6 +53,8 @@ using UnisAlgoLics::Vendor;
 
 enum LicsClientEventType {
     EXIT = 0,
+    RESERVOIR, // a reservoir fell below its low watermark
+    CHANNEL, // channel connectivity state may have changed
 };
 
 class LicsClientEvent {
@@ -56,45 +68,166 @@ private:
     int id_;
 };
 
+// every in-flight rpc of the client completion queue is a AsyncClientCall, its address is the tag.
+class AsyncClientCall {
+public:
+    virtual ~AsyncClientCall() {}
+
+    // called by completion queue thread once the rpc finished, the call is deleted right after.
+    virtual void Done() = 0;
+};
+
+template <class Response>
+class AsyncUnaryClientCall : public AsyncClientCall {
+public:
+    typedef std::function<void(const Status&, Response&)> DoneFn;
+
+    explicit AsyncUnaryClientCall(DoneFn done) : done_(done) {}
+
+    void Done() override {
+        done_(status, resp);
+    }
+
+    ClientContext ctx;
+    Response resp;
+    Status status;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<Response>> reader;
+
+private:
+    DoneFn done_;
+};
+
+// a channel state watch, Done runs when the state changed or the watch timed out.
+class ChannelWatchCall : public AsyncClientCall {
+public:
+    explicit ChannelWatchCall(std::function<void()> done) : done_(done) {}
+
+    void Done() override {
+        done_();
+    }
+
+private:
+    std::function<void()> done_;
+};
+
 class LicsClient {
 public:
+    typedef std::function<void(int, CreateLicsResponse&)> CreateDoneFn;
+    typedef std::function<void(int, DeleteLicsResponse&)> DeleteDoneFn;
+
     LicsClient(std::shared_ptr<Channel> channel, AlgoCapability* algoLics, int size);
     ~LicsClient();
 
     int CreateLics(CreateLicsRequest& req, CreateLicsResponse& resp);
     int DeleteLics(DeleteLicsRequest& req, DeleteLicsResponse& resp);
+    // done is called once with the result if ELICS_OK is returned, see lics_apply_async.
+    int CreateLicsAsync(CreateLicsRequest& req, CreateDoneFn done);
+    int DeleteLicsAsync(DeleteLicsRequest& req, DeleteDoneFn done);
+    // resp items follow req items, video items are sent in one rpc, picture items and video items
+    // with a reservoir are served locally.
+    int BatchCreateLics(BatchCreateLicsRequest& req, BatchCreateLicsResponse& resp);
+    int BatchDeleteLics(BatchDeleteLicsRequest& req, BatchDeleteLicsResponse& resp);
     int GetAuthAccess();
     int KeepAlive();
+    int KeepAliveOnStream(); // send one heartbeat on the keepalive stream, opened by openKeepAliveStream
     //void QueryLics();
     int GetTaskTypeFromAlgoID(int algoID, TaskType& type);
+    int SetReservoir(int algoID, int low, int high);
 
+    // interrupt doLoop wherever it waits and wait for it to exit, may be called more than once.
     void Stop();
 
 protected:
     virtual Status createLics(CreateLicsRequest& req, CreateLicsResponse& resp);
     virtual Status deleteLics(DeleteLicsRequest& req, DeleteLicsResponse& resp);
+    virtual void createLicsAsync(CreateLicsRequest& req, AsyncUnaryClientCall<CreateLicsResponse>::DoneFn done);
+    virtual void deleteLicsAsync(DeleteLicsRequest& req, AsyncUnaryClientCall<DeleteLicsResponse>::DoneFn done);
+    virtual Status batchCreateLics(BatchCreateLicsRequest& req, BatchCreateLicsResponse& resp);
+    virtual Status batchDeleteLics(BatchDeleteLicsRequest& req, BatchDeleteLicsResponse& resp);
     virtual Status getAuthAccess(const GetAuthAccessRequest& req, GetAuthAccessResponse& resp);
     virtual Status keepAlive(const KeepAliveRequest& req, KeepAliveResponse& resp);
+    virtual int openKeepAliveStream();
     //void queryLics_();
 
 private:
     void doLoop();
-    std::shared_ptr<LicsClientEvent> dequeue(); // TODO: make LicsClientEvent to be  a template
+    void pollCompletions();
+    // TODO: make LicsClientEvent to be  a template
+    std::shared_ptr<LicsClientEvent> dequeue(std::chrono::steady_clock::time_point deadline);
     void enqueue(std::shared_ptr<LicsClientEvent> t);
     bool empty();
 
+    bool waitReconnect(int attempt); // return true if asked to exit meanwhile
+    void watchChannel(grpc_connectivity_state state, std::chrono::steady_clock::time_point deadline);
+    int randomMs(int max);
+
     void signalExit();// signal work thread to exit.
     bool gotExitSignal(std::shared_ptr<LicsClientEvent> t);
 
     long getToken();
     void setToken(long token);
 
+    int takeFromReservoir(LicsReservoir* reservoir, int expected);
+    int createFromReservoir(LicsReservoir* reservoir, CreateLicsRequest& req, CreateLicsResponse& resp);
+    int deleteToReservoir(LicsReservoir* reservoir, DeleteLicsRequest& req, DeleteLicsResponse& resp);
+    LicsReservoir* findReservoir(long algoID);
+
+    // video applies of one algorithm share a CreateLics: whoever comes while one is in flight
+    // waits for the next, which asks for all of them at once.
+    struct ApplyCoalescer {
+        std::mutex mtx;
+        bool inFlight{false};
+        std::vector<std::pair<int, CreateDoneFn>> waiters; // expected licenses and callback, in arrival order
+    };
+    void coalesceCreate(ApplyCoalescer* coalescer, CreateLicsRequest& req, CreateDoneFn done);
+    void flushCoalesced(ApplyCoalescer* coalescer, const Algorithm& algo);
+
+    int leaseReservoir(long algoID, LicsReservoir* reservoir, int num);
+    void returnReservoir(long algoID, LicsReservoir* reservoir, int num);
+    void balanceReservoirs();
+
+    void buildKeepAliveRequest(KeepAliveRequest& req);
+    void buildKeepAliveDelta(KeepAliveRequest& req);
+    void applyKeepAliveResponse(const KeepAliveResponse& resp);
+    void applyHeartbeatPace(int intervalMs, int jitterMs);
+    void readKeepAliveStream();
+    void closeKeepAliveStream();
+
 private:
     long token_{-1};
 
-    std::map<long, std::shared_ptr<AlgoLics>> cache_; // key is algorithm id
+    // key is algorithm id, keys are fixed after construction. the lics fields are written by app threads,
+    // the doLoop thread and the keepalive stream reader, always under exclusive_write_or_read_cache.
+    std::map<long, std::shared_ptr<AlgoLics>> cache_;
+    std::mutex exclusive_write_or_read_cache;
+
+    // key is algorithm id, one per video algorithm and fixed after construction.
+    std::map<long, std::unique_ptr<LicsReservoir>> reservoirs_;
+    std::atomic<bool> refillPending_{false}; // a RESERVOIR event is queued
+    std::map<long, std::unique_ptr<ApplyCoalescer>> coalescers_; // key is algorithm id, same keys as reservoirs_
 
+    std::shared_ptr<Channel> channel_;
     std::unique_ptr<License::Stub> stub_;
+    std::atomic<bool> watchArmed_{false}; // a ChannelWatchCall is pending on cq_
+    std::mt19937 rng_; // reconnect jitter, doLoop thread only
+
+    grpc::CompletionQueue cq_; // async create/delete rpcs, drained by cqThread_
+    std::thread cqThread_;
+    std::thread loop_; // doLoop, it arms channel watches on cq_ so it is joined before cq_ shuts down
+    std::once_flag loopJoined_;
+
+    // keepalive stream, written by doLoop thread and read by streamReader_ thread.
+    std::unique_ptr<ClientContext> streamCtx_;
+    std::unique_ptr<ClientReaderWriter<KeepAliveRequest, KeepAliveResponse>> stream_;
+    std::thread streamReader_;
+    std::atomic<bool> streamBroken_{false};
+    std::atomic<int> streamRespCode_{ELICS_OK}; // respcode of the response which broke the stream
+    long streamVersion_{0}; // version of the last heartbeat written to the stream, 0 before the full snapshot
+    std::map<long, AlgoLics> streamSent_; // key is algorithm id, lics as last written to the stream
+
+    // heartbeat pacing told by server, the stream reader thread updates it too.
+    std::atomic<int> heartbeatIntervalMs_;
+    std::atomic<int> heartbeatJitterMs_{0};
 
     // to be fixed: keep synchronized 
     std::atomic<bool> connected_ {false}; // license server receving client request.
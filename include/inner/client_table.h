@@ -0,0 +1,51 @@
+#ifndef LICENSE_CLIENT_TABLE_HH
+#define LICENSE_CLIENT_TABLE_HH
+
+#include <climits>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+class Client;
+
+#define CLIENT_TABLE_EMPTY  (LONG_MIN) // never a token
+#define CLIENT_TABLE_MIN_SLOTS  (16)
+
+/*
+* ClientTable maps tokens to clients with open addressing and linear probing. tokens are kept
+* in an array of their own, so a probe walks consecutive cache lines of 8 tokens each and the
+* client is only touched on a hit. it is kept at most half full, erase shifts the entries of the
+* probe run back instead of leaving tombstones, so lookups never slow down with churn.
+* not thread-safe, the caller serializes writers against everyone.
+*/
+class ClientTable {
+public:
+    ClientTable();
+
+    std::shared_ptr<Client> Find(long token) const;
+    // insert or replace.
+    void Insert(long token, const std::shared_ptr<Client>& client);
+    bool Erase(long token);
+    size_t Size() const;
+
+    template <typename Fn>
+    void ForEach(Fn fn) const {
+        for (size_t idx = 0; idx < tokens_.size(); ++idx) {
+            if (tokens_[idx] != CLIENT_TABLE_EMPTY) {
+                fn(tokens_[idx], clients_[idx]);
+            }
+        }
+    }
+
+private:
+    size_t slotOf(long token) const;
+    void grow();
+
+    std::vector<long> tokens_;
+    std::vector<std::shared_ptr<Client>> clients_; // same slot as the token
+    size_t mask_;
+    int shift_; // 64 - log2 of the slot count
+    size_t size_{0};
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef LICENSE_CLOUD_SYNC_HH
+#define LICENSE_CLOUD_SYNC_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// CircuitBreaker stops calling a peer after `failures` failures in a row. it stays open for a
+// backoff that doubles every time it opens again, up to maxBackoff, then lets one call through:
+// success closes it, failure opens it once more.
+// not thread-safe, the caller serializes calls.
+class CircuitBreaker {
+public:
+    CircuitBreaker(int failures, std::chrono::milliseconds backoff, std::chrono::milliseconds maxBackoff);
+
+    bool Allow(std::chrono::steady_clock::time_point now);
+    void Succeed();
+    void Fail(std::chrono::steady_clock::time_point now);
+    bool Opened();
+
+private:
+    int threshold_;
+    std::chrono::milliseconds backoff_;
+    std::chrono::milliseconds maxBackoff_;
+    int failures_{0}; // in a row
+    int trips_{0}; // times opened since last success
+    std::chrono::steady_clock::time_point retryAt_;
+    bool opened_{false};
+};
+
+/*
+* CloudSyncWorker runs cloud fetches and pushes on a thread of its own, so whoever asks for one
+* never waits on the network. requests made while one is running are merged into the next run.
+* fetch and push return false on failure and feed the breaker, while it is open nothing is sent,
+* whatever was fetched last stays in effect and usage waits in the backlog of the pusher.
+*/
+class CloudSyncWorker {
+public:
+    CloudSyncWorker(std::function<bool()> fetch, std::function<bool()> push, const CircuitBreaker& breaker);
+    ~CloudSyncWorker();
+
+    void RequestFetch();
+    void RequestPush();
+    bool BreakerOpened();
+
+private:
+    void request(bool& pending);
+    void run();
+    bool call(const std::function<bool()>& request);
+
+    std::function<bool()> fetch_;
+    std::function<bool()> push_;
+    CircuitBreaker breaker_; // worker thread only
+    std::atomic<bool> breakerOpened_{false}; // copy of breaker_ state for other threads
+
+    std::mutex mtx_; // guards the flags below, never held across a request
+    std::condition_variable cv_;
+    bool fetchPending_{false};
+    bool pushPending_{false};
+    bool stopping_{false};
+    std::thread thread_;
+};
+
+#endif
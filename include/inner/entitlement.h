@@ -0,0 +1,38 @@
+#ifndef LICENSE_ENTITLEMENT_HH
+#define LICENSE_ENTITLEMENT_HH
+
+#include <map>
+#include <string>
+#include <vector>
+
+// licenses of cloud license class `key` count toward algorithm `algoID`, divided by `divisor`.
+struct EntitlementRule {
+    std::string key;
+    long algoID;
+    long divisor;
+};
+
+/*
+* EntitlementParser turns the cloud entitlement document, {"data": {"res": {"<class>": {"num": n}}}},
+* into license totals per algorithm in one streaming pass, no DOM is built. which class feeds which
+* algorithm comes from the rule table, so a new class is a conf change. classes without a rule and
+* any other member are skipped, a parse allocates nothing per class.
+*/
+class EntitlementParser {
+public:
+    explicit EntitlementParser(const std::vector<EntitlementRule>& rules);
+
+    // every algorithm of the table gets a total, zero if none of its classes is in the document.
+    // return false on malformed json or when there is no data.res object.
+    bool Parse(const char* json, std::map<long, int>& totals) const;
+
+    // conf format: <class>:<algorithm id>[/<divisor>],... like VIASCAR-MAX-CLASSES:101/86400.
+    // return false and leave rules alone on a bad entry.
+    static bool ParseRules(const std::string& conf, std::vector<EntitlementRule>& rules);
+    static std::vector<EntitlementRule> DefaultRules();
+
+private:
+    std::vector<EntitlementRule> rules_; // sorted by key, searched without building a string
+};
+
+#endif
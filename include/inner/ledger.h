@@ -0,0 +1,56 @@
+#ifndef LICENSE_LEDGER_HH
+#define LICENSE_LEDGER_HH
+
+#include <map>
+#include <memory>
+#include <atomic>
+#include <vector>
+
+#include "license.grpc.pb.h"
+
+using UnisAlgoLics::TaskType;
+
+// per-algorithm license counters, all fields are plain atomics so that grant/free never take a lock.
+struct AlgoLedgerEntry {
+    AlgoLedgerEntry(long id, int s, TaskType t) : algoID(id), slot(s), type(t) {}
+
+    const long algoID;
+    const int slot; // dense index of the algorithm, 0 up to LicsLedger::Slots(), clients keep their counters by it.
+    const TaskType type;
+    std::atomic<int> total{0};
+    std::atomic<int> used{0}; // includes reserved
+    std::atomic<int> reserved{0}; // leased into client reservoirs, not necessarily in use yet.
+    std::atomic<int> clients{0}; // clients registered this algorithm, used for picture fair share.
+};
+
+// LicsLedger keeps the server-side big picture of every algorithm license.
+// the algorithm catalog is fixed after construction, so lookups need no lock, and
+// Grant/Release are CAS loops on the per-algorithm counters. protobuf AlgoLics are
+// never stored here, callers build them at the RPC edge.
+class LicsLedger {
+public:
+    LicsLedger();
+
+    // register an algorithm, only allowed before the ledger is shared with other threads.
+    void AddAlgo(long algoID, TaskType type);
+
+    AlgoLedgerEntry* Find(long algoID) const;
+    // number of algorithms, every slot below it has an entry.
+    int Slots() const;
+    AlgoLedgerEntry* At(int slot) const;
+
+    // grant up to expected licenses, return the number actually granted.
+    int Grant(AlgoLedgerEntry* entry, int expected);
+    // give back up to expected licenses, return the number actually released.
+    int Release(AlgoLedgerEntry* entry, int expected);
+
+    void SetTotal(long algoID, int total);
+
+    const std::map<long, std::unique_ptr<AlgoLedgerEntry>>& Entries() const;
+
+private:
+    std::map<long, std::unique_ptr<AlgoLedgerEntry>> entries_; // key is algorithm id, read-only after startup.
+    std::vector<AlgoLedgerEntry*> slots_; // index is slot, in the order algorithms were added.
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef LICENSE_LOCK_PROFILE_HH
+#define LICENSE_LOCK_PROFILE_HH
+
+#include <string>
+#include <mutex>
+#include <condition_variable>
+
+/*
+* lock contention profiling, built with -DLICS_LOCK_PROFILE (cmake -DLICS_LOCK_PROFILE=ON).
+* server locks are declared as LicsMutex/LicsRWMutex and taken through the LICS_*_LOCK macros
+* below. without the flag those are the plain mutexes and guards, so nothing is left to pay for.
+* with it every call site counts acquisitions and contended acquisitions, and records how long it
+* waited for and held the lock. LockProfileReport dumps it all, GetMetrics returns it too.
+*/
+std::string LockProfileReport(); // empty unless profiling is compiled in
+
+#ifdef LICS_LOCK_PROFILE
+
+#include <chrono>
+#include "metrics.h"
+
+struct LockSite {
+    MetricsCounter* acquisitions;
+    MetricsCounter* contended; // lock was taken by someone else when we came
+    LatencyHistogram* wait;
+    LatencyHistogram* hold;
+};
+
+// sites live as long as the process, one per lock statement.
+LockSite* NewLockSite(const char* lock, const char* func, const char* file, int line);
+
+// site of the lock statement it is expanded in, looked up once.
+#define LICS_LOCK_SITE(lock) ([](const char* func) -> LockSite* { \
+            static LockSite* site = NewLockSite(lock, func, __FILE__, __LINE__); \
+            return site; \
+        }(__func__))
+
+// site of the latest exclusive lock taken by this thread, see ProfiledMutex::lock.
+extern thread_local LockSite* lastLockSite;
+
+/*
+* ProfiledMutex wraps std::mutex or RWMutex. an exclusive holder keeps its site and lock time in
+* the mutex, so unlock knows what to record and any std guard works on top of it. shared holders
+* are many, their guard keeps that instead.
+*/
+template <class Mutex>
+class ProfiledMutex {
+public:
+    void Lock(LockSite* site) {
+        site_ = site;
+        lockedAt_ = acquire(site, [this]() { return mtx_.try_lock(); }, [this]() { mtx_.lock(); });
+        lastLockSite = site;
+    }
+
+    // what condition_variable_any relocks with, a wait always follows a Lock of the same thread.
+    void lock() {
+        Lock(threadSite());
+    }
+
+    bool try_lock() {
+        if (!mtx_.try_lock()) {
+            return false;
+        }
+        site_ = threadSite();
+        lockedAt_ = std::chrono::steady_clock::now();
+        site_->acquisitions->Add();
+        return true;
+    }
+
+    void unlock() {
+        LockSite* site = site_;
+        long held = MetricsSinceNs(lockedAt_);
+        mtx_.unlock();
+        site->hold->Record(held);
+    }
+
+    std::chrono::steady_clock::time_point LockShared(LockSite* site) {
+        return acquire(site, [this]() { return mtx_.try_lock_shared(); }, [this]() { mtx_.lock_shared(); });
+    }
+
+    void UnlockShared(LockSite* site, std::chrono::steady_clock::time_point lockedAt) {
+        long held = MetricsSinceNs(lockedAt);
+        mtx_.unlock_shared();
+        site->hold->Record(held);
+    }
+
+private:
+    LockSite* threadSite() {
+        return lastLockSite ? lastLockSite : LICS_LOCK_SITE("unattributed");
+    }
+
+    // an uncontended acquisition costs one clock read, a contended one two.
+    template <class TryLock, class BlockingLock>
+    static std::chrono::steady_clock::time_point acquire(LockSite* site, TryLock tryLock, BlockingLock lock) {
+        site->acquisitions->Add();
+        if (tryLock()) {
+            site->wait->Record(0);
+            return std::chrono::steady_clock::now();
+        }
+
+        site->contended->Add();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        lock();
+        std::chrono::steady_clock::time_point lockedAt = std::chrono::steady_clock::now();
+        site->wait->Record(std::chrono::duration_cast<std::chrono::nanoseconds>(lockedAt - start).count());
+        return lockedAt;
+    }
+
+    Mutex mtx_;
+    LockSite* site_{nullptr}; // guarded by mtx_ itself, like lockedAt_
+    std::chrono::steady_clock::time_point lockedAt_;
+};
+
+template <class Mutex>
+class ProfiledReadLockGuard {
+public:
+    ProfiledReadLockGuard(ProfiledMutex<Mutex>& mtx, LockSite* site) : mtx_(mtx), site_(site), lockedAt_(mtx.LockShared(site)) {}
+    ~ProfiledReadLockGuard() { mtx_.UnlockShared(site_, lockedAt_); }
+
+    ProfiledReadLockGuard(const ProfiledReadLockGuard&) = delete;
+    ProfiledReadLockGuard& operator=(const ProfiledReadLockGuard&) = delete;
+
+private:
+    ProfiledMutex<Mutex>& mtx_;
+    LockSite* site_;
+    std::chrono::steady_clock::time_point lockedAt_;
+};
+
+template <class Mutex>
+Mutex& LockAt(Mutex& mtx, LockSite* site) {
+    mtx.Lock(site);
+    return mtx;
+}
+
+typedef ProfiledMutex<std::mutex> LicsMutex;
+typedef std::condition_variable_any LicsCondVar; // std::condition_variable takes std::mutex only
+
+#define LICS_LOCK_GUARD(guard, mtx) \
+    std::lock_guard<decltype(mtx)> guard(LockAt(mtx, LICS_LOCK_SITE(#mtx)), std::adopt_lock)
+#define LICS_UNIQUE_LOCK(guard, mtx) \
+    std::unique_lock<decltype(mtx)> guard(LockAt(mtx, LICS_LOCK_SITE(#mtx)), std::adopt_lock)
+#define LICS_READ_LOCK_GUARD(guard, mtx) \
+    ProfiledReadLockGuard<RWMutex> guard(mtx, LICS_LOCK_SITE(#mtx))
+
+#else
+
+typedef std::mutex LicsMutex;
+typedef std::condition_variable LicsCondVar;
+
+#define LICS_LOCK_GUARD(guard, mtx) std::lock_guard<decltype(mtx)> guard(mtx)
+#define LICS_UNIQUE_LOCK(guard, mtx) std::unique_lock<decltype(mtx)> guard(mtx)
+#define LICS_READ_LOCK_GUARD(guard, mtx) ReadLockGuard guard(mtx)
+
+#endif
+
+#endif
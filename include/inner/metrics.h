@@ -0,0 +1,110 @@
+#ifndef LICENSE_METRICS_HH
+#define LICENSE_METRICS_HH
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define METRICS_SHARDS  (8) // threads share a shard once there are more of them
+#define METRICS_CACHE_LINE  (64)
+
+// MetricsCounter only grows. every thread adds to a shard of its own, so recording is one
+// uncontended relaxed add, and reading sums the shards up.
+class MetricsCounter {
+public:
+    // c++11 new does not honor the alignment of the shards, these do.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
+    void Add(long num = 1);
+    long Value() const;
+
+private:
+    struct alignas(METRICS_CACHE_LINE) Shard {
+        std::atomic<long> value{0};
+    };
+    Shard shards_[METRICS_SHARDS];
+};
+
+/*
+* LatencyHistogram keeps nanoseconds in log-linear buckets like HdrHistogram does: every power of
+* two is split into HISTOGRAM_SUB_BUCKETS linear buckets, so a percentile is off by 1/16 at most,
+* whatever the magnitude. like MetricsCounter it is sharded per thread and never locks.
+*/
+#define HISTOGRAM_SUB_BITS  (4)
+#define HISTOGRAM_SUB_BUCKETS   (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS  (42) // about 73 minutes, longer is counted in the last bucket
+#define HISTOGRAM_BUCKETS   (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1))
+
+class LatencyHistogram {
+public:
+    struct Snapshot {
+        long count{0};
+        long sum{0};
+        std::vector<long> buckets;
+
+        // lower bound of the bucket the p-th value falls in, p in [0, 1].
+        long Percentile(double p) const;
+    };
+
+    // same as MetricsCounter.
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
+    void Record(long ns);
+    void Snap(Snapshot& snapshot) const;
+
+    static int BucketOf(long ns);
+    static long BucketLowerBound(int bucket);
+
+private:
+    struct alignas(METRICS_CACHE_LINE) Shard {
+        std::atomic<long> sum{0};
+        std::atomic<long> buckets[HISTOGRAM_BUCKETS];
+
+        Shard();
+    };
+    Shard shards_[METRICS_SHARDS];
+};
+
+// records the time from construction to destruction, a null histogram records nothing.
+class MetricsTimer {
+public:
+    explicit MetricsTimer(LatencyHistogram* histogram);
+    ~MetricsTimer();
+
+private:
+    LatencyHistogram* histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+long MetricsSinceNs(std::chrono::steady_clock::time_point start);
+
+/*
+* MetricsRegistry owns every metric of a process and renders them in the prometheus text format.
+* metrics are registered up front and recorded through the returned pointers, which stay valid as
+* long as the registry does, so recording never looks anything up. labels are given preformatted,
+* like rpc="CreateLics".
+*/
+class MetricsRegistry {
+public:
+    MetricsCounter* Counter(const std::string& name, const std::string& labels = "");
+    LatencyHistogram* Histogram(const std::string& name, const std::string& labels = "");
+    void Gauge(const std::string& name, const std::string& labels, std::function<long()> read);
+
+    std::string Render();
+
+private:
+    std::mutex mtx_; // guards registration and rendering, never recording
+    std::map<std::string, std::map<std::string, std::unique_ptr<MetricsCounter>>> counters_; // name, labels
+    std::map<std::string, std::map<std::string, std::unique_ptr<LatencyHistogram>>> histograms_;
+    std::map<std::string, std::map<std::string, std::function<long()>>> gauges_;
+};
+
+#endif
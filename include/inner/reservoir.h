@@ -0,0 +1,47 @@
+#ifndef LICENSE_RESERVOIR_HH
+#define LICENSE_RESERVOIR_HH
+
+#include <atomic>
+#include <cstdint>
+
+// LicsReservoir keeps the video licenses a client leased from server ahead of need.
+// leased and used live in one 64-bit word, so tasks take and put licenses with a single CAS and
+// never block or wait on server. leasing and returning are done by the caller, the reservoir only
+// says how many and keeps books: below the low watermark it asks to be filled up to the high
+// watermark, above the high watermark it asks to give back the surplus.
+// a high watermark of 0 disables the reservoir.
+class LicsReservoir {
+public:
+    LicsReservoir();
+
+    void SetWatermarks(int low, int high);
+    bool Enabled();
+
+    // take up to expected idle licenses, return the number actually taken.
+    int Take(int expected);
+    // put back up to num licenses taken before, return the number actually put back.
+    int Put(int num);
+
+    int Leased();
+    int Used();
+    int Idle(); // negative when server forgot a lease that tasks still use
+
+    int Deficit(); // licenses to lease now, 0 unless idle fell below the low watermark
+    int Surplus(); // idle licenses above the high watermark
+
+    void AddLeased(int num);
+    // take up to num idle licenses out of the lease, return the number taken. caller gives them
+    // back to server, or AddLeased them again if that failed.
+    int Reclaim(int num);
+
+    // server forgot every lease, like after a new token. used licenses stay with tasks and
+    // show up as a deficit, so that they are leased again.
+    void ResetLease();
+
+private:
+    std::atomic<int> low_{0};
+    std::atomic<int> high_{0};
+    std::atomic<uint64_t> state_{0}; // leased in the high half, used in the low half
+};
+
+#endif
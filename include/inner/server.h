@@ -13,6 +13,9 @@
 #include <condition_variable>
 #include <thread>
 #include <list>
+#include <vector>
+#include <chrono>
+#include <functional>
 #include <grpcpp/grpcpp.h>
 #include <grpcpp/health_check_service_interface.h>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
@@ -20,7 +23,16 @@
 #include "license.grpc.pb.h"
 #include "lics_error.h"
 #include "utils.h"
+#include "ledger.h"
+#include "timer_wheel.h"
 #include "lics_interface.h"
+#include "metrics.h"
+#include "cloud_sync.h"
+#include "entitlement.h"
+#include "usage_backlog.h"
+#include "wal.h"
+#include "client_table.h"
+#include "slab_pool.h"
 
 
 using grpc::Server;
@@ -32,12 +44,18 @@ using UnisAlgoLics::CreateLicsRequest;
 using UnisAlgoLics::CreateLicsResponse;
 using UnisAlgoLics::DeleteLicsRequest;
 using UnisAlgoLics::DeleteLicsResponse;
+using UnisAlgoLics::BatchCreateLicsRequest;
+using UnisAlgoLics::BatchCreateLicsResponse;
+using UnisAlgoLics::BatchDeleteLicsRequest;
+using UnisAlgoLics::BatchDeleteLicsResponse;
 using UnisAlgoLics::QueryLicsRequest;
 using UnisAlgoLics::QueryLicsResponse;
 using UnisAlgoLics::GetAuthAccessRequest;
 using UnisAlgoLics::GetAuthAccessResponse;
 using UnisAlgoLics::KeepAliveRequest;
 using UnisAlgoLics::KeepAliveResponse;
+using UnisAlgoLics::GetMetricsRequest;
+using UnisAlgoLics::GetMetricsResponse;
 using UnisAlgoLics::License;
 using UnisAlgoLics::Algorithm;
 using UnisAlgoLics::TaskType;
@@ -48,6 +66,19 @@ enum LicsServerEventType {
     EXIT = 0,
 };
 
+// rpcs timed by server, index of their latency histogram.
+enum LicsServerRpc {
+    RPC_CREATE_LICS = 0,
+    RPC_DELETE_LICS,
+    RPC_BATCH_CREATE_LICS,
+    RPC_BATCH_DELETE_LICS,
+    RPC_QUERY_LICS,
+    RPC_GET_AUTH_ACCESS,
+    RPC_KEEP_ALIVE,
+    RPC_KEEP_ALIVE_STREAM, // one per message
+    RPC_NUM,
+};
+
 class LicsServerEvent {
 public:
     LicsServerEvent(LicsServerEventType type) : type_(type) {}
@@ -58,35 +89,82 @@ private:
     LicsServerEventType type_;
 };
 
+// per-algorithm state of a client, indexed by ledger slot.
+struct ClientSlot {
+    std::atomic<int> held{0}; // licenses granted to client
+    std::atomic<int> reserved{0}; // licenses leased into client reservoir
+    int maxLimit{0}; // as client registered it
+    bool registered{false}; // client registered the algorithm
+};
+
+#define CLIENT_INLINE_SLOTS (8) // slots kept inside the client, a larger catalog gets an array of its own
+
+/*
+* a client keeps one ClientSlot per ledger algorithm in a single array, the ledger catalog is fixed
+* before any client is built. license calls take the slot of the ledger entry, not the algorithm id.
+* up to CLIENT_INLINE_SLOTS the array is part of the client, so it lives in the same pool block.
+*/
 class Client {
 
 public:
-    Client(long token, std::map<long, std::shared_ptr<AlgoLics>> algo);
-    void AddLics(long algoID, int num);
-    void DecLics(long algoID, int num);
+    Client(long token, const LicsLedger& ledger);
+    void Register(int slot, int maxLimit);
+    int Slots();
+    bool Registered(int slot);
+    int MaxLimit(int slot);
+    void AddLics(int slot, int num);
+    int DecLics(int slot, int num); // return the number actually taken back, never below zero.
+    int DrainLics(int slot); // take back all licenses of the algorithm
+    int HeldLics(int slot);
+    // same as above, for licenses leased into client reservoir.
+    void AddReserved(int slot, int num);
+    int DecReserved(int slot, int num);
+    int DrainReserved(int slot);
+    int ReservedLics(int slot);
+    void MarkEvicted();
+    bool Evicted();
     long GetToken();
     long GetLatestTimestamp();
-    bool Alive();
+    long Deadline(); // time after which the client is treated as dead
     void UpdateTimestamp();
-    int HeartbeatTimeoutCnt();
-    void IncHeartbeatTimeoutCnt();
-    void ZeroHeartbeatTimeoutCnt();
-    bool HaveAlgoID(long algoID);
-    std::map<long, std::shared_ptr<AlgoLics>> Algos();
+    void Expire(long now); // treat client as dead from now on, until next heartbeat
+    long ArmedDeadline(); // deadline the heartbeat wheel holds for client
+    void SetArmedDeadline(long deadline);
 
 private:
     long clientToken {-1};
-    long timestamp{0};
-    int continusKeepAliveFailedCnt {0};
-    std::map<long, std::shared_ptr<AlgoLics>> algo; // key is algorithm id
+    std::atomic<long> timestamp{0};
+    long armedDeadline{0}; // guarded by server license lock, other wheel entries of client are stale.
+    std::atomic<bool> evicted{false};
+    int slotNum{0};
+    ClientSlot inlineSlots[CLIENT_INLINE_SLOTS];
+    std::unique_ptr<ClientSlot[]> moreSlots; // only when the ledger has more than CLIENT_INLINE_SLOTS
+    ClientSlot* slots; // index is ledger slot, inlineSlots or moreSlots
+};
+
+// state of one KeepAliveStream, the token is resolved on the first message only.
+struct KeepAliveSession {
+    long token{-1};
+    std::shared_ptr<Client> client;
+    bool answered{false}; // first message is always answered
+    long version{0}; // version of the last heartbeat applied
+    std::map<long, AlgoLics> lics; // key is algorithm id, picture algorithms as client reported them.
+    std::map<long, int> shares; // key is algorithm id, picture shares last pushed to client.
+    int heartbeatIntervalMs{0}; // interval last pushed to client
 };
 
 class LicsServer : public License::Service {
+friend class LicsAsyncServer; // serves the same handlers over completion queues.
+friend class AsyncKeepAliveStreamCall;
 public:
 LicsServer();
+// walDir overrides conf item wal_dir, an empty one turns the WAL off.
+explicit LicsServer(const std::string& walDir);
 ~LicsServer();
 
+// stop housekeeping and the grpc server set by OnShutdown, if any. may be called more than once.
 void Shutdown();
+void OnShutdown(std::function<void()> stop);
 
 Status CreateLics(ServerContext* context, 
                 const CreateLicsRequest* request, 
@@ -94,6 +172,12 @@ Status CreateLics(ServerContext* context,
 Status DeleteLics(ServerContext* context, 
                 const DeleteLicsRequest* request, 
                 DeleteLicsResponse* response) override;
+Status BatchCreateLics(ServerContext* context,
+                const BatchCreateLicsRequest* request,
+                BatchCreateLicsResponse* response) override;
+Status BatchDeleteLics(ServerContext* context,
+                const BatchDeleteLicsRequest* request,
+                BatchDeleteLicsResponse* response) override;
 Status QueryLics(ServerContext* context, 
                 const QueryLicsRequest* request, 
                 QueryLicsResponse* response) override;
@@ -103,20 +187,50 @@ Status GetAuthAccess(ServerContext* context,
 Status KeepAlive(ServerContext* context, 
             const KeepAliveRequest* request, 
             KeepAliveResponse* response) override;
+Status KeepAliveStream(ServerContext* context,
+            grpc::ServerReaderWriter<KeepAliveResponse, KeepAliveRequest>* stream) override;
+Status GetMetrics(ServerContext* context,
+            const GetMetricsRequest* request,
+            GetMetricsResponse* response) override;
 
 private:
     long newClientToken();
-    int licsAlloc(long token, long algoID, int expected);
-    int licsFree(long token, long algoID, int expected);
+    int licsAlloc(long token, long algoID, int expected, bool reservoir = false);
+    int licsAlloc(const std::shared_ptr<Client>& client, long algoID, int expected, bool reservoir = false);
+    int licsFree(long token, long algoID, int expected, bool reservoir = false);
+    int licsFree(const std::shared_ptr<Client>& client, long algoID, int expected, bool reservoir = false);
+    void evictClientLics(const std::shared_ptr<Client>& client);
     void doLoop();
+    bool syncTotalFromCloud(); // false when nothing came back, totals are left as they are
+    bool syncUsedToCloud(); // false when the backlog could not be uploaded, it is kept for the next push
+    // housekeeping hands cloud sync over to cloud_, these never wait on the network.
+    void requestCloudFetch();
+    void requestCloudPush();
+
+    // periodic work of doLoop, each task has its own period and runs when it comes due.
+    struct HousekeepingTask {
+        void (LicsServer::*run)();
+        std::chrono::milliseconds period;
+        std::chrono::steady_clock::time_point due;
+    };
+    void addHousekeepingTask(void (LicsServer::*run)(), const std::string& confKey, int defSec);
+    // bring clients and their licenses back from the wal, before anything is served.
+    void recoverClients();
+    void checkpointWal();
+    void walSync(); // an rpc that changed allocations answers once its records are on disk
+    std::shared_ptr<Client> newClient(long token);
 
     void signalExit();
-    std::shared_ptr<LicsServerEvent> dequeue();
+    std::shared_ptr<LicsServerEvent> dequeue(std::chrono::steady_clock::time_point deadline);
     void enqueue(std::shared_ptr<LicsServerEvent> t);
     bool empty();
     bool gotExitSignal(std::shared_ptr<LicsServerEvent> t);
-    void serverClearDeadClients();
-    void clientTellServerStillAlive(long token);
+    std::shared_ptr<Client> findClient(long token);
+    std::shared_ptr<Client> clientTellServerStillAlive(long token);
+    int pictureShare(const std::shared_ptr<Client>& client, const AlgoLics& lics);
+    void heartbeatPace(long token, int& intervalMs, int& jitterMs);
+    void registerClientAlgos(std::shared_ptr<Client> client, int delta);
+    void registerMetrics();
 
     void print();
 
@@ -124,12 +238,21 @@ protected:
     // TEST-Class call following functions to verify data correct.
     Status createLics(const CreateLicsRequest* request, CreateLicsResponse* response);
     Status deleteLics(const DeleteLicsRequest* request, DeleteLicsResponse* response);
+    Status batchCreateLics(const BatchCreateLicsRequest* request, BatchCreateLicsResponse* response);
+    Status batchDeleteLics(const BatchDeleteLicsRequest* request, BatchDeleteLicsResponse* response);
     Status queryLics(const QueryLicsRequest* request, QueryLicsResponse* response);
     Status getAuthAccess(const GetAuthAccessRequest* request,  GetAuthAccessResponse* response);
     Status keepAlive(const KeepAliveRequest* request, KeepAliveResponse* response);
+    // return true if response needs to be sent, that is on first message and whenever a share or the heartbeat interval changed.
+    bool keepAliveStream(KeepAliveSession& session, const KeepAliveRequest* request, KeepAliveResponse* response);
+    void keepAliveStreamBroken(KeepAliveSession& session);
+    Status getMetrics(const GetMetricsRequest* request, GetMetricsResponse* response);
     void licsQuery(long token, long algoID, int& total, int& used);
     int totalClientNum();
     int clientNumByAlgoID(long algoID);
+    int reservedLicsByAlgoID(long algoID);
+    void serverClearDeadClients();
+    void serverClearDeadClients(long currentSysTime);
 
     // TEST-Class will override the following methods.
     virtual void updateLocalLics(const std::map<long, std::shared_ptr<AlgoLics>>& remote);
@@ -138,15 +261,56 @@ protected:
     virtual void fetchAlgosTotalLicFromCloud(std::map<long, std::shared_ptr<AlgoLics>>& remote);
 
 private:
-    std::atomic<long> tokenBase_{0};
-    std::map<long,std::shared_ptr<Client>> clientQ; // key is user token.
-    std::map<long, std::shared_ptr<AlgoLics>> licenseQ; // key is algorithm id.
-    std::mutex exclusive_write_or_read_server_license; // used to prevent multiple thread read or write licenseQ and clientQ
+    std::atomic<long> tokenBase_; // seeded from start time, so a restarted server never reissues a token
+    std::shared_ptr<SlabPool> clientPool_; // Client objects and their control blocks, recycled after eviction
+    ClientTable clientQ; // key is user token.
+    std::atomic<int> clientNum_{0}; // size of clientQ, read without the lock to pace heartbeats.
+    TimerWheel heartbeatWheel_; // heartbeat deadline of every client in clientQ, guarded by the same lock.
+    LicsLedger ledger_; // license counters of all algorithms, lock free.
+    LicsRWMutex exclusive_write_or_read_server_license; // guard clientQ only, lookups take the read side.
     std::atomic<bool> running_{true};
+    int reservoirCeiling_; // max licenses one client may lease into its reservoir, per algorithm.
+    int heartbeatIntervalMs_; // heartbeat interval while server is not busy
+    int heartbeatBusyClients_; // above this many clients the interval grows with the client count
 
     std::list<std::shared_ptr<LicsServerEvent>> event_;
-    std::mutex exclusive_write_or_read_event;
-    std::condition_variable cv_of_event_;
+    LicsMutex exclusive_write_or_read_event;
+    LicsCondVar cv_of_event_;
+
+    std::vector<HousekeepingTask> tasks_; // fixed before doLoop starts, touched by doLoop only.
+    std::thread loop_;
+    std::mutex stopServingMtx_;
+    std::function<void()> stopServing_; // shuts down the grpc server serving the handlers
+    std::unique_ptr<CloudSyncWorker> cloud_; // created before loop_ starts, gone after it stops
+    // touched by cloud_ only: validators of the last entitlement document, what it was parsed into,
+    // and the totals last handed to updateLocalLics.
+    std::string cloudETag_;
+    size_t cloudReplyHash_{0};
+    std::map<long, std::shared_ptr<AlgoLics>> cloudTotals_;
+    std::map<long, int> appliedTotals_;
+    EntitlementParser entitlement_; // which cloud license class feeds which algorithm, fixed after construction
+    UsageBacklog usage_; // filled up by housekeeping, drained by cloud_
+    int usagePushRetries_;
+    std::unique_ptr<LicsWal> wal_; // null unless wal_dir is set, fixed after construction
+
+    // metrics are registered in the constructor, recording goes through these pointers without a lookup.
+    struct AlgoMetrics {
+        MetricsCounter* granted;
+        MetricsCounter* denied;
+    };
+    MetricsRegistry metrics_;
+    LatencyHistogram* rpcLatency_[RPC_NUM];
+    LatencyHistogram* clientReadLockWait_; // wait for the read side of exclusive_write_or_read_server_license
+    LatencyHistogram* clientWriteLockWait_;
+    LatencyHistogram* cloudFetchLatency_;
+    LatencyHistogram* cloudPushLatency_;
+    LatencyHistogram* walSyncWait_; // rpcs waiting for their records to be on disk
+    MetricsCounter* clientsRegistered_;
+    MetricsCounter* clientsEvicted_;
+    MetricsCounter* cloudFetchFailures_;
+    MetricsCounter* cloudFetchUnchanged_;
+    MetricsCounter* cloudPushFailures_;
+    std::map<long, AlgoMetrics> algoMetrics_; // key is algorithm id, same keys as ledger, never modified after construction.
 };
 
 void RunServer();
@@ -0,0 +1,82 @@
+#ifndef LICENSE_SLAB_POOL_HH
+#define LICENSE_SLAB_POOL_HH
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#define SLAB_POOL_BLOCKS    (256) // blocks carved out of one slab
+
+/*
+* SlabPool hands out blocks of one size carved from slabs of SLAB_POOL_BLOCKS blocks, a freed
+* block goes on a free list and is handed out again, slabs are only freed with the pool. the
+* block size is taken from the first request, requests of any other size go to operator new.
+* thread-safe.
+*/
+class SlabPool {
+public:
+    SlabPool() = default;
+    ~SlabPool();
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    void* Alloc(size_t size);
+    void Free(void* block, size_t size);
+
+    size_t Slabs();
+    size_t FreeBlocks();
+
+private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    std::mutex mtx_;
+    size_t objectSize_{0}; // size of the first request, the only one pooled
+    size_t blockSize_{0}; // objectSize_ rounded up for alignment
+    FreeBlock* free_{nullptr};
+    size_t freeBlocks_{0};
+    std::vector<char*> slabs_;
+};
+
+/*
+* allocator for std::allocate_shared, so an object and its control block are one block of the
+* pool. every control block keeps a reference to the pool, the pool goes away with the last
+* object it holds, whoever holds that.
+*/
+template <typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+
+    explicit PoolAllocator(const std::shared_ptr<SlabPool>& pool) : pool_(pool) {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) : pool_(other.pool_) {}
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(pool_->Alloc(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        pool_->Free(ptr, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& other) const {
+        return pool_ == other.pool_;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>& other) const {
+        return pool_ != other.pool_;
+    }
+
+private:
+    template <typename U> friend class PoolAllocator;
+
+    std::shared_ptr<SlabPool> pool_;
+};
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef LICENSE_TIMER_WHEEL_HH
+#define LICENSE_TIMER_WHEEL_HH
+
+#include <vector>
+#include <cstddef>
+
+// hashed timer wheel with one second resolution, ids are client tokens.
+// Advance only visits the slots between the last call and now, so the cost depends on
+// how many timers come due instead of how many are armed. a deadline further than one
+// revolution stays in its slot until the right round comes.
+// not thread-safe, the caller serializes Add and Advance.
+class TimerWheel {
+public:
+    struct Timer {
+        long id;
+        long deadline;
+    };
+
+    TimerWheel(int slots, long now);
+
+    void Add(long id, long deadline);
+
+    // move the wheel to now and collect every timer whose deadline is not after now.
+    void Advance(long now, std::vector<Timer>& expired);
+
+    size_t Size();
+
+private:
+    std::vector<std::vector<Timer>> slots_;
+    long current_; // the last second processed by Advance
+    size_t size_{0};
+};
+
+#endif
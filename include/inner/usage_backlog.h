@@ -0,0 +1,55 @@
+#ifndef LICENSE_USAGE_BACKLOG_HH
+#define LICENSE_USAGE_BACKLOG_HH
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct AlgoUsage {
+    int total{0};
+    int used{0}; // at the end of the sample
+    int peak{0}; // highest used within the sample
+};
+
+// license usage over [from, to], seconds from epoch. a fresh snapshot has from == to and one merged from n snapshots has n.
+struct UsageSample {
+    long from{0};
+    long to{0};
+    int snapshots{1};
+    std::map<long, AlgoUsage> algos; // key is algorithm id
+
+    // b follows a, the result covers both: latest used and total, highest peak.
+    static UsageSample Merge(const UsageSample& a, const UsageSample& b);
+};
+
+/*
+* UsageBacklog queues usage samples until an upload takes them. it holds capacity samples at most:
+* once full, the two neighbours covering the shortest time are merged into one, so an unreachable
+* cloud costs resolution, not memory, and the loss spreads evenly over the backlog.
+* thread-safe, the lock is only held to move samples in and out.
+*/
+class UsageBacklog {
+public:
+    explicit UsageBacklog(size_t capacity);
+
+    void Add(const UsageSample& sample);
+    // move every queued sample, oldest first, into samples.
+    void Take(std::vector<UsageSample>& samples);
+    // give back samples taken by a failed upload, they are older than anything added since.
+    void PutBack(std::vector<UsageSample>& samples);
+    size_t Size();
+
+    // one compact json body for a batch: {"samples":[{"from":..,"to":..,"snapshots":..,"algos":[{"id":..,"total":..,"used":..,"peak":..}]}]}
+    static std::string Encode(const std::vector<UsageSample>& samples);
+
+private:
+    void shrink();
+
+    size_t capacity_;
+    std::mutex mtx_;
+    std::deque<UsageSample> samples_; // oldest first
+};
+
+#endif
@@ -7,11 +7,20 @@
 #include <mutex>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <pthread.h>
 #include <curl/curl.h>
 
+#include "lock_profile.h"
+
 #define EHTTP_OK    (0)
 #define EHTTP_OPEN_CONN_FAILURE   (100)
 #define EHTTP_GET_FAILURE   (101)
+#define EHTTP_NOT_MODIFIED  (102)
+#define EHTTP_SEND_FAILURE  (103)
+#define EHTTP_BAD_STATUS    (104) // the peer answered, but not with 2xx
+#define HTTP_DEFAULT_CONNECT_TIMEOUT_MS (2000)
+#define HTTP_DEFAULT_TIMEOUT_MS (5000)
 
 
 struct HttpReply {
@@ -20,23 +29,33 @@ struct HttpReply {
 };
 
 // one HttpClient run in one single thread
-// Post/Put/Get is a short-connection-based method, which will do tcp handshake, data transfer and tcp termination whenever calling method.
+// one easy handle is kept for all requests, connections and dns lookups are cached in a curl share, so polls reuse the connection.
 // HttpClient will allocate HttpReply.response, but app layor need to hold the responsability of memory free, like delete HttpReply.response.
 class HttpClient {
 public:
     HttpClient();
     ~HttpClient();
-    int Post(const std::string& url, HttpReply& reply);
-    int Put(const std::string& url, HttpReply& reply);
+    // send body as json, reply takes the response body. a non-2xx answer is EHTTP_BAD_STATUS.
+    int Post(const std::string& url, const std::string& body, std::string& reply);
+    int Put(const std::string& url, const std::string& body, std::string& reply);
     int Get(const std::string& url, std::string& reply);
+    // conditional GET, sends If-None-Match when etag is not empty. returns EHTTP_NOT_MODIFIED and
+    // leaves reply alone if the document is unchanged, otherwise etag takes the one of the response.
+    int Get(const std::string& url, std::string& reply, std::string& etag);
+    // bound every request from now on, the whole request included. zero waits forever.
+    void SetTimeout(long connectMs, long totalMs);
 private:
     bool connIsOpened();
     int openConn();
     void closeConn();
+    int send(const char* method, const std::string& url, const std::string& body, std::string& reply);
 private:
     bool connOpened{false};
     CURL** ppCurlHandle{nullptr};
-    std::mutex execlusive_op_protect;
+    CURLSH* share_{nullptr};
+    LicsMutex execlusive_op_protect;
+    std::atomic<long> connectTimeoutMs_{HTTP_DEFAULT_CONNECT_TIMEOUT_MS};
+    std::atomic<long> timeoutMs_{HTTP_DEFAULT_TIMEOUT_MS};
 };
 
 class ServerConf {
@@ -44,6 +63,8 @@ public:
     ServerConf(const std::string& file);
 
     std::string GetItem(const std::string& key);
+    // return def if key is absent or not a number.
+    int GetIntItem(const std::string& key, int def);
 
 private:
     // trim all space and newline(\r\n or \r) characters
@@ -56,6 +77,43 @@ private:
 
 };
 
+// reader-writer lock on top of pthread_rwlock_t, cause c++11 has no std::shared_mutex.
+// lock/unlock take the write side, so std::lock_guard<RWMutex> works as an exclusive lock.
+class RWMutex {
+public:
+    RWMutex();
+    ~RWMutex();
+
+    void lock();
+    bool try_lock();
+    void unlock();
+    void lock_shared();
+    bool try_lock_shared();
+    void unlock_shared();
+
+private:
+    pthread_rwlock_t rwlock_;
+};
+
+// scoped read side of RWMutex, like std::shared_lock in c++14.
+class ReadLockGuard {
+public:
+    explicit ReadLockGuard(RWMutex& mtx) : mtx_(mtx) { mtx_.lock_shared(); }
+    ~ReadLockGuard() { mtx_.unlock_shared(); }
+
+    ReadLockGuard(const ReadLockGuard&) = delete;
+    ReadLockGuard& operator=(const ReadLockGuard&) = delete;
+
+private:
+    RWMutex& mtx_;
+};
+
+#ifdef LICS_LOCK_PROFILE
+typedef ProfiledMutex<RWMutex> LicsRWMutex;
+#else
+typedef RWMutex LicsRWMutex;
+#endif
+
 std::shared_ptr<HttpClient> getHttpClient();
 
 std::shared_ptr<ServerConf> getServerConf();
@@ -0,0 +1,97 @@
+#ifndef LICENSE_WAL_HH
+#define LICENSE_WAL_HH
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum WalRecordType {
+    WAL_REGISTER = 1,
+    WAL_EVICT,
+    WAL_GRANT,
+    WAL_FREE,
+};
+
+// allocation state of one client as far as the log knows it.
+struct WalClient {
+    std::map<long, std::string> algos; // key is algorithm id, value a serialized AlgoLics the client registered
+    std::map<long, long> held; // key is algorithm id, signed while replaying, records of racing threads may come out of order
+    std::map<long, long> reserved;
+};
+
+struct WalState {
+    long tokenBase{0}; // highest token ever registered, live or not
+    std::map<long, WalClient> clients; // key is token
+
+    // apply one encoded record, false if it does not decode.
+    bool Apply(const char* data, size_t size);
+};
+
+/*
+* LicsWal makes the allocation state of clients survive a restart. every registration, eviction,
+* grant and free is appended as a delta record, deltas commute, so appends of racing threads need
+* no order. records are written and fdatasync-ed by a flusher thread in groups: whatever piles up
+* while one sync runs goes out with the next one, and Sync waits for the group holding everything
+* appended so far.
+*
+* the log is cut in segments, wal.<seq>. Checkpoint closes the current segment and folds it into
+* the snapshot, which is state replayed from the log only, so it never reads or locks live state.
+* the folded segments are deleted then. recovery loads the snapshot and replays the segments left,
+* a torn record at the end of the last one is where the log ends.
+*/
+class LicsWal {
+public:
+    explicit LicsWal(const std::string& dir);
+    ~LicsWal();
+
+    // load what is on disk into state and start the log, once, before anything is appended.
+    // return false if dir can not be used, nothing is logged then.
+    bool Recover(WalState& state);
+
+    // algos: algorithm id to serialized AlgoLics
+    void Register(long token, const std::map<long, std::string>& algos);
+    void Evict(long token);
+    void Grant(long token, long algoID, int num, bool reservoir);
+    void Free(long token, long algoID, int num, bool reservoir);
+
+    // wait until every record appended before the call is on disk.
+    void Sync();
+    // fold closed segments into a new snapshot, run by one thread at a time.
+    bool Checkpoint();
+
+    static unsigned Crc32(const char* data, size_t size);
+
+private:
+    void append(const std::string& record);
+    void run();
+    bool openSegment(long seq);
+    std::string segmentPath(long seq);
+    bool replaySegment(long seq, WalState& state);
+    bool loadSnapshot(WalState& state, long& nextSeq);
+    bool writeSnapshot(const WalState& state, long nextSeq);
+
+    std::string dir_;
+    int fd_{-1}; // current segment, flusher only once the log started
+    long seq_{0}; // of the current segment
+    WalState base_; // state of the snapshot, Checkpoint only
+    long baseNext_{0}; // first segment the snapshot does not hold
+
+    std::mutex mtx_;
+    std::condition_variable cv_; // flusher waits for records or a rotation
+    std::condition_variable synced_; // Sync and Checkpoint wait for the flusher
+    std::string pending_; // encoded records not handed to the flusher yet
+    long appended_{0}; // records appended so far
+    long durable_{0}; // records on disk so far
+    bool rotate_{false}; // next group closes the segment after it
+    long sealed_{-1}; // last closed segment
+    bool stopping_{false};
+    bool started_{false}; // flusher_ runs, set by Recover
+    bool stopped_{false}; // flusher_ is joined, set by the destructor
+    bool failed_{false}; // a write or sync failed, the log stops there
+    std::thread flusher_; // started and joined without mtx_, never read under it
+};
+
+#endif
@@ -19,4 +19,5 @@
 #define ELICS_DUPLICATED_RESOURCE_INIT  (ELICS_BASE + 6)
 #define ELICS_UNITILIZED_RESOURCE  (ELICS_BASE + 7)
 #define ELICS_INVALID_PARAMS  (ELICS_BASE + 8)
+#define ELICS_HEARTBEAT_OUT_OF_SYNC  (ELICS_BASE + 9)
 #endif
\ No newline at end of file
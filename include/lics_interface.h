@@ -29,6 +29,41 @@ int lics_apply(int algoID, const int expectLicsNum, int* actualLicsNum);
 
 int lics_free(int algoID, const int licsNum);
 
+/*
+    keep between lowWatermark and highWatermark idle video licenses of algoID leased ahead of need,
+    lics_apply/lics_free of the algorithm are then served locally. highWatermark 0 turns it off.
+    server caps how many licenses one client may lease.
+*/
+int lics_set_reservoir(int algoID, int lowWatermark, int highWatermark);
+
+/*
+    non-blocking lics_apply/lics_free. the callback gets the same return code and license number the
+    blocking call would, exactly once, and only if ELICS_OK is returned here.
+    video requests are answered on the client completion queue thread, requests served locally
+    (picture, or video with a reservoir) may be answered before the call returns.
+    callbacks must be short and must not call the blocking lics_* functions.
+*/
+typedef void (*lics_apply_cb)(int ret, int algoID, int actualLicsNum, void* userData);
+typedef void (*lics_free_cb)(int ret, int algoID, int licsNum, void* userData);
+
+int lics_apply_async(int algoID, const int expectLicsNum, lics_apply_cb cb, void* userData);
+
+int lics_free_async(int algoID, const int licsNum, lics_free_cb cb, void* userData);
+
+typedef struct LicsBatchItem_s {
+    int algoID;
+    int licsNum; // expected licenses for lics_apply_batch, licenses to give back for lics_free_batch.
+    int actualLicsNum; // filled up by lics_apply_batch/lics_free_batch.
+}LicsBatchItem;
+
+/*
+    apply or free licenses of many algorithms at once, video ones take a single round trip to server.
+    an item with an unknown algorithm id fails the whole call before anything is sent.
+*/
+int lics_apply_batch(LicsBatchItem* items, int size);
+
+int lics_free_batch(LicsBatchItem* items, int size);
+
 void lics_global_cleanup();
 
 
@@ -0,0 +1,277 @@
+#include "async_server.h"
+#include "server.h"
+
+#include <cstddef>
+#include <pthread.h>
+#include <google/protobuf/arena.h>
+
+#include "spdlog/spdlog.h"
+
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerAsyncReaderWriter;
+using grpc::ServerCompletionQueue;
+using UnisAlgoLics::License;
+
+#define ASYNC_SHUTDOWN_GRACE_MS (1000)
+#define ASYNC_CALL_ARENA_BYTES  (1024) // in the call object, fits request and response of every unary rpc but batches
+
+/*
+* one unary rpc: it is armed on a completion queue, served once a request comes in, and
+* deleted after the response is flushed. a new call is armed before serving, so the
+* method always has an outstanding request on every queue, until the server is stopping.
+* request and response live on an arena of the call, whose first block is part of the call
+* object, so parsing the request and building nested messages of the response take no malloc
+* until the block runs out. all of it goes away with the call in one piece.
+*/
+template <class Request, class Response>
+class AsyncUnaryCall : public AsyncCall {
+public:
+    typedef void (License::AsyncService::*RequestFn)(ServerContext*, Request*,
+                ServerAsyncResponseWriter<Response>*, grpc::CompletionQueue*, ServerCompletionQueue*, void*);
+    typedef Status (LicsServer::*HandleFn)(const Request*, Response*);
+
+    AsyncUnaryCall(License::AsyncService* service, ServerCompletionQueue* cq, LicsServer* handler, RequestFn request, HandleFn handle,
+                const std::atomic<bool>* stopping)
+        : service_(service), cq_(cq), handler_(handler), request_(request), handle_(handle), stopping_(stopping), arena_(arenaOptions(arenaBlock_)),
+        req_(google::protobuf::Arena::CreateMessage<Request>(&arena_)), resp_(google::protobuf::Arena::CreateMessage<Response>(&arena_)),
+        responder_(&ctx_) {
+        (service_->*request_)(&ctx_, req_, &responder_, cq_, cq_, this);
+    }
+
+    void Proceed(bool ok) override {
+        if (finished_ || !ok) {
+            // response flushed, or queue shut down before any request came.
+            delete this;
+            return;
+        }
+
+        if (!*stopping_) {
+            new AsyncUnaryCall<Request, Response>(service_, cq_, handler_, request_, handle_, stopping_);
+        }
+
+        Status status = (handler_->*handle_)(req_, resp_);
+        finished_ = true;
+        responder_.Finish(*resp_, status, this);
+    }
+
+private:
+    static google::protobuf::ArenaOptions arenaOptions(char* block) {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = ASYNC_CALL_ARENA_BYTES;
+        return options;
+    }
+
+private:
+    License::AsyncService* service_;
+    ServerCompletionQueue* cq_;
+    LicsServer* handler_;
+    RequestFn request_;
+    HandleFn handle_;
+    const std::atomic<bool>* stopping_;
+
+    alignas(std::max_align_t) char arenaBlock_[ASYNC_CALL_ARENA_BYTES]; // must outlive arena_
+    google::protobuf::Arena arena_;
+    ServerContext ctx_;
+    Request* req_; // owned by arena_
+    Response* resp_; // owned by arena_
+    ServerAsyncResponseWriter<Response> responder_;
+    bool finished_{false};
+};
+
+/*
+* one KeepAliveStream: read a heartbeat, write a response when the handler wants one, read again.
+* only one operation is outstanding at a time, so the call object is the tag of all of them.
+* a stream broken by server shutdown is cancelled already, it is deleted without a Finish, which
+* could come after its queue was shut down.
+*/
+class AsyncKeepAliveStreamCall : public AsyncCall {
+public:
+    AsyncKeepAliveStreamCall(License::AsyncService* service, ServerCompletionQueue* cq, LicsServer* handler,
+                const std::atomic<bool>* stopping)
+        : service_(service), cq_(cq), handler_(handler), stopping_(stopping), stream_(&ctx_) {
+        service_->RequestKeepAliveStream(&ctx_, &stream_, cq_, cq_, this);
+    }
+
+    void Proceed(bool ok) override {
+        switch (state_) {
+        case CONNECT:
+            if (!ok) {
+                delete this;
+                return;
+            }
+            if (!*stopping_) {
+                new AsyncKeepAliveStreamCall(service_, cq_, handler_, stopping_);
+            }
+            read();
+            return;
+        case READ:
+            if (!ok) {
+                finish(); // client closed or stream broken
+                return;
+            }
+            resp_.Clear();
+            if (handler_->keepAliveStream(session_, &req_, &resp_)) {
+                state_ = WRITE;
+                stream_.Write(resp_, this);
+                return;
+            }
+            read();
+            return;
+        case WRITE:
+            if (!ok) {
+                finish();
+                return;
+            }
+            read();
+            return;
+        case FINISH:
+            delete this;
+            return;
+        }
+    }
+
+private:
+    void read() {
+        state_ = READ;
+        stream_.Read(&req_, this);
+    }
+
+    void finish() {
+        handler_->keepAliveStreamBroken(session_);
+        if (*stopping_) {
+            delete this;
+            return;
+        }
+        state_ = FINISH;
+        stream_.Finish(Status::OK, this);
+    }
+
+private:
+    enum State { CONNECT, READ, WRITE, FINISH };
+
+    License::AsyncService* service_;
+    ServerCompletionQueue* cq_;
+    LicsServer* handler_;
+    const std::atomic<bool>* stopping_;
+
+    ServerContext ctx_;
+    ServerAsyncReaderWriter<KeepAliveResponse, KeepAliveRequest> stream_;
+    KeepAliveSession session_;
+    KeepAliveRequest req_;
+    KeepAliveResponse resp_;
+    State state_{CONNECT};
+};
+
+LicsAsyncServer::LicsAsyncServer(LicsServer* handler, int cqNum, int pollerNum, const std::vector<int>& cpus)
+    : handler_(handler), cqNum_(cqNum > 0 ? cqNum : 1), pollerNum_(pollerNum > 0 ? pollerNum : 1), cpus_(cpus) {
+
+}
+
+LicsAsyncServer::~LicsAsyncServer() {
+    Shutdown();
+    for (auto& t : pollers_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+
+    // queues must be drained before they go, pollers did unless Run never started them.
+    void* tag = nullptr;
+    bool ok = false;
+    for (auto& cq : cqs_) {
+        while (cq->Next(&tag, &ok)) {
+            delete static_cast<AsyncCall*>(tag);
+        }
+    }
+}
+
+bool LicsAsyncServer::BuildAndStart(grpc::ServerBuilder& builder) {
+    builder.RegisterService(&service_);
+    for (int idx = 0; idx < cqNum_; ++idx) {
+        cqs_.push_back(builder.AddCompletionQueue());
+    }
+
+    server_ = builder.BuildAndStart();
+    return server_ != nullptr;
+}
+
+void LicsAsyncServer::armAll(ServerCompletionQueue* cq) {
+    new AsyncUnaryCall<CreateLicsRequest, CreateLicsResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestCreateLics, &LicsServer::createLics, &stopping_);
+    new AsyncUnaryCall<DeleteLicsRequest, DeleteLicsResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestDeleteLics, &LicsServer::deleteLics, &stopping_);
+    new AsyncUnaryCall<BatchCreateLicsRequest, BatchCreateLicsResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestBatchCreateLics, &LicsServer::batchCreateLics, &stopping_);
+    new AsyncUnaryCall<BatchDeleteLicsRequest, BatchDeleteLicsResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestBatchDeleteLics, &LicsServer::batchDeleteLics, &stopping_);
+    new AsyncUnaryCall<QueryLicsRequest, QueryLicsResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestQueryLics, &LicsServer::queryLics, &stopping_);
+    new AsyncUnaryCall<GetAuthAccessRequest, GetAuthAccessResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestGetAuthAccess, &LicsServer::getAuthAccess, &stopping_);
+    new AsyncUnaryCall<KeepAliveRequest, KeepAliveResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestKeepAlive, &LicsServer::keepAlive, &stopping_);
+    new AsyncUnaryCall<GetMetricsRequest, GetMetricsResponse>(&service_, cq, handler_,
+                &License::AsyncService::RequestGetMetrics, &LicsServer::getMetrics, &stopping_);
+    new AsyncKeepAliveStreamCall(&service_, cq, handler_, &stopping_);
+}
+
+void LicsAsyncServer::poll(ServerCompletionQueue* cq, int cpu) {
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (ret != 0) {
+            SPDLOG_WARN("failed to pin poller to cpu({0}):{1}", cpu, ret);
+        }
+    }
+
+    void* tag = nullptr;
+    bool ok = false;
+    while (cq->Next(&tag, &ok)) {
+        static_cast<AsyncCall*>(tag)->Proceed(ok);
+    }
+}
+
+void LicsAsyncServer::Run() {
+    if (!server_) {
+        return;
+    }
+
+    for (auto& cq : cqs_) {
+        armAll(cq.get());
+    }
+
+    int pollerIdx = 0;
+    for (auto& cq : cqs_) {
+        for (int idx = 0; idx < pollerNum_; ++idx, ++pollerIdx) {
+            int cpu = cpus_.empty() ? -1 : cpus_[pollerIdx % cpus_.size()];
+            pollers_.push_back(std::thread(&LicsAsyncServer::poll, this, cq.get(), cpu));
+        }
+    }
+    SPDLOG_INFO("async server running: {0} completion queues, {1} pollers per queue", cqNum_, pollerNum_);
+
+    for (auto& t : pollers_) {
+        t.join();
+    }
+    pollers_.clear();
+}
+
+/*
+* grpc wants the server shut down before its completion queues. pollers keep running meanwhile,
+* so calls in flight finish and requested calls come back not ok and delete themselves. Next
+* returns false once a queue is shut down and drained, pollers exit then.
+*/
+void LicsAsyncServer::Shutdown() {
+    if (!server_ || stopped_.exchange(true)) {
+        return;
+    }
+
+    stopping_ = true;
+    server_->Shutdown(std::chrono::system_clock::now() + std::chrono::milliseconds(ASYNC_SHUTDOWN_GRACE_MS));
+    for (auto& cq : cqs_) {
+        cq->Shutdown();
+    }
+    SPDLOG_INFO("async server shut down");
+}
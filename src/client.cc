@@ -1,7 +1,16 @@
 #include "client.h"
 
+#include <future>
+
+#define CLIENT_HEARTBEAT_INTERVAL_MS    (10000) // until server tells otherwise
+#define CLIENT_RECONNECT_BASE_MS    (100) // first backoff window
+#define CLIENT_RECONNECT_MAX_MS (10000) // backoff cap
+#define CLIENT_RECONNECT_SPREAD_MS  (1000) // reconnects of a channel turned ready spread over this
+#define CLIENT_CHANNEL_WATCH_MS (1000) // bounds how long shutdown waits for a pending watch
+
 std::atomic<bool> clientStartup_{false};
 std::shared_ptr<LicsClient> licsClient_ = nullptr;
+static std::atomic<int> liveClients_{0}; // clients of a process share the logger, the last one shuts it down
 
 const char*lics_version() {
     return "UNIS_LICS_CLIENT_V1.0.0";
@@ -51,7 +60,7 @@ int lics_global_init(const char* remote, AlgoCapability* algoLics, int size) {
     return ELICS_OK;
 }
 
-int lics_apply(int algoID, const int expectLicsNum, int* actualLicsNum) {
+int lics_apply_async(int algoID, const int expectLicsNum, lics_apply_cb cb, void* userData) {
     if (!clientStartup_) {
         return ELICS_UNITILIZED_RESOURCE;
     }
@@ -68,18 +77,12 @@ int lics_apply(int algoID, const int expectLicsNum, int* actualLicsNum) {
     createReq.mutable_algo()->set_algorithmid(algoID);
     createReq.set_clientexpectedlicsnum(expectLicsNum);
 
-    CreateLicsResponse createResp;
-    ret = licsClient_->CreateLics(createReq, createResp);
-    if (ret != ELICS_OK) {
-        return ret;
-    }
-
-    *actualLicsNum = createResp.clientgetactuallicsnum();
-
-    return ret;
+    return licsClient_->CreateLicsAsync(createReq, [=](int ret, CreateLicsResponse& resp) {
+        cb(ret, algoID, resp.clientgetactuallicsnum(), userData);
+    });
 }
 
-int lics_free(int algoID, const int licsNum) {
+int lics_free_async(int algoID, const int licsNum, lics_free_cb cb, void* userData) {
     if (!clientStartup_) {
         return ELICS_UNITILIZED_RESOURCE;
     }
@@ -96,9 +99,124 @@ int lics_free(int algoID, const int licsNum) {
     deleteReq.mutable_algo()->set_algorithmid(algoID);
     deleteReq.set_licsnum(licsNum);
 
-    DeleteLicsResponse deleteResp;
+    return licsClient_->DeleteLicsAsync(deleteReq, [=](int ret, DeleteLicsResponse& resp) {
+        cb(ret, algoID, resp.licsnum(), userData);
+    });
+}
+
+// blocking calls wait for their async counterpart, which is answered on the completion queue thread.
+struct LicsSyncResult {
+    std::promise<int> ret;
+    int licsNum{0};
+};
+
+static void licsSyncDone(int ret, int algoID, int licsNum, void* userData) {
+    LicsSyncResult* result = static_cast<LicsSyncResult*>(userData);
+    result->licsNum = licsNum;
+    result->ret.set_value(ret);
+}
+
+int lics_apply(int algoID, const int expectLicsNum, int* actualLicsNum) {
+    LicsSyncResult result;
+    std::future<int> done = result.ret.get_future();
+    int ret = lics_apply_async(algoID, expectLicsNum, licsSyncDone, &result);
+    if (ret != ELICS_OK) {
+        return ret;
+    }
+
+    ret = done.get();
+    if (ret != ELICS_OK) {
+        return ret;
+    }
+
+    *actualLicsNum = result.licsNum;
+
+    return ret;
+}
+
+int lics_set_reservoir(int algoID, int lowWatermark, int highWatermark) {
+    if (!clientStartup_) {
+        return ELICS_UNITILIZED_RESOURCE;
+    }
+
+    return licsClient_->SetReservoir(algoID, lowWatermark, highWatermark);
+}
+
+int lics_free(int algoID, const int licsNum) {
+    LicsSyncResult result;
+    std::future<int> done = result.ret.get_future();
+    int ret = lics_free_async(algoID, licsNum, licsSyncDone, &result);
+    if (ret != ELICS_OK) {
+        return ret;
+    }
+
+    return done.get();
+}
+
+int lics_apply_batch(LicsBatchItem* items, int size) {
+    if (!clientStartup_) {
+        return ELICS_UNITILIZED_RESOURCE;
+    }
+
+    BatchCreateLicsRequest batchReq;
+    for (int idx = 0; idx < size; ++idx) {
+        TaskType type;
+        int ret = licsClient_->GetTaskTypeFromAlgoID(items[idx].algoID, type);
+        if (ret != ELICS_OK) {
+            return ret;
+        }
+
+        CreateLicsRequest* createReq = batchReq.add_items();
+        createReq->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+        createReq->mutable_algo()->set_type(type);
+        createReq->mutable_algo()->set_algorithmid(items[idx].algoID);
+        createReq->set_clientexpectedlicsnum(items[idx].licsNum);
+    }
+
+    BatchCreateLicsResponse batchResp;
+    int ret = licsClient_->BatchCreateLics(batchReq, batchResp);
+    if (ret != ELICS_OK) {
+        return ret;
+    }
+
+    for (int idx = 0; idx < size && idx < batchResp.items_size(); ++idx) {
+        items[idx].actualLicsNum = batchResp.items(idx).clientgetactuallicsnum();
+    }
+
+    return ret;
+}
+
+int lics_free_batch(LicsBatchItem* items, int size) {
+    if (!clientStartup_) {
+        return ELICS_UNITILIZED_RESOURCE;
+    }
+
+    BatchDeleteLicsRequest batchReq;
+    for (int idx = 0; idx < size; ++idx) {
+        TaskType type;
+        int ret = licsClient_->GetTaskTypeFromAlgoID(items[idx].algoID, type);
+        if (ret != ELICS_OK) {
+            return ret;
+        }
+
+        DeleteLicsRequest* deleteReq = batchReq.add_items();
+        deleteReq->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+        deleteReq->mutable_algo()->set_type(type);
+        deleteReq->mutable_algo()->set_algorithmid(items[idx].algoID);
+        deleteReq->set_licsnum(items[idx].licsNum);
+    }
+
+    BatchDeleteLicsResponse batchResp;
+    int ret = licsClient_->BatchDeleteLics(batchReq, batchResp);
+    if (ret != ELICS_OK) {
+        return ret;
+    }
+
+    for (int idx = 0; idx < size && idx < batchResp.items_size(); ++idx) {
+        items[idx].actualLicsNum = batchResp.items(idx).licsnum();
+    }
 
-    return licsClient_->DeleteLics(deleteReq, deleteResp);
+    return ret;
 }
 
 void lics_global_cleanup() {
@@ -107,9 +225,6 @@ void lics_global_cleanup() {
     }
 
     licsClient_->Stop();
-
-    sleep(1); // make some time to signal thread to exit.
-
     licsClient_.reset();
 
     cleanup_resource_before_client_exit();
@@ -119,12 +234,23 @@ void lics_global_cleanup() {
 
 LicsClient::~LicsClient() {
     running_= false;
+    Stop();
+    closeKeepAliveStream();
+
+    // in-flight rpcs and a pending channel watch still complete, with an error if channel is going away.
+    cq_.Shutdown();
+    if (cqThread_.joinable()) {
+        cqThread_.join();
+    }
+
     SPDLOG_ERROR("got exit, bye");
-    spdlog::shutdown();// exit log
+    if (--liveClients_ == 0) {
+        spdlog::shutdown();// exit log
+    }
 }
 
 int LicsClient::GetTaskTypeFromAlgoID(int algoID, TaskType& type) {
-    //TODO: add lock
+    std::lock_guard<std::mutex> lk(exclusive_write_or_read_cache);
     auto search = cache_.find(algoID);
     if (search != cache_.end()) {
         type = search->second->algo().type();
@@ -134,13 +260,16 @@ int LicsClient::GetTaskTypeFromAlgoID(int algoID, TaskType& type) {
 }
 
 LicsClient::LicsClient(std::shared_ptr<Channel> channel, AlgoCapability* algoLics, int size)
-    : stub_(License::NewStub(channel)) {
-
-    // load log 
-    auto log = spdlog::rotating_logger_mt("client", "/var/unis/license/client/log/log.txt", 1048576 * 5, 3);
-    log->flush_on(spdlog::level::info); //set flush policy 
-    spdlog::set_default_logger(log); // set log to be defalut 
-    spdlog::set_pattern("%Y-%m-%d %H:%M:%S.%e %l [%s:%!:%#] %v"); 
+    : channel_(channel), stub_(License::NewStub(channel)), rng_(std::random_device()()),
+      heartbeatIntervalMs_(CLIENT_HEARTBEAT_INTERVAL_MS) {
+
+    // load log, unless another client of this process did.
+    if (liveClients_++ == 0) {
+        auto log = spdlog::rotating_logger_mt("client", "/var/unis/license/client/log/log.txt", 1048576 * 5, 3);
+        log->flush_on(spdlog::level::info); //set flush policy 
+        spdlog::set_default_logger(log); // set log to be defalut 
+        spdlog::set_pattern("%Y-%m-%d %H:%M:%S.%e %l [%s:%!:%#] %v"); 
+    }
     
     for (int idx = 0; idx < size; ++idx) {
         std::shared_ptr<AlgoLics> lics = std::make_shared<AlgoLics>();
@@ -158,11 +287,202 @@ LicsClient::LicsClient(std::shared_ptr<Channel> channel, AlgoCapability* algoLic
         lics->set_usedlics(0);
         lics->set_maxlimit(algoLics[idx].maxLimit); // TODO: set by app
         cache_[algoLics[idx].algoID] = lics;
+
+        if (algoLics[idx].type == AlgoLicsType::VIDEO) {
+            reservoirs_[algoLics[idx].algoID] = std::unique_ptr<LicsReservoir>(new LicsReservoir());
+            coalescers_[algoLics[idx].algoID] = std::unique_ptr<ApplyCoalescer>(new ApplyCoalescer());
+        }
     }
 
-    // TODO: start a doLoop thread
-    std::thread t(&LicsClient::doLoop, this);
-    t.detach();
+    cqThread_ = std::thread(&LicsClient::pollCompletions, this);
+    loop_ = std::thread(&LicsClient::doLoop, this);
+}
+
+void LicsClient::pollCompletions() {
+    void* tag = nullptr;
+    bool ok = false;
+    // Finish always completes with ok, the rpc status tells whether it worked.
+    while (cq_.Next(&tag, &ok)) {
+        AsyncClientCall* call = static_cast<AsyncClientCall*>(tag);
+        call->Done();
+        delete call;
+    }
+}
+
+void LicsClient::createLicsAsync(CreateLicsRequest& req, AsyncUnaryClientCall<CreateLicsResponse>::DoneFn done) {
+    AsyncUnaryClientCall<CreateLicsResponse>* call = new AsyncUnaryClientCall<CreateLicsResponse>(done);
+    call->reader = stub_->PrepareAsyncCreateLics(&call->ctx, req, &cq_);
+    call->reader->StartCall();
+    call->reader->Finish(&call->resp, &call->status, call);
+}
+
+void LicsClient::deleteLicsAsync(DeleteLicsRequest& req, AsyncUnaryClientCall<DeleteLicsResponse>::DoneFn done) {
+    AsyncUnaryClientCall<DeleteLicsResponse>* call = new AsyncUnaryClientCall<DeleteLicsResponse>(done);
+    call->reader = stub_->PrepareAsyncDeleteLics(&call->ctx, req, &cq_);
+    call->reader->StartCall();
+    call->reader->Finish(&call->resp, &call->status, call);
+}
+
+/*
+* picture requests are served in place like CreateLics does. video requests take what the reservoir
+* holds in place, only the shortfall goes to server on the completion queue, so this never blocks.
+*/
+int LicsClient::CreateLicsAsync(CreateLicsRequest& req, CreateDoneFn done) {
+    if (!connected_) {
+        SPDLOG_INFO("disconnected to license server, please wait and retry...");
+        return ELICS_NET_DISCONNECTED;
+    }
+
+    if (req.algo().type() != TaskType::VIDEO) {
+        CreateLicsResponse resp;
+        int ret = CreateLics(req, resp);
+        if (ret == ELICS_OK) {
+            done(ret, resp);
+        }
+        return ret;
+    }
+
+    LicsReservoir* reservoir = findReservoir(req.algo().algorithmid());
+    int taken = 0;
+    if (reservoir && reservoir->Enabled()) {
+        int expected = req.clientexpectedlicsnum();
+        taken = takeFromReservoir(reservoir, expected);
+        if (taken == expected) {
+            CreateLicsResponse resp;
+            resp.set_token(getToken());
+            resp.mutable_algo()->CopyFrom(req.algo());
+            resp.set_clientgetactuallicsnum(taken);
+            resp.set_respcode(ELICS_OK);
+            done(ELICS_OK, resp);
+            return ELICS_OK;
+        }
+
+        // what server grants for the shortfall comes on top, the reservoir part is kept even if that fails.
+        req.set_clientexpectedlicsnum(expected - taken);
+        if (taken > 0) {
+            CreateDoneFn task = done;
+            done = [taken, task](int ret, CreateLicsResponse& resp) {
+                resp.set_clientgetactuallicsnum((ret == ELICS_OK ? resp.clientgetactuallicsnum() : 0) + taken);
+                task(ELICS_OK, resp);
+            };
+        }
+    }
+
+    auto coalescer = coalescers_.find(req.algo().algorithmid());
+    if (coalescer != coalescers_.end()) {
+        coalesceCreate(coalescer->second.get(), req, done);
+        return ELICS_OK;
+    }
+
+    req.set_token(getToken());
+    createLicsAsync(req, [done](const Status& status, CreateLicsResponse& resp) {
+        if (!status.ok()) {
+            SPDLOG_INFO("CreateLics({0}):{1}", status.error_code(), status.error_message());
+        }
+        done(status.ok() ? ELICS_OK : status.error_code(), resp);
+    });
+    return ELICS_OK;
+}
+
+void LicsClient::coalesceCreate(ApplyCoalescer* coalescer, CreateLicsRequest& req, CreateDoneFn done) {
+    bool send = false;
+    {
+        std::lock_guard<std::mutex> lk(coalescer->mtx);
+        coalescer->waiters.push_back(std::make_pair(req.clientexpectedlicsnum(), done));
+        send = !coalescer->inFlight;
+        coalescer->inFlight = true;
+    }
+
+    if (send) {
+        flushCoalesced(coalescer, req.algo());
+    }
+}
+
+// send one CreateLics for every waiter so far, then the next batch once it is answered.
+// the grant is handed out first come first served, nobody gets more than it asked for.
+void LicsClient::flushCoalesced(ApplyCoalescer* coalescer, const Algorithm& algo) {
+    std::vector<std::pair<int, CreateDoneFn>> batch;
+    {
+        std::lock_guard<std::mutex> lk(coalescer->mtx);
+        batch.swap(coalescer->waiters);
+        if (batch.empty()) {
+            coalescer->inFlight = false;
+            return;
+        }
+    }
+
+    int expected = 0;
+    for (auto& waiter : batch) {
+        expected += waiter.first;
+    }
+
+    CreateLicsRequest req;
+    req.set_token(getToken());
+    req.mutable_algo()->CopyFrom(algo);
+    req.set_clientexpectedlicsnum(expected);
+    createLicsAsync(req, [this, coalescer, algo, batch](const Status& status, CreateLicsResponse& resp) {
+        if (!status.ok()) {
+            SPDLOG_INFO("CreateLics({0}):{1}", status.error_code(), status.error_message());
+        }
+
+        int left = status.ok() ? resp.clientgetactuallicsnum() : 0;
+        for (auto& waiter : batch) {
+            CreateLicsResponse share(resp);
+            int actual = left < waiter.first ? left : waiter.first;
+            share.set_clientgetactuallicsnum(actual);
+            left -= actual;
+            waiter.second(status.ok() ? ELICS_OK : status.error_code(), share);
+        }
+
+        flushCoalesced(coalescer, algo);
+    });
+}
+
+// same as CreateLicsAsync: licenses go back to the reservoir in place, only the rest goes to server.
+int LicsClient::DeleteLicsAsync(DeleteLicsRequest& req, DeleteDoneFn done) {
+    if (req.algo().type() != TaskType::VIDEO) {
+        DeleteLicsResponse resp;
+        int ret = DeleteLics(req, resp);
+        if (ret == ELICS_OK) {
+            done(ret, resp);
+        }
+        return ret;
+    }
+
+    LicsReservoir* reservoir = findReservoir(req.algo().algorithmid());
+    int put = (reservoir && reservoir->Used() > 0) ? reservoir->Put(req.licsnum()) : 0;
+    if (put > 0) {
+        DeleteLicsResponse resp;
+        resp.set_token(getToken());
+        resp.mutable_algo()->CopyFrom(req.algo());
+        resp.set_licsnum(put);
+        resp.set_respcode(ELICS_OK);
+        if (put == req.licsnum() || !connected_) {
+            done(ELICS_OK, resp); // what is left was granted directly, it stays with the caller until server is back
+            return ELICS_OK;
+        }
+
+        req.set_licsnum(req.licsnum() - put);
+        DeleteDoneFn task = done;
+        done = [put, task](int ret, DeleteLicsResponse& resp) {
+            resp.set_licsnum((ret == ELICS_OK ? resp.licsnum() : 0) + put);
+            task(ELICS_OK, resp);
+        };
+    }
+
+    if (!connected_) {
+        SPDLOG_INFO("disconnected to license server, please wait and retry...");
+        return ELICS_NET_DISCONNECTED;
+    }
+
+    req.set_token(getToken());
+    deleteLicsAsync(req, [done](const Status& status, DeleteLicsResponse& resp) {
+        if (!status.ok()) {
+            SPDLOG_INFO("DeleteLics({0}):{1}", status.error_code(), status.error_message());
+        }
+        done(status.ok() ? ELICS_OK : status.error_code(), resp);
+    });
+    return ELICS_OK;
 }
 
 Status LicsClient::createLics(CreateLicsRequest& req, CreateLicsResponse& resp){
@@ -182,6 +502,10 @@ int LicsClient::CreateLics(CreateLicsRequest& req, CreateLicsResponse& resp){
     }
 
    if (req.algo().type() == TaskType::VIDEO) {
+        LicsReservoir* reservoir = findReservoir(req.algo().algorithmid());
+        if (reservoir && reservoir->Enabled()) {
+            return createFromReservoir(reservoir, req, resp);
+        }
 
         req.set_token(getToken());
 
@@ -198,7 +522,7 @@ int LicsClient::CreateLics(CreateLicsRequest& req, CreateLicsResponse& resp){
     }
 
     if (req.algo().type() == TaskType::PICTURE) {
-        // TODO: add lock
+        std::lock_guard<std::mutex> lk(exclusive_write_or_read_cache);
         auto search = cache_.find(req.algo().algorithmid());
         if (search != cache_.end()) {
             int total = search->second->totallics();
@@ -234,6 +558,11 @@ int LicsClient::DeleteLics(DeleteLicsRequest& req, DeleteLicsResponse& resp) {
             return ELICS_NET_DISCONNECTED;
         }
 
+        LicsReservoir* reservoir = findReservoir(req.algo().algorithmid());
+        if (reservoir && reservoir->Used() > 0) {
+            return deleteToReservoir(reservoir, req, resp);
+        }
+
         req.set_token(getToken());
         
         Status status = deleteLics(req, resp);
@@ -247,7 +576,7 @@ int LicsClient::DeleteLics(DeleteLicsRequest& req, DeleteLicsResponse& resp) {
     }
 
     if (req.algo().type() == TaskType::PICTURE) {
-        // TODO: add lock
+        std::lock_guard<std::mutex> lk(exclusive_write_or_read_cache);
         auto search = cache_.find(req.algo().algorithmid());
         if (search != cache_.end()) {
             int used = req.licsnum() + search->second->usedlics();
@@ -262,6 +591,255 @@ int LicsClient::DeleteLics(DeleteLicsRequest& req, DeleteLicsResponse& resp) {
     return ELICS_ALGO_NOT_EXIST; 
 }
 
+LicsReservoir* LicsClient::findReservoir(long algoID) {
+    auto search = reservoirs_.find(algoID);
+    if (search == reservoirs_.end()) {
+        return nullptr;
+    }
+
+    return search->second.get();
+}
+
+int LicsClient::SetReservoir(int algoID, int low, int high) {
+    LicsReservoir* reservoir = findReservoir(algoID);
+    if (!reservoir) {
+        SPDLOG_WARN("algorithm({0}) has no reservoir, only video algorithm does", algoID);
+        return ELICS_ALGO_NOT_EXIST;
+    }
+
+    if (low < 0 || high < 0 || low > high) {
+        return ELICS_INVALID_PARAMS;
+    }
+
+    // background loop fills it up, or gives everything back when high is 0.
+    reservoir->SetWatermarks(low, high);
+    return ELICS_OK;
+}
+
+// idle licenses of the reservoir, never waits on server. a reservoir running low or dry is topped
+// up by doLoop in the background, what it can not cover now is left to the caller.
+int LicsClient::takeFromReservoir(LicsReservoir* reservoir, int expected) {
+    int actual = reservoir->Take(expected);
+    if ((actual < expected || reservoir->Deficit() > 0) && !refillPending_.exchange(true)) {
+        enqueue(std::make_shared<LicsClientEvent>(LicsClientEventType::RESERVOIR));
+    }
+
+    return actual;
+}
+
+// tasks are served from the reservoir, the shortfall is granted to the task directly by server.
+int LicsClient::createFromReservoir(LicsReservoir* reservoir, CreateLicsRequest& req, CreateLicsResponse& resp) {
+    int expected = req.clientexpectedlicsnum();
+    int actual = takeFromReservoir(reservoir, expected);
+
+    if (actual < expected) {
+        CreateLicsRequest directReq(req);
+        CreateLicsResponse directResp;
+        directReq.set_token(getToken());
+        directReq.set_clientexpectedlicsnum(expected - actual);
+        Status status = createLics(directReq, directResp);
+        if (status.ok()) {
+            actual += directResp.clientgetactuallicsnum();
+        } else {
+            SPDLOG_INFO("CreateLics({0}):{1}", status.error_code(), status.error_message());
+        }
+    }
+
+    resp.set_token(getToken());
+    resp.mutable_algo()->CopyFrom(req.algo());
+    resp.set_clientgetactuallicsnum(actual);
+    resp.set_respcode(ELICS_OK);
+    return ELICS_OK;
+}
+
+// licenses go back to the reservoir first, the rest were granted directly by server.
+int LicsClient::deleteToReservoir(LicsReservoir* reservoir, DeleteLicsRequest& req, DeleteLicsResponse& resp) {
+    int actual = reservoir->Put(req.licsnum());
+    if (actual < req.licsnum()) {
+        DeleteLicsRequest directReq(req);
+        DeleteLicsResponse directResp;
+        directReq.set_token(getToken());
+        directReq.set_licsnum(req.licsnum() - actual);
+        Status status = deleteLics(directReq, directResp);
+        if (!status.ok()) {
+            SPDLOG_INFO("DeleteLics({0}):{1}", status.error_code(), status.error_message());
+            return status.error_code();
+        }
+        actual += directResp.licsnum();
+    }
+
+    resp.set_token(getToken());
+    resp.mutable_algo()->CopyFrom(req.algo());
+    resp.set_licsnum(actual);
+    resp.set_respcode(ELICS_OK);
+    return ELICS_OK;
+}
+
+int LicsClient::leaseReservoir(long algoID, LicsReservoir* reservoir, int num) {
+    if (num <= 0) {
+        return 0;
+    }
+
+    CreateLicsRequest req;
+    CreateLicsResponse resp;
+    req.set_token(getToken());
+    req.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    req.mutable_algo()->set_type(TaskType::VIDEO);
+    req.mutable_algo()->set_algorithmid(algoID);
+    req.set_clientexpectedlicsnum(num);
+    req.set_reservoir(true);
+
+    Status status = createLics(req, resp);
+    if (!status.ok()) {
+        SPDLOG_INFO("lease reservoir({0}):{1}", status.error_code(), status.error_message());
+        return 0;
+    }
+
+    reservoir->AddLeased(resp.clientgetactuallicsnum());
+    return resp.clientgetactuallicsnum();
+}
+
+void LicsClient::returnReservoir(long algoID, LicsReservoir* reservoir, int num) {
+    int reclaimed = reservoir->Reclaim(num);
+    if (reclaimed <= 0) {
+        return;
+    }
+
+    DeleteLicsRequest req;
+    DeleteLicsResponse resp;
+    req.set_token(getToken());
+    req.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    req.mutable_algo()->set_type(TaskType::VIDEO);
+    req.mutable_algo()->set_algorithmid(algoID);
+    req.set_licsnum(reclaimed);
+    req.set_reservoir(true);
+
+    Status status = deleteLics(req, resp);
+    if (!status.ok()) {
+        SPDLOG_INFO("return reservoir({0}):{1}", status.error_code(), status.error_message());
+        reservoir->AddLeased(reclaimed); // try again next round
+        return;
+    }
+}
+
+// called by doLoop after every heartbeat, so leases follow the same connection as heartbeats.
+void LicsClient::balanceReservoirs() {
+    refillPending_ = false;
+    for (auto& iter : reservoirs_) {
+        int deficit = iter.second->Deficit();
+        if (deficit > 0) {
+            leaseReservoir(iter.first, iter.second.get(), deficit);
+            continue;
+        }
+
+        returnReservoir(iter.first, iter.second.get(), iter.second->Surplus());
+    }
+}
+
+Status LicsClient::batchCreateLics(BatchCreateLicsRequest& req, BatchCreateLicsResponse& resp) {
+    ClientContext context;
+    return stub_->BatchCreateLics(&context, req, &resp);
+}
+
+int LicsClient::BatchCreateLics(BatchCreateLicsRequest& req, BatchCreateLicsResponse& resp) {
+    if (!connected_) {
+        SPDLOG_INFO("disconnected to license server, please wait and retry...");
+        return ELICS_NET_DISCONNECTED;
+    }
+
+    // the rpc goes first, local items are only served once it worked, so a failed batch grants nothing.
+    BatchCreateLicsRequest videoReq;
+    std::vector<int> videoIdx; // position of every video item in req
+    std::vector<int> localIdx; // position of every item served locally
+    videoReq.set_token(getToken());
+    for (int idx = 0; idx < req.items_size(); ++idx) {
+        resp.add_items();
+        LicsReservoir* reservoir = findReservoir(req.items(idx).algo().algorithmid());
+        bool local = reservoir && reservoir->Enabled();
+        if (req.items(idx).algo().type() == TaskType::VIDEO && !local) {
+            *videoReq.add_items() = req.items(idx);
+            videoIdx.push_back(idx);
+            continue;
+        }
+        localIdx.push_back(idx);
+    }
+
+    if (videoReq.items_size() > 0) {
+        BatchCreateLicsResponse videoResp;
+        Status status = batchCreateLics(videoReq, videoResp);
+        if (!status.ok()) {
+            SPDLOG_INFO("BatchCreateLics({0}):{1}", status.error_code(), status.error_message());
+            return status.error_code();
+        }
+        if (videoResp.respcode() != ELICS_OK) {
+            return videoResp.respcode();
+        }
+        for (int idx = 0; idx < videoResp.items_size() && idx < (int)videoIdx.size(); ++idx) {
+            *resp.mutable_items(videoIdx[idx]) = videoResp.items(idx);
+        }
+    }
+
+    for (int idx : localIdx) {
+        resp.mutable_items(idx)->set_respcode(CreateLics(*req.mutable_items(idx), *resp.mutable_items(idx)));
+    }
+
+    resp.set_token(getToken());
+    resp.set_respcode(ELICS_OK);
+    return ELICS_OK;
+}
+
+Status LicsClient::batchDeleteLics(BatchDeleteLicsRequest& req, BatchDeleteLicsResponse& resp) {
+    ClientContext context;
+    return stub_->BatchDeleteLics(&context, req, &resp);
+}
+
+int LicsClient::BatchDeleteLics(BatchDeleteLicsRequest& req, BatchDeleteLicsResponse& resp) {
+    // same order as BatchCreateLics, a failed batch frees nothing and the caller may try it again.
+    BatchDeleteLicsRequest videoReq;
+    std::vector<int> videoIdx; // position of every video item in req
+    std::vector<int> localIdx; // position of every item served locally
+    videoReq.set_token(getToken());
+    for (int idx = 0; idx < req.items_size(); ++idx) {
+        resp.add_items();
+        LicsReservoir* reservoir = findReservoir(req.items(idx).algo().algorithmid());
+        bool local = reservoir && reservoir->Used() > 0;
+        if (req.items(idx).algo().type() == TaskType::VIDEO && !local) {
+            *videoReq.add_items() = req.items(idx);
+            videoIdx.push_back(idx);
+            continue;
+        }
+        localIdx.push_back(idx);
+    }
+
+    if (videoReq.items_size() > 0) {
+        if (!connected_) {
+            SPDLOG_INFO("disconnected to license server, please wait and retry...");
+            return ELICS_NET_DISCONNECTED;
+        }
+
+        BatchDeleteLicsResponse videoResp;
+        Status status = batchDeleteLics(videoReq, videoResp);
+        if (!status.ok()) {
+            SPDLOG_INFO("BatchDeleteLics({0}):{1}", status.error_code(), status.error_message());
+            return status.error_code();// app need to handle this error
+        }
+        if (videoResp.respcode() != ELICS_OK) {
+            return videoResp.respcode();
+        }
+        for (int idx = 0; idx < videoResp.items_size() && idx < (int)videoIdx.size(); ++idx) {
+            *resp.mutable_items(videoIdx[idx]) = videoResp.items(idx);
+        }
+    }
+
+    for (int idx : localIdx) {
+        resp.mutable_items(idx)->set_respcode(DeleteLics(*req.mutable_items(idx), *resp.mutable_items(idx)));
+    }
+
+    resp.set_token(getToken());
+    resp.set_respcode(ELICS_OK);
+    return ELICS_OK;
+}
+
 // int LicsClient::QueryLics() {
 //     if (!connected_) {
 //         SPDLOG_INFO("disconnected to license server, please wait and retry...");
@@ -296,6 +874,7 @@ int LicsClient::GetAuthAccess() {
     if (status.ok()) {
         SPDLOG_INFO(" get accessed token: {0} ok", resp.token());
         setToken(resp.token());
+        applyHeartbeatPace(resp.heartbeatintervalms(), resp.heartbeatjitterms());
         return resp.respcode();
     }
 
@@ -307,43 +886,161 @@ Status LicsClient::keepAlive(const KeepAliveRequest& req, KeepAliveResponse& res
     return stub_->KeepAlive(&context, req, &resp);
 }
 
-int LicsClient::KeepAlive() {
-    KeepAliveRequest req;
-    KeepAliveResponse resp;
-    
+static void copyHeartbeatLics(AlgoLics* lics, const AlgoLics& from) {
+    lics->set_requestid(from.requestid());
+    lics->set_totallics(from.totallics());
+    lics->set_usedlics(from.usedlics());
+    lics->set_maxlimit(from.maxlimit());
+
+    lics->mutable_algo()->set_vendor(from.algo().vendor());
+    lics->mutable_algo()->set_type(from.algo().type());
+    lics->mutable_algo()->set_algorithmid(from.algo().algorithmid());
+}
+
+void LicsClient::buildKeepAliveRequest(KeepAliveRequest& req) {
     req.set_token(getToken());
     // upload picture lics to server
-    for(auto iter : cache_) { 
+    std::lock_guard<std::mutex> lk(exclusive_write_or_read_cache);
+    for(auto& iter : cache_) { 
+        copyHeartbeatLics(req.add_lics(), *iter.second);
+    }
+}
+
+// the first heartbeat of a stream is a full snapshot, later ones carry only what changed.
+void LicsClient::buildKeepAliveDelta(KeepAliveRequest& req) {
+    bool full = (streamVersion_ == 0);
+    req.set_token(getToken());
+    req.set_delta(!full);
+
+    std::lock_guard<std::mutex> lk(exclusive_write_or_read_cache);
+    for(auto& iter : cache_) {
+        auto sent = streamSent_.find(iter.first);
+        if (!full && sent != streamSent_.end() &&
+                sent->second.totallics() == iter.second->totallics() &&
+                sent->second.usedlics() == iter.second->usedlics() &&
+                sent->second.maxlimit() == iter.second->maxlimit()) {
+            continue;
+        }
         AlgoLics* lics = req.add_lics();
-        lics->set_requestid(iter.second->requestid());
-        lics->set_totallics(iter.second->totallics());
-        lics->set_usedlics(iter.second->usedlics());
-        lics->set_maxlimit(iter.second->maxlimit());
+        copyHeartbeatLics(lics, *iter.second);
+        streamSent_[iter.first] = *lics;
+    }
 
-        lics->mutable_algo()->set_vendor(iter.second->algo().vendor());
-        lics->mutable_algo()->set_type(iter.second->algo().type());
-        lics->mutable_algo()->set_algorithmid(iter.second->algo().algorithmid());
+    if (full || req.lics_size() > 0) {
+        ++streamVersion_;
     }
+    req.set_version(streamVersion_);
+}
+
+// servers which do not pace heartbeats send 0, the current pace is kept then.
+void LicsClient::applyHeartbeatPace(int intervalMs, int jitterMs) {
+    if (intervalMs <= 0) {
+        return;
+    }
+
+    if (intervalMs != heartbeatIntervalMs_) {
+        SPDLOG_INFO("heartbeat interval {0}ms, jitter {1}ms", intervalMs, jitterMs);
+    }
+    heartbeatIntervalMs_ = intervalMs;
+    heartbeatJitterMs_ = jitterMs < intervalMs ? jitterMs : 0;
+}
+
+void LicsClient::applyKeepAliveResponse(const KeepAliveResponse& resp) {
+    applyHeartbeatPace(resp.heartbeatintervalms(), resp.heartbeatjitterms());
+    std::lock_guard<std::mutex> lk(exclusive_write_or_read_cache);
+    for (int idx = 0; idx < resp.lics_size(); ++idx ) {
+        int algoID = resp.lics(idx).algo().algorithmid();
+        int total = resp.lics(idx).totallics();
+
+        auto search = cache_.find(algoID);
+        if (search != cache_.end()) {
+            search->second->set_totallics(total);
+        }
+    }
+}
+
+int LicsClient::KeepAlive() {
+    KeepAliveRequest req;
+    KeepAliveResponse resp;
+    buildKeepAliveRequest(req);
 
     Status status = keepAlive(req, resp);
 
     // TODO: parse the response, 
     if (status.ok()) {
+        applyKeepAliveResponse(resp);
+        return ELICS_OK;
+    }
 
-        for (int idx = 0; idx < resp.lics_size(); ++idx ) {
-            int algoID = resp.lics(idx).algo().algorithmid();
-            int total = resp.lics(idx).totallics();
+    return status.error_code();
+}
 
-            auto search = cache_.find(algoID);
-            if (search != cache_.end()) {
-                cache_[algoID]->set_totallics(total);
-            }
+int LicsClient::openKeepAliveStream() {
+    streamCtx_.reset(new ClientContext());
+    stream_ = stub_->KeepAliveStream(streamCtx_.get());
+    streamBroken_ = false;
+    streamRespCode_ = ELICS_OK;
+    streamVersion_ = 0;
+    streamSent_.clear();
+
+    // first heartbeat carries the token, server resolves it once for the whole stream.
+    int ret = KeepAliveOnStream();
+    if (ret != ELICS_OK) {
+        closeKeepAliveStream();
+        return ret;
+    }
+
+    streamReader_ = std::thread(&LicsClient::readKeepAliveStream, this);
+    return ELICS_OK;
+}
+
+int LicsClient::KeepAliveOnStream() {
+    if (!stream_ || streamBroken_) {
+        return streamRespCode_ != ELICS_OK ? streamRespCode_.load() : ELICS_NET_DISCONNECTED;
+    }
+
+    KeepAliveRequest req;
+    buildKeepAliveDelta(req);
+    if (!stream_->Write(req)) {
+        streamBroken_ = true;
+        return ELICS_NET_DISCONNECTED;
+    }
+
+    return ELICS_OK;
+}
+
+// server only answers when picture shares changed, or to tell the token is gone.
+void LicsClient::readKeepAliveStream() {
+    KeepAliveResponse resp;
+    while (stream_->Read(&resp)) {
+        if (resp.respcode() != ELICS_OK) {
+            SPDLOG_ERROR("keepalive stream got a error: {0}", resp.respcode());
+            streamRespCode_ = resp.respcode();
+            break;
         }
-        
-        return ELICS_OK;
+        applyKeepAliveResponse(resp);
     }
 
-    return status.error_code();
+    streamBroken_ = true;
+}
+
+void LicsClient::closeKeepAliveStream() {
+    if (!stream_) {
+        return;
+    }
+
+    stream_->WritesDone();
+    streamCtx_->TryCancel(); // do not wait for a server that never answers
+    if (streamReader_.joinable()) {
+        streamReader_.join();
+    }
+
+    Status status = stream_->Finish();
+    if (!status.ok() && status.error_code() != grpc::StatusCode::CANCELLED) {
+        SPDLOG_INFO("keepalive stream closed({0}):{1}", status.error_code(), status.error_message());
+    }
+    stream_.reset();
+    streamCtx_.reset();
 }
 
 bool LicsClient::empty() {
@@ -354,8 +1051,14 @@ bool LicsClient::empty() {
     return false;
 }
 
+// doLoop takes the exit signal in its backoff wait as well as between heartbeats.
 void LicsClient::Stop() {
     signalExit();
+    std::call_once(loopJoined_, [this]() {
+        if (loop_.joinable()) {
+            loop_.join();
+        }
+    });
 }
 
 void LicsClient::signalExit() {
@@ -363,9 +1066,10 @@ void LicsClient::signalExit() {
     enqueue(t);
 }
 
-std::shared_ptr<LicsClientEvent> LicsClient::dequeue() {
+// wait for an event until deadline, nullptr if none came.
+std::shared_ptr<LicsClientEvent> LicsClient::dequeue(std::chrono::steady_clock::time_point deadline) {
     std::unique_lock<std::mutex> lk(exclusive_write_or_read_event);
-    if (cv_of_event_.wait_for(lk,std::chrono::milliseconds(100), [&]{return !empty();})) {
+    if (cv_of_event_.wait_until(lk, deadline, [&]{return !empty();})) {
 
         std::shared_ptr<LicsClientEvent> ev = std::move(event_.front());
         event_.pop_front();
@@ -399,49 +1103,153 @@ bool LicsClient::gotExitSignal(std::shared_ptr<LicsClientEvent> t) {
     
 }
 
+int LicsClient::randomMs(int max) {
+    return std::uniform_int_distribution<int>(0, max > 0 ? max : 0)(rng_);
+}
+
+void LicsClient::watchChannel(grpc_connectivity_state state, std::chrono::steady_clock::time_point deadline) {
+    if (watchArmed_.exchange(true)) {
+        return;
+    }
+
+    // NotifyOnStateChange takes a system clock deadline.
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point limit = now + std::chrono::milliseconds(CLIENT_CHANNEL_WATCH_MS);
+    std::chrono::system_clock::time_point sysDeadline = std::chrono::system_clock::now() +
+            std::chrono::duration_cast<std::chrono::system_clock::duration>((deadline < limit ? deadline : limit) - now);
+
+    ChannelWatchCall* call = new ChannelWatchCall([this]() {
+        watchArmed_ = false;
+        enqueue(std::make_shared<LicsClientEvent>(LicsClientEventType::CHANNEL));
+    });
+    channel_->NotifyOnStateChange(state, sysDeadline, &cq_, call);
+}
+
+/*
+* full jitter backoff: sleep a random time up to CLIENT_RECONNECT_BASE_MS doubled per attempt, at most
+* CLIENT_RECONNECT_MAX_MS. a channel that turns ready cuts the wait short, to a random point of
+* CLIENT_RECONNECT_SPREAD_MS, so clients of a restarted server do not come back all at once.
+*/
+bool LicsClient::waitReconnect(int attempt) {
+    long window = (long)CLIENT_RECONNECT_BASE_MS << (attempt < 16 ? attempt : 16);
+    window = window < CLIENT_RECONNECT_MAX_MS ? window : CLIENT_RECONNECT_MAX_MS;
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() +
+            std::chrono::milliseconds(randomMs(window));
+
+    grpc_connectivity_state state = channel_->GetState(true); // true: start connecting if idle
+    if (state != GRPC_CHANNEL_READY) {
+        watchChannel(state, deadline);
+    }
+
+    while (true) {
+        std::shared_ptr<LicsClientEvent> ev = dequeue(deadline);
+        if (!ev) {
+            return false;
+        }
+        if (gotExitSignal(ev)) {
+            return true;
+        }
+        if (ev->GetEventType() != LicsClientEventType::CHANNEL) {
+            continue; // reservoirs are balanced once connected again
+        }
+
+        state = channel_->GetState(true);
+        if (state == GRPC_CHANNEL_READY) {
+            std::chrono::steady_clock::time_point soon = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(randomMs(CLIENT_RECONNECT_SPREAD_MS));
+            deadline = soon < deadline ? soon : deadline;
+            continue;
+        }
+        watchChannel(state, deadline);
+    }
+}
+
 void LicsClient::doLoop() {
+    int attempt = 0;
 
     while (running_) {
 
-        // send authentication request to license server
+        // send authentication request to license server, with the last token to resume it.
+        long previous = getToken();
         if (ELICS_OK != GetAuthAccess()) { // bug to be fixed: make getAuthAcess being automical operation
-            std::shared_ptr<LicsClientEvent> ev = dequeue();
-            if (ev) {
-                // TODO : send delete license request 
-                if (gotExitSignal(ev)) {
-                    return;
-                }
-
-                // TODO: if failed , push the event to queue.
-                // else update license cache about video
+            if (waitReconnect(attempt++)) {
+                return;
             }
             continue;
         }
+        attempt = 0;
 
         connected_ = true;// bug to be fixed: keep it synchronized
 
+        // a new token owns no lease, whatever tasks still use is leased again below.
+        // a resumed one keeps what server booked for it.
+        if (getToken() != previous) {
+            for (auto& iter : reservoirs_) {
+                iter.second->ResetLease();
+            }
+        }
+
+        // prefer the keepalive stream, fall back to unary KeepAlive if server does not support it or it breaks.
+        bool streaming = (openKeepAliveStream() == ELICS_OK);
+
+        // beat on the pace server sets, starting from the jitter slot it gave this client.
+        std::chrono::steady_clock::time_point nextBeat = std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(heartbeatJitterMs_);
+
         // if ok, start keepAlive execution
         while(true) {
             // check if a event comes.
-            std::shared_ptr<LicsClientEvent> ev = dequeue();
+            std::shared_ptr<LicsClientEvent> ev = dequeue(nextBeat);
             if (ev) {
                 // TODO : send delete license request 
                 if (gotExitSignal(ev)) {
+                    closeKeepAliveStream();
                     return;
                 }
+            }
 
-                // TODO: if failed , push the event to queue.
-                // else update license cache about video
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now < nextBeat) {
+                // woken up by a reservoir running low, no heartbeat is due yet.
+                balanceReservoirs();
+                continue;
             }
 
             // TODO: send keepavlie request to license server with license cache.
-            int ret = KeepAlive();
+            int ret = ELICS_OK;
+            if (streaming) {
+                ret = KeepAliveOnStream();
+                if (ret != ELICS_OK) {
+                    closeKeepAliveStream();
+                    streaming = false;
+                    if (ret == ELICS_HEARTBEAT_OUT_OF_SYNC) {
+                        // a new stream starts over from a full snapshot.
+                        streaming = (openKeepAliveStream() == ELICS_OK);
+                    }
+                    if (streaming) {
+                        ret = ELICS_OK;
+                    } else if (ret != ELICS_CLIENT_NOT_EXIST) {
+                        ret = KeepAlive();
+                    }
+                }
+            } else {
+                ret = KeepAlive();
+            }
+
             if (ret != ELICS_OK) {
                 SPDLOG_ERROR("keepAlive has a error: {0}", ret);
                 connected_ = false; // bug to be fixed
                 break;
             }
 
+            balanceReservoirs();
+
+            // schedule from the last deadline so beats do not drift, unless they fell behind.
+            nextBeat += std::chrono::milliseconds(heartbeatIntervalMs_);
+            if (nextBeat <= now) {
+                nextBeat = now + std::chrono::milliseconds(heartbeatIntervalMs_);
+            }
+
             // TODO: update license cache about picture
             
 
@@ -0,0 +1,98 @@
+#include "client_table.h"
+
+#include <cstdint>
+
+ClientTable::ClientTable() : tokens_(CLIENT_TABLE_MIN_SLOTS, CLIENT_TABLE_EMPTY), clients_(CLIENT_TABLE_MIN_SLOTS),
+        mask_(CLIENT_TABLE_MIN_SLOTS - 1), shift_(64 - 4) {
+
+}
+
+// fibonacci hashing, tokens are sequential and would fill runs of slots with their low bits alone.
+size_t ClientTable::slotOf(long token) const {
+    return static_cast<size_t>((static_cast<uint64_t>(token) * 0x9E3779B97F4A7C15ull) >> shift_);
+}
+
+std::shared_ptr<Client> ClientTable::Find(long token) const {
+    for (size_t idx = slotOf(token); tokens_[idx] != CLIENT_TABLE_EMPTY; idx = (idx + 1) & mask_) {
+        if (tokens_[idx] == token) {
+            return clients_[idx];
+        }
+    }
+
+    return nullptr;
+}
+
+void ClientTable::Insert(long token, const std::shared_ptr<Client>& client) {
+    if (token == CLIENT_TABLE_EMPTY) {
+        return;
+    }
+    if ((size_ + 1) * 2 > tokens_.size()) {
+        grow();
+    }
+
+    size_t idx = slotOf(token);
+    while (tokens_[idx] != CLIENT_TABLE_EMPTY && tokens_[idx] != token) {
+        idx = (idx + 1) & mask_;
+    }
+    if (tokens_[idx] == CLIENT_TABLE_EMPTY) {
+        ++size_;
+    }
+    tokens_[idx] = token;
+    clients_[idx] = client;
+}
+
+/*
+* backward shift: every entry after the hole whose home slot is not between the hole and itself
+* would be cut off from its home by the hole, so it moves into the hole and leaves a new one.
+*/
+bool ClientTable::Erase(long token) {
+    if (token == CLIENT_TABLE_EMPTY) {
+        return false;
+    }
+    size_t hole = slotOf(token);
+    while (tokens_[hole] != token) {
+        if (tokens_[hole] == CLIENT_TABLE_EMPTY) {
+            return false;
+        }
+        hole = (hole + 1) & mask_;
+    }
+
+    for (size_t idx = (hole + 1) & mask_; tokens_[idx] != CLIENT_TABLE_EMPTY; idx = (idx + 1) & mask_) {
+        size_t home = slotOf(tokens_[idx]);
+        if (((idx - home) & mask_) >= ((idx - hole) & mask_)) {
+            tokens_[hole] = tokens_[idx];
+            clients_[hole] = std::move(clients_[idx]);
+            hole = idx;
+        }
+    }
+
+    tokens_[hole] = CLIENT_TABLE_EMPTY;
+    clients_[hole].reset();
+    --size_;
+    return true;
+}
+
+size_t ClientTable::Size() const {
+    return size_;
+}
+
+void ClientTable::grow() {
+    std::vector<long> tokens(tokens_.size() * 2, CLIENT_TABLE_EMPTY);
+    std::vector<std::shared_ptr<Client>> clients(tokens.size());
+    tokens.swap(tokens_);
+    clients.swap(clients_);
+    mask_ = tokens_.size() - 1;
+    --shift_;
+
+    for (size_t from = 0; from < tokens.size(); ++from) {
+        if (tokens[from] == CLIENT_TABLE_EMPTY) {
+            continue;
+        }
+        size_t idx = slotOf(tokens[from]);
+        while (tokens_[idx] != CLIENT_TABLE_EMPTY) {
+            idx = (idx + 1) & mask_;
+        }
+        tokens_[idx] = tokens[from];
+        clients_[idx] = std::move(clients[from]);
+    }
+}
@@ -0,0 +1,114 @@
+#include "cloud_sync.h"
+
+CircuitBreaker::CircuitBreaker(int failures, std::chrono::milliseconds backoff, std::chrono::milliseconds maxBackoff) :
+        threshold_(failures > 0 ? failures : 1), backoff_(backoff), maxBackoff_(maxBackoff) {
+
+}
+
+bool CircuitBreaker::Allow(std::chrono::steady_clock::time_point now) {
+    return failures_ < threshold_ || now >= retryAt_;
+}
+
+void CircuitBreaker::Succeed() {
+    failures_ = 0;
+    trips_ = 0;
+    opened_ = false;
+}
+
+void CircuitBreaker::Fail(std::chrono::steady_clock::time_point now) {
+    if (++failures_ < threshold_) {
+        return;
+    }
+
+    // a failed trial call opens it again, for twice as long.
+    std::chrono::milliseconds backoff = backoff_;
+    for (int idx = 0; idx < trips_ && backoff < maxBackoff_; ++idx) {
+        backoff *= 2;
+    }
+    backoff = backoff < maxBackoff_ ? backoff : maxBackoff_;
+    ++trips_;
+    retryAt_ = now + backoff;
+    opened_ = true;
+}
+
+bool CircuitBreaker::Opened() {
+    return opened_;
+}
+
+CloudSyncWorker::CloudSyncWorker(std::function<bool()> fetch, std::function<bool()> push, const CircuitBreaker& breaker) :
+        fetch_(fetch), push_(push), breaker_(breaker) {
+    thread_ = std::thread(&CloudSyncWorker::run, this);
+}
+
+// waits for the request in flight, which the http timeouts bound.
+CloudSyncWorker::~CloudSyncWorker() {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void CloudSyncWorker::RequestFetch() {
+    request(fetchPending_);
+}
+
+void CloudSyncWorker::RequestPush() {
+    request(pushPending_);
+}
+
+bool CloudSyncWorker::BreakerOpened() {
+    return breakerOpened_;
+}
+
+void CloudSyncWorker::request(bool& pending) {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        pending = true;
+    }
+    cv_.notify_one();
+}
+
+void CloudSyncWorker::run() {
+    while (true) {
+        bool fetch = false;
+        bool push = false;
+        {
+            std::unique_lock<std::mutex> lk(mtx_);
+            cv_.wait(lk, [this]() { return stopping_ || fetchPending_ || pushPending_; });
+            if (stopping_) {
+                return;
+            }
+            fetch = fetchPending_;
+            push = pushPending_;
+            fetchPending_ = false;
+            pushPending_ = false;
+        }
+
+        // requests coming while the breaker is open are dropped, the next period asks again.
+        if (!breaker_.Allow(std::chrono::steady_clock::now())) {
+            continue;
+        }
+
+        // totals come first, nothing is pushed after a failed fetch.
+        if (fetch && !call(fetch_)) {
+            continue;
+        }
+
+        if (push) {
+            call(push_);
+        }
+    }
+}
+
+bool CloudSyncWorker::call(const std::function<bool()>& request) {
+    bool succeeded = request();
+    if (succeeded) {
+        breaker_.Succeed();
+    } else {
+        breaker_.Fail(std::chrono::steady_clock::now());
+    }
+    breakerOpened_ = breaker_.Opened();
+    return succeeded;
+}
@@ -0,0 +1,205 @@
+#include "entitlement.h"
+#include "lics_interface.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "rapidjson/reader.h"
+
+// levels of the path to a license count, data.res.<class>.num, counted in objects from the root.
+enum EntitlementLevel {
+    LEVEL_ROOT = 1,
+    LEVEL_DATA,
+    LEVEL_RES,
+    LEVEL_CLASS,
+};
+
+static bool keyIs(const char* str, rapidjson::SizeType len, const char* key) {
+    return std::strlen(key) == len && std::memcmp(str, key, len) == 0;
+}
+
+/*
+* follows the path one level at a time: matched is how deep the current container is on it, next
+* is set by a key that leads one level further. everything off the path is only counted in depth.
+*/
+class EntitlementHandler : public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, EntitlementHandler> {
+public:
+    EntitlementHandler(const std::vector<EntitlementRule>& rules, std::map<long, int>& totals) : rules_(rules), totals_(totals) {}
+
+    bool SawRes() {
+        return sawRes_;
+    }
+
+    bool Key(const char* str, rapidjson::SizeType len, bool copy) {
+        next_ = false;
+        if (depth_ != matched_) {
+            return true;
+        }
+
+        switch (depth_) {
+        case LEVEL_ROOT:
+            next_ = keyIs(str, len, "data");
+            break;
+        case LEVEL_DATA:
+            next_ = keyIs(str, len, "res");
+            break;
+        case LEVEL_RES:
+            findRules(str, len);
+            next_ = first_ < last_;
+            break;
+        case LEVEL_CLASS:
+            next_ = keyIs(str, len, "num");
+            break;
+        }
+        return true;
+    }
+
+    bool StartObject() {
+        ++depth_;
+        if ((depth_ == LEVEL_ROOT) || (next_ && depth_ == matched_ + 1 && depth_ <= LEVEL_CLASS)) {
+            matched_ = depth_;
+            sawRes_ = sawRes_ || (matched_ == LEVEL_RES);
+        }
+        next_ = false;
+        return true;
+    }
+
+    bool EndObject(rapidjson::SizeType memberCount) {
+        if (matched_ == depth_) {
+            --matched_;
+        }
+        --depth_;
+        next_ = false;
+        return true;
+    }
+
+    bool StartArray() {
+        ++depth_;
+        next_ = false;
+        return true;
+    }
+
+    bool EndArray(rapidjson::SizeType elementCount) {
+        --depth_;
+        next_ = false;
+        return true;
+    }
+
+    bool Int(int num) { return count(num); }
+    bool Uint(unsigned num) { return count(num); }
+    bool Int64(int64_t num) { return count(num); }
+    bool Uint64(uint64_t num) { return count(static_cast<long>(num)); }
+    bool Double(double num) { return count(static_cast<long>(num)); }
+
+    // null, bool and string values.
+    bool Default() {
+        next_ = false;
+        return true;
+    }
+
+private:
+    void findRules(const char* str, rapidjson::SizeType len) {
+        auto less = [str, len](const EntitlementRule& rule) { return rule.key.compare(0, std::string::npos, str, len) < 0; };
+        auto notGreater = [str, len](const EntitlementRule& rule) { return rule.key.compare(0, std::string::npos, str, len) <= 0; };
+        first_ = std::partition_point(rules_.begin(), rules_.end(), less) - rules_.begin();
+        last_ = std::partition_point(rules_.begin() + first_, rules_.end(), notGreater) - rules_.begin();
+    }
+
+    bool count(long num) {
+        if (next_ && depth_ == LEVEL_CLASS && matched_ == LEVEL_CLASS) {
+            for (size_t idx = first_; idx < last_; ++idx) {
+                long lics = num / rules_[idx].divisor;
+                totals_[rules_[idx].algoID] += lics > 0 ? lics : 0;
+            }
+        }
+        next_ = false;
+        return true;
+    }
+
+    const std::vector<EntitlementRule>& rules_;
+    std::map<long, int>& totals_;
+    int depth_{0};
+    int matched_{0};
+    bool next_{false};
+    bool sawRes_{false};
+    size_t first_{0}; // rules of the class being read, [first_, last_)
+    size_t last_{0};
+};
+
+EntitlementParser::EntitlementParser(const std::vector<EntitlementRule>& rules) : rules_(rules) {
+    std::stable_sort(rules_.begin(), rules_.end(), [](const EntitlementRule& a, const EntitlementRule& b) { return a.key < b.key; });
+}
+
+bool EntitlementParser::Parse(const char* json, std::map<long, int>& totals) const {
+    totals.clear();
+    for (auto& rule : rules_) {
+        totals[rule.algoID] = 0;
+    }
+
+    EntitlementHandler handler(rules_, totals);
+    rapidjson::Reader reader;
+    rapidjson::StringStream stream(json);
+    if (reader.Parse(stream, handler).IsError()) {
+        return false;
+    }
+
+    return handler.SawRes();
+}
+
+bool EntitlementParser::ParseRules(const std::string& conf, std::vector<EntitlementRule>& rules) {
+    std::vector<EntitlementRule> parsed;
+    std::stringstream ss(conf);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (item.empty()) {
+            continue;
+        }
+
+        size_t colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0) {
+            return false;
+        }
+
+        EntitlementRule rule;
+        rule.key = item.substr(0, colon);
+        char* end = nullptr;
+        rule.algoID = std::strtol(item.c_str() + colon + 1, &end, 10);
+        rule.divisor = 1;
+        if (*end == '/') {
+            rule.divisor = std::strtol(end + 1, &end, 10);
+        }
+        if (*end != '\0' || end == item.c_str() + colon + 1 || rule.divisor <= 0) {
+            return false;
+        }
+        parsed.push_back(rule);
+    }
+
+    if (parsed.empty()) {
+        return false;
+    }
+    rules.swap(parsed);
+    return true;
+}
+
+/*
+* using F as a function of total algorithm license number, input: agorithm id
+* F(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA) = F(VIASFACEP-MAX-CLASSES) + F(VIASCAR-MAX-CLASSES) / 24 / 3600 +
+*                                               F(VIASOA-MAX-CLASSES) + F(FVSAOA-MAX-CLASSES)
+*
+* F(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD) = F(VIASVIDEO-MAX-CLASSES) + F(VIASFACEV-MAX-CLASSES) + F(VIASOD-MAX-CLASSES)
+*                                               + F(FVSAOD-MAX-CLASSES)
+*/
+std::vector<EntitlementRule> EntitlementParser::DefaultRules() {
+    return std::vector<EntitlementRule>{
+        {"VIASFACEP-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, 1},
+        {"VIASCAR-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, 24 * 3600},
+        {"VIASOA-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, 1},
+        {"FVSAOA-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, 1},
+        {"VIASVIDEO-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1},
+        {"VIASFACEV-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1},
+        {"VIASOD-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1},
+        {"FVSAOD-MAX-CLASSES", UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1},
+    };
+}
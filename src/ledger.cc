@@ -0,0 +1,87 @@
+#include "ledger.h"
+
+LicsLedger::LicsLedger() {
+
+}
+
+// an algorithm added again is replaced in its slot.
+void LicsLedger::AddAlgo(long algoID, TaskType type) {
+    AlgoLedgerEntry* known = Find(algoID);
+    int slot = known ? known->slot : static_cast<int>(slots_.size());
+    entries_[algoID] = std::unique_ptr<AlgoLedgerEntry>(new AlgoLedgerEntry(algoID, slot, type));
+    if (known) {
+        slots_[slot] = entries_[algoID].get();
+    } else {
+        slots_.push_back(entries_[algoID].get());
+    }
+}
+
+AlgoLedgerEntry* LicsLedger::Find(long algoID) const {
+    auto search = entries_.find(algoID);
+    if (search == entries_.end()) {
+        return nullptr;
+    }
+
+    return search->second.get();
+}
+
+int LicsLedger::Slots() const {
+    return static_cast<int>(slots_.size());
+}
+
+AlgoLedgerEntry* LicsLedger::At(int slot) const {
+    if (slot < 0 || slot >= Slots()) {
+        return nullptr;
+    }
+
+    return slots_[slot];
+}
+
+int LicsLedger::Grant(AlgoLedgerEntry* entry, int expected) {
+    if (expected <= 0) {
+        return 0;
+    }
+
+    int used = entry->used.load();
+    while (true) {
+        int left = entry->total.load() - used;
+        int actual = left >= expected ? expected : left;
+        if (actual <= 0) {
+            return 0;
+        }
+
+        // on failure used is reloaded with the latest value, try again with it.
+        if (entry->used.compare_exchange_weak(used, used + actual)) {
+            return actual;
+        }
+    }
+}
+
+int LicsLedger::Release(AlgoLedgerEntry* entry, int expected) {
+    if (expected <= 0) {
+        return 0;
+    }
+
+    int used = entry->used.load();
+    while (true) {
+        int actual = used >= expected ? expected : used;
+        if (actual <= 0) {
+            return 0;
+        }
+
+        if (entry->used.compare_exchange_weak(used, used - actual)) {
+            return actual;
+        }
+    }
+}
+
+void LicsLedger::SetTotal(long algoID, int total) {
+    AlgoLedgerEntry* entry = Find(algoID);
+    if (entry) {
+        entry->total.store(total);
+    }
+}
+
+const std::map<long, std::unique_ptr<AlgoLedgerEntry>>& LicsLedger::Entries() const {
+    return entries_;
+}
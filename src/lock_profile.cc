@@ -0,0 +1,39 @@
+#include "lock_profile.h"
+
+#ifdef LICS_LOCK_PROFILE
+
+#include <cstring>
+
+thread_local LockSite* lastLockSite = nullptr;
+
+// never destroyed, locks are still taken while statics go away at exit.
+static MetricsRegistry* lockProfileRegistry() {
+    static MetricsRegistry* registry = new MetricsRegistry();
+    return registry;
+}
+
+LockSite* NewLockSite(const char* lock, const char* func, const char* file, int line) {
+    const char* base = std::strrchr(file, '/');
+    std::string labels = std::string("lock=\"") + lock + "\",site=\"" + func + "@" +
+                (base ? base + 1 : file) + ":" + std::to_string(line) + "\"";
+
+    MetricsRegistry* registry = lockProfileRegistry();
+    LockSite* site = new LockSite();
+    site->acquisitions = registry->Counter("lics_lock_acquisitions_total", labels);
+    site->contended = registry->Counter("lics_lock_contended_total", labels);
+    site->wait = registry->Histogram("lics_lock_site_wait_ns", labels);
+    site->hold = registry->Histogram("lics_lock_site_hold_ns", labels);
+    return site;
+}
+
+std::string LockProfileReport() {
+    return lockProfileRegistry()->Render();
+}
+
+#else
+
+std::string LockProfileReport() {
+    return "";
+}
+
+#endif
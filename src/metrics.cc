@@ -0,0 +1,203 @@
+#include "metrics.h"
+
+#include <cstdlib>
+#include <new>
+
+// threads are spread over the shards round robin, in the order they first record something.
+static std::atomic<int> nextShard{0};
+static thread_local int threadShard = -1; // constant initialized, so reading it needs no guard
+
+static int shardOfThread() {
+    if (threadShard < 0) {
+        threadShard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+    }
+    return threadShard;
+}
+
+// cache line aligned, so shards of different metrics never share a line either.
+static void* newAligned(size_t size) {
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, METRICS_CACHE_LINE, size) != 0) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* MetricsCounter::operator new(size_t size) {
+    return newAligned(size);
+}
+
+void MetricsCounter::operator delete(void* ptr) {
+    free(ptr);
+}
+
+void MetricsCounter::Add(long num) {
+    shards_[shardOfThread()].value.fetch_add(num, std::memory_order_relaxed);
+}
+
+long MetricsCounter::Value() const {
+    long value = 0;
+    for (auto& shard : shards_) {
+        value += shard.value.load(std::memory_order_relaxed);
+    }
+    return value;
+}
+
+void* LatencyHistogram::operator new(size_t size) {
+    return newAligned(size);
+}
+
+void LatencyHistogram::operator delete(void* ptr) {
+    free(ptr);
+}
+
+LatencyHistogram::Shard::Shard() {
+    for (auto& bucket : buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+// values below HISTOGRAM_SUB_BUCKETS get a bucket each, above that the top HISTOGRAM_SUB_BITS bits
+// after the leading one pick the sub bucket of the power of two.
+int LatencyHistogram::BucketOf(long ns) {
+    if (ns < HISTOGRAM_SUB_BUCKETS) {
+        return ns > 0 ? ns : 0;
+    }
+
+    int msb = 63 - __builtin_clzl(ns);
+    if (msb >= HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int sub = (ns >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+long LatencyHistogram::BucketLowerBound(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int msb = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (HISTOGRAM_SUB_BUCKETS + sub) << (msb - HISTOGRAM_SUB_BITS);
+}
+
+void LatencyHistogram::Record(long ns) {
+    Shard& shard = shards_[shardOfThread()];
+    shard.buckets[BucketOf(ns)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(ns, std::memory_order_relaxed);
+}
+
+// shards are read one by one while others keep recording, so sum and buckets may be off by
+// the records of that moment. count is summed up from the buckets, recording does not keep one.
+void LatencyHistogram::Snap(Snapshot& snapshot) const {
+    snapshot.count = 0;
+    snapshot.sum = 0;
+    snapshot.buckets.assign(HISTOGRAM_BUCKETS, 0);
+    for (auto& shard : shards_) {
+        snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+        for (int idx = 0; idx < HISTOGRAM_BUCKETS; ++idx) {
+            long num = shard.buckets[idx].load(std::memory_order_relaxed);
+            snapshot.buckets[idx] += num;
+            snapshot.count += num;
+        }
+    }
+}
+
+long LatencyHistogram::Snapshot::Percentile(double p) const {
+    if (count == 0) {
+        return 0;
+    }
+
+    long rank = static_cast<long>(p * (count - 1));
+    long seen = 0;
+    for (size_t idx = 0; idx < buckets.size(); ++idx) {
+        seen += buckets[idx];
+        if (seen > rank) {
+            return BucketLowerBound(idx);
+        }
+    }
+    return BucketLowerBound(buckets.size() - 1);
+}
+
+long MetricsSinceNs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+MetricsTimer::MetricsTimer(LatencyHistogram* histogram) : histogram_(histogram), start_(std::chrono::steady_clock::now()) {
+
+}
+
+MetricsTimer::~MetricsTimer() {
+    if (histogram_) {
+        histogram_->Record(MetricsSinceNs(start_));
+    }
+}
+
+MetricsCounter* MetricsRegistry::Counter(const std::string& name, const std::string& labels) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    std::unique_ptr<MetricsCounter>& counter = counters_[name][labels];
+    if (!counter) {
+        counter.reset(new MetricsCounter());
+    }
+    return counter.get();
+}
+
+LatencyHistogram* MetricsRegistry::Histogram(const std::string& name, const std::string& labels) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    std::unique_ptr<LatencyHistogram>& histogram = histograms_[name][labels];
+    if (!histogram) {
+        histogram.reset(new LatencyHistogram());
+    }
+    return histogram.get();
+}
+
+void MetricsRegistry::Gauge(const std::string& name, const std::string& labels, std::function<long()> read) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    gauges_[name][labels] = read;
+}
+
+static std::string withLabels(const std::string& name, const std::string& labels, const std::string& extra = "") {
+    if (labels.empty() && extra.empty()) {
+        return name;
+    }
+    return name + "{" + labels + (labels.empty() || extra.empty() ? "" : ",") + extra + "}";
+}
+
+// histograms are rendered as summaries, quantiles are bucket lower bounds.
+std::string MetricsRegistry::Render() {
+    std::lock_guard<std::mutex> lk(mtx_);
+    std::string text;
+
+    for (auto& family : counters_) {
+        text += "# TYPE " + family.first + " counter\n";
+        for (auto& counter : family.second) {
+            text += withLabels(family.first, counter.first) + " " + std::to_string(counter.second->Value()) + "\n";
+        }
+    }
+
+    for (auto& family : gauges_) {
+        text += "# TYPE " + family.first + " gauge\n";
+        for (auto& gauge : family.second) {
+            text += withLabels(family.first, gauge.first) + " " + std::to_string(gauge.second()) + "\n";
+        }
+    }
+
+    const char* quantiles[] = {"0.5", "0.9", "0.99", "0.999", "1"};
+    const double values[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+    for (auto& family : histograms_) {
+        text += "# TYPE " + family.first + " summary\n";
+        for (auto& histogram : family.second) {
+            LatencyHistogram::Snapshot snapshot;
+            histogram.second->Snap(snapshot);
+            for (int idx = 0; idx < 5; ++idx) {
+                text += withLabels(family.first, histogram.first, std::string("quantile=\"") + quantiles[idx] + "\"") +
+                        " " + std::to_string(snapshot.Percentile(values[idx])) + "\n";
+            }
+            text += withLabels(family.first + "_sum", histogram.first) + " " + std::to_string(snapshot.sum) + "\n";
+            text += withLabels(family.first + "_count", histogram.first) + " " + std::to_string(snapshot.count) + "\n";
+        }
+    }
+
+    return text;
+}
@@ -0,0 +1,127 @@
+#include "reservoir.h"
+
+static int leasedOf(uint64_t state) {
+    return static_cast<int>(state >> 32);
+}
+
+static int usedOf(uint64_t state) {
+    return static_cast<int>(state & 0xffffffff);
+}
+
+static uint64_t stateOf(int leased, int used) {
+    return (static_cast<uint64_t>(leased) << 32) | static_cast<uint32_t>(used);
+}
+
+LicsReservoir::LicsReservoir() {
+
+}
+
+void LicsReservoir::SetWatermarks(int low, int high) {
+    high_ = high > 0 ? high : 0;
+    low_ = low < high_ ? (low > 0 ? low : 0) : high_.load();
+}
+
+bool LicsReservoir::Enabled() {
+    return high_ > 0;
+}
+
+int LicsReservoir::Take(int expected) {
+    if (expected <= 0) {
+        return 0;
+    }
+
+    uint64_t state = state_.load();
+    while (true) {
+        int idle = leasedOf(state) - usedOf(state);
+        int actual = idle >= expected ? expected : idle;
+        if (actual <= 0) {
+            return 0;
+        }
+
+        // on failure state is reloaded with the latest value, try again with it.
+        if (state_.compare_exchange_weak(state, stateOf(leasedOf(state), usedOf(state) + actual))) {
+            return actual;
+        }
+    }
+}
+
+int LicsReservoir::Put(int num) {
+    if (num <= 0) {
+        return 0;
+    }
+
+    uint64_t state = state_.load();
+    while (true) {
+        int used = usedOf(state);
+        int actual = used >= num ? num : used;
+        if (actual <= 0) {
+            return 0;
+        }
+
+        if (state_.compare_exchange_weak(state, stateOf(leasedOf(state), used - actual))) {
+            return actual;
+        }
+    }
+}
+
+int LicsReservoir::Leased() {
+    return leasedOf(state_);
+}
+
+int LicsReservoir::Used() {
+    return usedOf(state_);
+}
+
+int LicsReservoir::Idle() {
+    uint64_t state = state_;
+    return leasedOf(state) - usedOf(state);
+}
+
+int LicsReservoir::Deficit() {
+    int idle = Idle();
+    if (idle >= low_ && idle >= 0) {
+        return 0;
+    }
+
+    return high_ - idle;
+}
+
+int LicsReservoir::Surplus() {
+    int idle = Idle();
+    return idle > high_ ? idle - high_ : 0;
+}
+
+void LicsReservoir::AddLeased(int num) {
+    if (num <= 0) {
+        return;
+    }
+
+    uint64_t state = state_.load();
+    while (!state_.compare_exchange_weak(state, stateOf(leasedOf(state) + num, usedOf(state)))) {
+    }
+}
+
+int LicsReservoir::Reclaim(int num) {
+    if (num <= 0) {
+        return 0;
+    }
+
+    uint64_t state = state_.load();
+    while (true) {
+        int idle = leasedOf(state) - usedOf(state);
+        int actual = idle >= num ? num : idle;
+        if (actual <= 0) {
+            return 0;
+        }
+
+        if (state_.compare_exchange_weak(state, stateOf(leasedOf(state) - actual, usedOf(state)))) {
+            return actual;
+        }
+    }
+}
+
+void LicsReservoir::ResetLease() {
+    uint64_t state = state_.load();
+    while (!state_.compare_exchange_weak(state, stateOf(0, usedOf(state)))) {
+    }
+}
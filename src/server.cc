@@ -1,10 +1,9 @@
 #include "server.h"
+#include "async_server.h"
+#include <csignal>
 #include <ctime>
-
-#include "rapidjson/document.h"
-#include "rapidjson/writer.h"
-#include "rapidjson/stringbuffer.h"
-
+#include <pthread.h>
+#include <sstream>
 
 #define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_DEBUG // set level beyond debug when put it into production 
 #include "spdlog/spdlog.h"
@@ -12,35 +11,77 @@
 #include "spdlog/cfg/env.h"
 #include "spdlog/sinks/rotating_file_sink.h"
 
-#define SERVER_TIME_100_MS  (100)
 #define CLIENT_HEARTBEAT_DETECT_INTERVAL_SEC   (30)
 #define MAX_CLIENT_HEARTBEAT_LOST_CNT   (3)
+#define CLIENT_HEARTBEAT_TIMEOUT_SEC    (CLIENT_HEARTBEAT_DETECT_INTERVAL_SEC * MAX_CLIENT_HEARTBEAT_LOST_CNT)
+#define HEARTBEAT_WHEEL_SLOTS   (128) // one revolution must cover CLIENT_HEARTBEAT_TIMEOUT_SEC
+#define DEFAULT_RESERVOIR_CEILING   (64)
+#define DEFAULT_HEARTBEAT_INTERVAL_MS   (10000)
+#define DEFAULT_HEARTBEAT_BUSY_CLIENTS  (1000)
+#define MAX_HEARTBEAT_INTERVAL_MS   (CLIENT_HEARTBEAT_DETECT_INTERVAL_SEC * 1000) // still MAX_CLIENT_HEARTBEAT_LOST_CNT beats per timeout
+#define HEARTBEAT_JITTER_SLOTS  (64)
+#define TOKEN_SEQ_BITS  (20) // tokens issued per second of uptime before a restart may reuse one
+#define DEFAULT_SWEEP_INTERVAL_SEC  (CLIENT_HEARTBEAT_DETECT_INTERVAL_SEC)
+#define DEFAULT_CLOUD_FETCH_INTERVAL_SEC    (30)
+#define DEFAULT_USAGE_PUSH_INTERVAL_SEC (30)
+#define DEFAULT_STATS_INTERVAL_SEC  (30)
+#define DEFAULT_CLOUD_BREAKER_FAILURES  (3)
+#define DEFAULT_CLOUD_BREAKER_BACKOFF_MS    (5000)
+#define DEFAULT_CLOUD_BREAKER_MAX_BACKOFF_MS    (300000)
+#define DEFAULT_USAGE_BACKLOG_SAMPLES   (1440) // half a day of 30s pushes before samples get merged
+#define DEFAULT_USAGE_PUSH_RETRIES  (2)
+#define USAGE_PUSH_RETRY_BACKOFF_MS (200) // doubles every retry
+#define DEFAULT_SNAPSHOT_INTERVAL_SEC   (300)
+
+
+Client::Client(long token, const LicsLedger& ledger) : clientToken(token), slotNum(ledger.Slots()),
+        moreSlots(ledger.Slots() > CLIENT_INLINE_SLOTS ? new ClientSlot[ledger.Slots()] : nullptr),
+        slots(moreSlots ? moreSlots.get() : inlineSlots) {
+    timestamp = GetTimeSecsFromEpoch();
+}
 
+// only before the client is shared, the flags are read without synchronization afterwards.
+void Client::Register(int slot, int maxLimit) {
+    if (slot < 0 || slot >= slotNum) {
+        return;
+    }
 
-Client::Client(long token, std::map<long, std::shared_ptr<AlgoLics>> a) : clientToken(token), algo(a) {
-    timestamp = GetTimeSecsFromEpoch();
+    slots[slot].registered = true;
+    slots[slot].maxLimit = maxLimit;
+}
+
+int Client::Slots() {
+    return slotNum;
+}
+
+bool Client::Registered(int slot) {
+    return slot >= 0 && slot < slotNum && slots[slot].registered;
 }
 
-std::map<long, std::shared_ptr<AlgoLics>> Client::Algos() {
-    return algo;
+int Client::MaxLimit(int slot) {
+    return Registered(slot) ? slots[slot].maxLimit : 0;
 }
 
 void Client::UpdateTimestamp() {
     // TODO: update timestamp with system;
     timestamp = GetTimeSecsFromEpoch();
-    ZeroHeartbeatTimeoutCnt();
 }
 
-int Client::HeartbeatTimeoutCnt() {
-    return continusKeepAliveFailedCnt;
+long Client::Deadline() {
+    // TODO: read max keep alive from conf
+    return timestamp + CLIENT_HEARTBEAT_TIMEOUT_SEC;
+}
+
+void Client::Expire(long now) {
+    timestamp = now - CLIENT_HEARTBEAT_TIMEOUT_SEC;
 }
 
-void Client::IncHeartbeatTimeoutCnt() {
-    ++continusKeepAliveFailedCnt;
+long Client::ArmedDeadline() {
+    return armedDeadline;
 }
 
-void Client::ZeroHeartbeatTimeoutCnt() {
-    continusKeepAliveFailedCnt = 0;
+void Client::SetArmedDeadline(long deadline) {
+    armedDeadline = deadline;
 }
 
 long Client::GetLatestTimestamp() {
@@ -51,92 +92,163 @@ long Client::GetToken() {
     return clientToken;
 }
 
-bool Client::HaveAlgoID(long algoID) {
-    auto search = algo.find(algoID);
-    if (search != algo.end()) {
-        return true;
+static int decCounter(std::atomic<int>& counter, int num) {
+    if (num <= 0) {
+        return 0;
     }
 
-    return false;
-}
+    int used = counter.load();
+    while (true) {
+        int actual = used >= num ? num : used;
+        if (actual <= 0) {
+            return 0;
+        }
 
-bool Client::Alive() {
+        if (counter.compare_exchange_weak(used, used - actual)) {
+            return actual;
+        }
+    }
+}
 
-    // TODO: read max keep alive from conf
-    if (continusKeepAliveFailedCnt >= MAX_CLIENT_HEARTBEAT_LOST_CNT) {
-        return false;
+// slots outside of the ledger are ignored, same as unknown algorithms were.
+void Client::AddLics(int slot, int num) {
+    if (slot >= 0 && slot < slotNum) {
+        slots[slot].held.fetch_add(num);
     }
+}
 
-    return true;
+int Client::DecLics(int slot, int num) {
+    return slot >= 0 && slot < slotNum ? decCounter(slots[slot].held, num) : 0;
 }
 
-void Client::AddLics(long algoID, int num) {
-    auto search = algo.find(algoID);
-    if (search == algo.end()) {
-        return;
-    }
+int Client::DrainLics(int slot) {
+    return slot >= 0 && slot < slotNum ? slots[slot].held.exchange(0) : 0;
+}
 
-    int used = search->second->usedlics();
-    search->second->set_usedlics(used + num);
-    search->second->set_totallics(used + num);
+int Client::HeldLics(int slot) {
+    return slot >= 0 && slot < slotNum ? slots[slot].held.load() : 0;
 }
 
-void Client::DecLics(long algoID, int num) {
-    auto search = algo.find(algoID);
-    if (search == algo.end()) {
-        return;
+void Client::AddReserved(int slot, int num) {
+    if (slot >= 0 && slot < slotNum) {
+        slots[slot].reserved.fetch_add(num);
     }
+}
+
+int Client::DecReserved(int slot, int num) {
+    return slot >= 0 && slot < slotNum ? decCounter(slots[slot].reserved, num) : 0;
+}
 
-    int used = search->second->usedlics();
-    search->second->set_usedlics(used - num);
-    search->second->set_totallics(used - num);
+int Client::DrainReserved(int slot) {
+    return slot >= 0 && slot < slotNum ? slots[slot].reserved.exchange(0) : 0;
 }
 
-LicsServer::LicsServer() {
+int Client::ReservedLics(int slot) {
+    return slot >= 0 && slot < slotNum ? slots[slot].reserved.load() : 0;
+}
+
+void Client::MarkEvicted() {
+    evicted = true;
+}
+
+bool Client::Evicted() {
+    return evicted;
+}
+
+LicsServer::LicsServer() : LicsServer(getServerConf()->GetItem("wal_dir")) {
+
+}
+
+LicsServer::LicsServer(const std::string& walDir) : tokenBase_(GetTimeSecsFromEpoch() << TOKEN_SEQ_BITS), clientPool_(std::make_shared<SlabPool>()), heartbeatWheel_(HEARTBEAT_WHEEL_SLOTS, GetTimeSecsFromEpoch()),
+        reservoirCeiling_(getServerConf()->GetIntItem("reservoir_ceiling", DEFAULT_RESERVOIR_CEILING)),
+        heartbeatIntervalMs_(getServerConf()->GetIntItem("heartbeat_interval_ms", DEFAULT_HEARTBEAT_INTERVAL_MS)),
+        heartbeatBusyClients_(getServerConf()->GetIntItem("heartbeat_busy_clients", DEFAULT_HEARTBEAT_BUSY_CLIENTS)),
+        entitlement_(EntitlementParser::DefaultRules()),
+        usage_(getServerConf()->GetIntItem("usage_backlog_samples", DEFAULT_USAGE_BACKLOG_SAMPLES)),
+        usagePushRetries_(getServerConf()->GetIntItem("usage_push_retries", DEFAULT_USAGE_PUSH_RETRIES)) {
     auto log = spdlog::rotating_logger_mt("server", getServerConf()->GetItem("log"), 1048576 * 5, 3);
     log->flush_on(spdlog::level::debug); //set flush policy 
     spdlog::set_default_logger(log); // set log to be defalut 
     spdlog::set_pattern("%Y-%m-%d %H:%M:%S.%e %l [%s:%!:%#] %v");   
     spdlog::set_level(spdlog::level::debug);
 
-    // load all license into cache, depend by vendor
-    std::shared_ptr<AlgoLics> odLics = std::make_shared<AlgoLics>();
-    odLics->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
-    odLics->mutable_algo()->set_type(TaskType::VIDEO);
-    odLics->mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
-    odLics->set_requestid(-1);
-    odLics->set_totallics(0);
-    odLics->set_usedlics(0);
-    odLics->set_maxlimit(0); // TODO: set by conf
-    licenseQ[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD] = odLics;
-
-    std::shared_ptr<AlgoLics> faceOaLics = std::make_shared<AlgoLics>();
-    faceOaLics->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
-    faceOaLics->mutable_algo()->set_type(TaskType::PICTURE);
-    faceOaLics->mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA);    
-    faceOaLics->set_requestid(-1);
-    faceOaLics->set_totallics(0);
-    faceOaLics->set_usedlics(0);
-    faceOaLics->set_maxlimit(0);
-    licenseQ[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA] = faceOaLics;
-
-    std::shared_ptr<AlgoLics> vasOaLics = std::make_shared<AlgoLics>();
-    vasOaLics->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
-    vasOaLics->mutable_algo()->set_type(TaskType::PICTURE);
-    vasOaLics->mutable_algo()->set_algorithmid(UNIS_VAS_OA);
-    vasOaLics->set_requestid(-1);
-    vasOaLics->set_totallics(0);
-    vasOaLics->set_usedlics(0);
-    vasOaLics->set_maxlimit(0);
-    licenseQ[UNIS_VAS_OA] = vasOaLics;
-
-    std::thread t(&LicsServer::doLoop, this);
-    t.detach();
+    // load all algorithms into ledger, depend by vendor. total is filled up by cloud later.
+    ledger_.AddAlgo(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, TaskType::VIDEO);
+    ledger_.AddAlgo(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, TaskType::PICTURE);
+    ledger_.AddAlgo(UNIS_VAS_OA, TaskType::PICTURE);
+    registerMetrics();
+
+    if (!walDir.empty()) {
+        wal_.reset(new LicsWal(walDir));
+        recoverClients();
+    }
+
+    // overloaded, so the pointer type has to be spelled out.
+    void (LicsServer::*sweep)() = &LicsServer::serverClearDeadClients;
+    addHousekeepingTask(sweep, "sweep_interval_sec", DEFAULT_SWEEP_INTERVAL_SEC);
+    addHousekeepingTask(&LicsServer::requestCloudFetch, "cloud_fetch_interval_sec", DEFAULT_CLOUD_FETCH_INTERVAL_SEC);
+    addHousekeepingTask(&LicsServer::requestCloudPush, "usage_push_interval_sec", DEFAULT_USAGE_PUSH_INTERVAL_SEC);
+    addHousekeepingTask(&LicsServer::print, "stats_interval_sec", DEFAULT_STATS_INTERVAL_SEC);
+    if (wal_) {
+        addHousekeepingTask(&LicsServer::checkpointWal, "snapshot_interval_sec", DEFAULT_SNAPSHOT_INTERVAL_SEC);
+    }
+
+    std::string rulesConf = getServerConf()->GetItem("entitlement_rules");
+    std::vector<EntitlementRule> rules;
+    if (EntitlementParser::ParseRules(rulesConf, rules)) {
+        entitlement_ = EntitlementParser(rules);
+    } else if (!rulesConf.empty()) {
+        SPDLOG_ERROR("conf item(entitlement_rules) is malformed:{0}, use default", rulesConf);
+    }
+
+    getHttpClient()->SetTimeout(getServerConf()->GetIntItem("cloud_connect_timeout_ms", HTTP_DEFAULT_CONNECT_TIMEOUT_MS),
+                getServerConf()->GetIntItem("cloud_timeout_ms", HTTP_DEFAULT_TIMEOUT_MS));
+    CircuitBreaker breaker(getServerConf()->GetIntItem("cloud_breaker_failures", DEFAULT_CLOUD_BREAKER_FAILURES),
+                std::chrono::milliseconds(getServerConf()->GetIntItem("cloud_breaker_backoff_ms", DEFAULT_CLOUD_BREAKER_BACKOFF_MS)),
+                std::chrono::milliseconds(getServerConf()->GetIntItem("cloud_breaker_max_backoff_ms", DEFAULT_CLOUD_BREAKER_MAX_BACKOFF_MS)));
+    cloud_.reset(new CloudSyncWorker([this]() { return syncTotalFromCloud(); }, [this]() { return syncUsedToCloud(); }, breaker));
+    cloud_->RequestFetch(); // when LicsServer start up, make it fetch license data as soon as possible.
+
+    loop_ = std::thread(&LicsServer::doLoop, this);
+}
+
+void LicsServer::registerMetrics() {
+    const char* rpcs[RPC_NUM] = {"CreateLics", "DeleteLics", "BatchCreateLics", "BatchDeleteLics",
+                "QueryLics", "GetAuthAccess", "KeepAlive", "KeepAliveStream"};
+    for (int idx = 0; idx < RPC_NUM; ++idx) {
+        rpcLatency_[idx] = metrics_.Histogram("lics_rpc_latency_ns", std::string("rpc=\"") + rpcs[idx] + "\"");
+    }
+    clientReadLockWait_ = metrics_.Histogram("lics_lock_wait_ns", "lock=\"clients\",side=\"read\"");
+    clientWriteLockWait_ = metrics_.Histogram("lics_lock_wait_ns", "lock=\"clients\",side=\"write\"");
+    cloudFetchLatency_ = metrics_.Histogram("lics_cloud_latency_ns", "op=\"fetch\"");
+    cloudPushLatency_ = metrics_.Histogram("lics_cloud_latency_ns", "op=\"push\"");
+    walSyncWait_ = metrics_.Histogram("lics_wal_sync_wait_ns");
+    clientsRegistered_ = metrics_.Counter("lics_clients_registered_total");
+    clientsEvicted_ = metrics_.Counter("lics_clients_evicted_total");
+    cloudFetchFailures_ = metrics_.Counter("lics_cloud_fetch_failures_total");
+    cloudFetchUnchanged_ = metrics_.Counter("lics_cloud_fetch_unchanged_total");
+    cloudPushFailures_ = metrics_.Counter("lics_cloud_push_failures_total");
+    metrics_.Gauge("lics_usage_backlog_samples", "", [this]() -> long { return usage_.Size(); });
+    metrics_.Gauge("lics_cloud_breaker_open", "", [this]() -> long { return cloud_ && cloud_->BreakerOpened() ? 1 : 0; });
+    metrics_.Gauge("lics_clients", "", [this]() -> long { return clientNum_; });
+
+    for (auto& entry : ledger_.Entries()) {
+        std::string algo = "algo=\"" + std::to_string(entry.first) + "\"";
+        AlgoMetrics& algoMetrics = algoMetrics_[entry.first];
+        algoMetrics.granted = metrics_.Counter("lics_licenses_granted_total", algo);
+        algoMetrics.denied = metrics_.Counter("lics_licenses_denied_total", algo);
+
+        AlgoLedgerEntry* ledgerEntry = entry.second.get();
+        metrics_.Gauge("lics_licenses", algo + ",state=\"total\"", [ledgerEntry]() -> long { return ledgerEntry->total; });
+        metrics_.Gauge("lics_licenses", algo + ",state=\"used\"", [ledgerEntry]() -> long { return ledgerEntry->used; });
+    }
 }
 
 LicsServer::~LicsServer() {
     running_ = false;
-    sleep(1);
+    signalExit();
+    loop_.join();
+    cloud_.reset();
     SPDLOG_ERROR("bye~");
     spdlog::shutdown();// exit log
 }
@@ -146,148 +258,97 @@ std::string("http://" + getServerConf()->GetItem("cloud") + "/api/vcloud/v2/lice
 }
 
 void LicsServer::fetchAlgosTotalLicFromCloud(std::map<long, std::shared_ptr<AlgoLics>>& remote){
+    // the etag is kept once the document it belongs to got parsed.
     std::string reply;
-    int ret = getHttpClient()->Get(FETCH_ALGOS_TOTAL_LICS_URL, reply);
-    if ( ret != EHTTP_OK) {
-        SPDLOG_ERROR("GET from cloud have a error:{0}", ret);
+    std::string etag = cloudETag_;
+    int ret = getHttpClient()->Get(FETCH_ALGOS_TOTAL_LICS_URL, reply, etag);
+    if (ret == EHTTP_NOT_MODIFIED) {
+        remote = cloudTotals_;
         return;
     }
-        
-
-    SPDLOG_DEBUG("GET from cloud:{0}", reply.c_str());
-
-    rapidjson::Document document;
-
-    // absense of key field, like data or res, means that it's a bad response, throw it and return
-    document.Parse(reply.c_str());
-    if (!document.HasMember("data")) {
-        SPDLOG_WARN("json parse failed: no found field(data) GET from cloud:{0}", reply.c_str());
+    if ( ret != EHTTP_OK) {
+        SPDLOG_ERROR("GET from cloud have a error:{0}", ret);
         return;
     }
 
-    if (!document["data"].HasMember("res")) {
-        SPDLOG_WARN("json parse failed: no found field(res) GET from cloud:{0}", reply.c_str());
+    // cloud without etag support, an identical document is not parsed again either.
+    size_t replyHash = std::hash<std::string>()(reply);
+    if (!cloudTotals_.empty() && replyHash == cloudReplyHash_) {
+        remote = cloudTotals_;
         return;
     }
 
-    /*
-    * using F as a function of total algorithm license number, input: agorithm id
-    * F(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA) = F(VIASFACEP-MAX-CLASSES) + F(VIASCAR-MAX-CLASSES) / 24 / 3600 +
-    *                                               F(VIASOA-MAX-CLASSES) + F(FVSAOA-MAX-CLASSES)
-    * 
-    * F(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD) = F(VIASVIDEO-MAX-CLASSES) + F(VIASFACEV-MAX-CLASSES) + F(VIASOD-MAX-CLASSES)
-    *                                               + F(FVSAOD-MAX-CLASSES)
-    */
-
-    int numOfFacePersonVehicleNonOA = 0;
-    int numOfFacePersonVehicleNonOD = 0;
-
-    if (document["data"]["res"].HasMember("VIASFACEP-MAX-CLASSES")) {
-
-        if (!document["data"]["res"]["VIASFACEP-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under VIASFACEP-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            numOfFacePersonVehicleNonOA += document["data"]["res"]["VIASFACEP-MAX-CLASSES"]["num"].GetInt();
-        }
-    }
-
-    if (document["data"]["res"].HasMember("VIASCAR-MAX-CLASSES")) {
-
-        if (!document["data"]["res"]["VIASCAR-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under VIASCAR-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            int carLics = document["data"]["res"]["VIASCAR-MAX-CLASSES"]["num"].GetInt();
-            int translatedLics = carLics / 24 / 3600;
-            carLics = translatedLics <= 0 ? 0 : translatedLics;
-            numOfFacePersonVehicleNonOA += translatedLics;
-        }
-    }
-
-    if (document["data"]["res"].HasMember("VIASOA-MAX-CLASSES")) {
-
-        if (!document["data"]["res"]["VIASOA-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under VIASOA-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            numOfFacePersonVehicleNonOA += document["data"]["res"]["VIASOA-MAX-CLASSES"]["num"].GetInt();
-        }
-    }
-
-    if (document["data"]["res"].HasMember("FVSAOA-MAX-CLASSES")) {
-
-        if (!document["data"]["res"]["FVSAOA-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under FVSAOA-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            numOfFacePersonVehicleNonOA += document["data"]["res"]["FVSAOA-MAX-CLASSES"]["num"].GetInt();
-        }
-    }
-
-    if (document["data"]["res"].HasMember("VIASVIDEO-MAX-CLASSES")) {
-
-        if (!document["data"]["res"]["VIASVIDEO-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under VIASVIDEO-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            numOfFacePersonVehicleNonOD += document["data"]["res"]["VIASVIDEO-MAX-CLASSES"]["num"].GetInt();
-        }
-    }
-
-    if (document["data"]["res"].HasMember("VIASFACEV-MAX-CLASSES")) {
-
-        if (!document["data"]["res"]["VIASFACEV-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under VIASFACEV-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            numOfFacePersonVehicleNonOD += document["data"]["res"]["VIASFACEV-MAX-CLASSES"]["num"].GetInt();
-        }
-    }
-
-    if (document["data"]["res"].HasMember("VIASOD-MAX-CLASSES")) {
+    SPDLOG_DEBUG("GET from cloud:{0}", reply.c_str());
 
-        if (!document["data"]["res"]["VIASOD-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under VIASOD-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            numOfFacePersonVehicleNonOD += document["data"]["res"]["VIASOD-MAX-CLASSES"]["num"].GetInt();
-        }
+    // absense of key field, like data or res, means that it's a bad response, throw it and return
+    std::map<long, int> totals;
+    if (!entitlement_.Parse(reply.c_str(), totals)) {
+        SPDLOG_WARN("json parse failed: bad json or no found field(data.res) GET from cloud:{0}", reply.c_str());
+        return;
     }
 
-    if (document["data"]["res"].HasMember("FVSAOD-MAX-CLASSES")) {
-
-        if (!document["data"]["res"]["FVSAOD-MAX-CLASSES"].HasMember("num")) {
-            SPDLOG_WARN("json parse failed: no found field(num) under FVSAOD-MAX-CLASSES. GET from cloud:{0}", reply.c_str());
-        }else {
-            numOfFacePersonVehicleNonOD += document["data"]["res"]["FVSAOD-MAX-CLASSES"]["num"].GetInt();
-        }
+    for (const auto& total : totals) {
+        std::shared_ptr<AlgoLics> lics = std::make_shared<AlgoLics>();
+        lics->set_totallics(total.second);
+        remote[total.first] = lics;
     }
 
+    cloudTotals_ = remote;
+    cloudReplyHash_ = replyHash;
+    cloudETag_ = etag;
+}
 
-    std::shared_ptr<AlgoLics> oaLics = std::make_shared<AlgoLics>();
-    oaLics->set_totallics(numOfFacePersonVehicleNonOA);
-
-    std::shared_ptr<AlgoLics> odLics = std::make_shared<AlgoLics>();
-    odLics->set_totallics(numOfFacePersonVehicleNonOD);
-    
-
-    remote[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA] = oaLics;
-    remote[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD] = odLics;
-
+#define PUSH_ALGOS_USED_LICS_URL  {\
+std::string("http://" + getServerConf()->GetItem("cloud") + "/api/vcloud/v2/license/usage")\
 }
 
+// queues a sample and leaves the upload to cloud_, the caller never waits on the network.
 void LicsServer::pushAlgosUsedLicToCloud(const std::map<long, std::shared_ptr<AlgoLics>>& local) {
-
+    UsageSample sample;
+    sample.from = GetTimeSecsFromEpoch();
+    sample.to = sample.from;
+    for (const auto& lics : local) {
+        AlgoUsage& usage = sample.algos[lics.first];
+        usage.total = lics.second->totallics();
+        usage.used = lics.second->usedlics();
+        usage.peak = usage.used;
+    }
+    usage_.Add(sample);
+    cloud_->RequestPush();
 }
 
-
 void LicsServer::updateLocalLics(const std::map<long, std::shared_ptr<AlgoLics>>& remoteAlgosTotalLic) {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
     for (const auto &remote : remoteAlgosTotalLic) {
-        licenseQ[remote.first]->set_totallics(remote.second->totallics());
+        ledger_.SetTotal(remote.first, remote.second->totallics());
     }
 }
 
+// a snapshot of the ledger counters, read without any lock.
 void LicsServer::getLocalLics(std::map<long, std::shared_ptr<AlgoLics>>& local) {
-
+    for (const auto& entry : ledger_.Entries()) {
+        std::shared_ptr<AlgoLics> lics = std::make_shared<AlgoLics>();
+        lics->mutable_algo()->set_algorithmid(entry.first);
+        lics->mutable_algo()->set_type(entry.second->type);
+        lics->set_totallics(entry.second->total);
+        lics->set_usedlics(entry.second->used);
+        local[entry.first] = lics;
+    }
 }
 
 void LicsServer::Shutdown() {
     signalExit();
+
+    // in the lock, so the server stopped can not go away meanwhile, see OnShutdown.
+    std::lock_guard<std::mutex> lk(stopServingMtx_);
+    if (stopServing_) {
+        stopServing_();
+    }
+}
+
+// whoever owns the server clears it before the server goes, which waits for a Shutdown in progress.
+void LicsServer::OnShutdown(std::function<void()> stop) {
+    std::lock_guard<std::mutex> lk(stopServingMtx_);
+    stopServing_ = stop;
 }
 
 void LicsServer::signalExit() {
@@ -303,9 +364,10 @@ bool LicsServer::empty() {
     return false;
 }
 
-std::shared_ptr<LicsServerEvent> LicsServer::dequeue() {
-    std::unique_lock<std::mutex> lk(exclusive_write_or_read_event);
-    if (cv_of_event_.wait_for(lk,std::chrono::milliseconds(SERVER_TIME_100_MS), [&]{return !empty();})) {
+// wait for an event until deadline, nullptr if none came.
+std::shared_ptr<LicsServerEvent> LicsServer::dequeue(std::chrono::steady_clock::time_point deadline) {
+    LICS_UNIQUE_LOCK(lk, exclusive_write_or_read_event);
+    if (cv_of_event_.wait_until(lk, deadline, [&]{return !empty();})) {
 
         std::shared_ptr<LicsServerEvent> ev = std::move(event_.front());
         event_.pop_front();
@@ -318,7 +380,7 @@ std::shared_ptr<LicsServerEvent> LicsServer::dequeue() {
 void LicsServer::enqueue(std::shared_ptr<LicsServerEvent> t) {
     {
         // bug to be fixed: mutex will block the client, we will fixed during some time in future.
-        std::lock_guard<std::mutex> lk(exclusive_write_or_read_event);
+        LICS_LOCK_GUARD(lk, exclusive_write_or_read_event);
 
         // TODO: push into queue
         event_.push_back(t);
@@ -339,216 +401,456 @@ bool LicsServer::gotExitSignal(std::shared_ptr<LicsServerEvent> t) {
     
 }
 
+std::shared_ptr<Client> LicsServer::findClient(long token) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    LICS_READ_LOCK_GUARD(lk, exclusive_write_or_read_server_license);
+    clientReadLockWait_->Record(MetricsSinceNs(start));
+    return clientQ.Find(token);
+}
+
 void LicsServer::serverClearDeadClients() {
+    serverClearDeadClients(GetTimeSecsFromEpoch());
+}
+
+/*
+* only clients whose deadline came due are visited. a heartbeat does not touch the wheel,
+* it just moves the client timestamp forward, so a due client that was heard from in the
+* meantime is re-armed at its new deadline instead of being evicted.
+*/
+void LicsServer::serverClearDeadClients(long currentSysTime) {
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    LICS_LOCK_GUARD(lk, exclusive_write_or_read_server_license);
+    clientWriteLockWait_->Record(MetricsSinceNs(start));
 
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
+    std::vector<TimerWheel::Timer> due;
+    heartbeatWheel_.Advance(currentSysTime, due);
+
+    for (auto& timer : due) {
+        long token = timer.id;
+        std::shared_ptr<Client> client = clientQ.Find(token);
+        if (!client) {
+            continue;
+        }
+        if (client->ArmedDeadline() != timer.deadline) {
+            continue; // superseded by an earlier deadline, see keepAliveStreamBroken
+        }
 
-    long currentSysTime = GetTimeSecsFromEpoch();// prevent from mulitiple call in the loop
-    for (auto clientIter = clientQ.begin(); clientIter != clientQ.end();) {
-        // check if the client keep alive
-        long token = clientIter->first;
-        std::shared_ptr<Client> client(clientIter->second);
-        long clientLatestHeartbeatTime = client->GetLatestTimestamp();
-        
-        long diff = currentSysTime >= clientLatestHeartbeatTime ? currentSysTime - clientLatestHeartbeatTime : 0; 
         // TODO: read CLIENT_HEARTBEAT_DETECT_INTERVAL_SEC  from conf file.
-        if (diff > CLIENT_HEARTBEAT_DETECT_INTERVAL_SEC) {
-            client->IncHeartbeatTimeoutCnt();
-            SPDLOG_INFO("client({0}) hearbeat timeout reach {1}", token, client->HeartbeatTimeoutCnt());
+        long deadline = client->Deadline();
+        if (deadline > currentSysTime) {
+            heartbeatWheel_.Add(token, deadline);
+            client->SetArmedDeadline(deadline);
+            continue;
         }
 
-        if (!client->Alive()) {
-            std::map<long, std::shared_ptr<AlgoLics>> Lics = client->Algos();
-
-            for (auto& lic : Lics) {
-                long algoID = lic.first;
-                int clientUsedLics = lic.second->totallics();
-                auto algoInLicenseQ = licenseQ.find(algoID);
-                if (algoInLicenseQ != licenseQ.end()) {
-                    int usedLics = algoInLicenseQ->second->usedlics();
-                    algoInLicenseQ->second->set_usedlics(usedLics - clientUsedLics);
-                }
-            }
-            SPDLOG_INFO("detect heatbeat-stoped client. remove token:{0}", token);
-            clientIter = clientQ.erase(clientIter);
-        } else {
-            ++clientIter;
+        // mark first, a licsAlloc racing with us will see it and give its grant back.
+        client->MarkEvicted();
+        if (wal_) {
+            wal_->Evict(token);
         }
+        registerClientAlgos(client, -1);
+        evictClientLics(client);
+        SPDLOG_INFO("detect heatbeat-stoped client. remove token:{0}, latest heartbeat:{1}", token, client->GetLatestTimestamp());
+        clientQ.Erase(token);
+        --clientNum_;
+        clientsEvicted_->Add();
     }
 }
 
+// ledger counters are atomics and read without a lock, only the client table walk takes it.
 void LicsServer::print() {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
-
-    std::string allLics("server licenses big picture\nalgo\t total\t used");
-    for (auto& lics : licenseQ) {
+    std::string allLics("server licenses big picture\nalgo\t total\t used\t reserved");
+    for (auto& lics : ledger_.Entries()) {
         long algo = lics.first;
-        int total = lics.second->totallics();
-        int used = lics.second->usedlics();
+        int total = lics.second->total;
+        int used = lics.second->used;
+        int reserved = lics.second->reserved;
 
-        allLics += "\n" + std::to_string(algo) + "\t " + std::to_string(total) + "\t " + std::to_string(used);
+        allLics += "\n" + std::to_string(algo) + "\t " + std::to_string(total) + "\t " + std::to_string(used) + "\t " + std::to_string(reserved);
     }
     SPDLOG_INFO(allLics);
 
-    for (auto& c : clientQ) {
-        long token = c.first;
-        std::string clientLics("client({0}) license\nalgo\t total\t used");
-        
-        std::map<long, std::shared_ptr<AlgoLics>> algo = c.second->Algos();
-        for (auto& a : algo) {
-            long algo = a.first;
-            int total = a.second->totallics();
-            int used = a.second->usedlics();
-
-            clientLics += "\n" + std::to_string(algo) + "\t " + std::to_string(total) + "\t " + std::to_string(used);
-        }
-        SPDLOG_INFO(clientLics, token);
+    // the table may grow under a registration, it is walked under the read lock, once, and logged after.
+    std::vector<std::pair<long, std::string>> clients;
+    {
+        LICS_READ_LOCK_GUARD(lk, exclusive_write_or_read_server_license);
+        clientQ.ForEach([this, &clients](long token, const std::shared_ptr<Client>& client) {
+            std::string clientLics("client({0}) license\nalgo\t total\t used");
+            for (auto& a : ledger_.Entries()) {
+                long algo = a.first;
+                int total = client->HeldLics(a.second->slot);
+                int used = total;
+
+                clientLics += "\n" + std::to_string(algo) + "\t " + std::to_string(total) + "\t " + std::to_string(used);
+            }
+            clients.push_back(std::make_pair(token, clientLics));
+        });
+    }
+    for (auto& c : clients) {
+        SPDLOG_INFO(c.second, c.first);
     }
     
 }
 
-void LicsServer::doLoop() {
-    // when LicsServer start up, make it fetch license data as soon as possible.
-    std::map<long, std::shared_ptr<AlgoLics>> remoteAlgosTotalLic;
-    fetchAlgosTotalLicFromCloud(remoteAlgosTotalLic);
-    updateLocalLics(remoteAlgosTotalLic);
+void LicsServer::addHousekeepingTask(void (LicsServer::*run)(), const std::string& confKey, int defSec) {
+    int sec = getServerConf()->GetIntItem(confKey, defSec);
+    if (sec <= 0) {
+        SPDLOG_ERROR("invalid {0}:{1}, use {2}", confKey, sec, defSec);
+        sec = defSec;
+    }
 
-    int every_30s_continue_do_next = 0;
-    while (running_) {
-        ++every_30s_continue_do_next;
-        
-        std::shared_ptr<LicsServerEvent> ev = dequeue();
-        if (ev) {
-            if (gotExitSignal(ev)) {
-                SPDLOG_ERROR("got a signal to exit");
-                return;
+    HousekeepingTask task;
+    task.run = run;
+    task.period = std::chrono::milliseconds(sec * 1000);
+    tasks_.push_back(task);
+}
+
+/*
+* clients come back with their tokens, registered algorithms and licenses, and a full heartbeat
+* timeout to show up again. ledger counters are rebuilt from what the clients hold.
+*/
+void LicsServer::recoverClients() {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    WalState state;
+    if (!wal_->Recover(state)) {
+        SPDLOG_ERROR("wal recovery failed, allocations are not logged");
+        wal_.reset();
+        return;
+    }
+
+    LICS_LOCK_GUARD(lk, exclusive_write_or_read_server_license);
+    for (auto& logged : state.clients) {
+        std::shared_ptr<Client> c = newClient(logged.first);
+        AlgoLics lics;
+        for (auto& a : logged.second.algos) {
+            AlgoLedgerEntry* entry = ledger_.Find(a.first);
+            if (entry && lics.ParseFromString(a.second)) {
+                c->Register(entry->slot, lics.maxlimit());
             }
         }
 
-        // dequeue wake up every 100ms,make the follow code execute every 30s.
-        if (every_30s_continue_do_next < (CLIENT_HEARTBEAT_DETECT_INTERVAL_SEC * 1000) / SERVER_TIME_100_MS) {
-            continue;
+        // racing grants and frees are replayed in any order, only their sum is right.
+        for (auto& held : logged.second.held) {
+            AlgoLedgerEntry* entry = ledger_.Find(held.first);
+            if (entry && held.second > 0) {
+                c->AddLics(entry->slot, held.second);
+                entry->used += held.second;
+            }
+        }
+        for (auto& reserved : logged.second.reserved) {
+            AlgoLedgerEntry* entry = ledger_.Find(reserved.first);
+            if (entry && reserved.second > 0) {
+                c->AddReserved(entry->slot, reserved.second);
+                entry->reserved += reserved.second;
+                entry->used += reserved.second;
+            }
         }
-        every_30s_continue_do_next = 0;
 
-        serverClearDeadClients();
+        clientQ.Insert(logged.first, c);
+        ++clientNum_;
+        heartbeatWheel_.Add(logged.first, c->Deadline());
+        c->SetArmedDeadline(c->Deadline());
+        registerClientAlgos(c, 1);
+    }
+
+    // a restart in the same second must not hand out a token that is still live.
+    tokenBase_ = state.tokenBase > tokenBase_ ? state.tokenBase : tokenBase_.load();
+    SPDLOG_INFO("recovered {0} clients from wal in {1} us", state.clients.size(),
+                std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+}
+
+void LicsServer::checkpointWal() {
+    if (!wal_->Checkpoint()) {
+        SPDLOG_ERROR("wal checkpoint failed, segments are kept");
+    }
+}
+
+void LicsServer::walSync() {
+    if (!wal_) {
+        return;
+    }
+    MetricsTimer timer(walSyncWait_);
+    wal_->Sync();
+}
 
+bool LicsServer::syncTotalFromCloud() {
+    std::map<long, std::shared_ptr<AlgoLics>> remoteAlgosTotalLic;
+    {
+        MetricsTimer timer(cloudFetchLatency_);
         fetchAlgosTotalLicFromCloud(remoteAlgosTotalLic);
-        updateLocalLics(remoteAlgosTotalLic);
+    }
+    if (remoteAlgosTotalLic.empty()) {
+        cloudFetchFailures_->Add();
+        SPDLOG_WARN("fetch from cloud failed, keep last known totals");
+        return false;
+    }
 
-        std::map<long, std::shared_ptr<AlgoLics>> cacheAlgosUsedLic;
-        getLocalLics(cacheAlgosUsedLic);
-        pushAlgosUsedLicToCloud(cacheAlgosUsedLic);
-        
-        // TODO: get interval from conf
-    
-        print();
+    // the ledger is only touched when an entitlement changed.
+    std::map<long, int> totals;
+    for (auto& remote : remoteAlgosTotalLic) {
+        totals[remote.first] = remote.second->totallics();
+    }
+    if (totals == appliedTotals_) {
+        cloudFetchUnchanged_->Add();
+        return true;
+    }
+
+    updateLocalLics(remoteAlgosTotalLic);
+    appliedTotals_ = totals;
+    return true;
+}
+
+// the whole backlog goes in one post, on failure it is put back and merges with what comes next.
+bool LicsServer::syncUsedToCloud() {
+    std::vector<UsageSample> samples;
+    usage_.Take(samples);
+    if (samples.empty()) {
+        return true;
+    }
+
+    MetricsTimer timer(cloudPushLatency_);
+    std::string body = UsageBacklog::Encode(samples);
+    std::string reply;
+    int ret = getHttpClient()->Post(PUSH_ALGOS_USED_LICS_URL, body, reply);
+    for (int retry = 0; ret != EHTTP_OK && retry < usagePushRetries_ && running_; ++retry) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(USAGE_PUSH_RETRY_BACKOFF_MS << retry));
+        ret = getHttpClient()->Post(PUSH_ALGOS_USED_LICS_URL, body, reply);
+    }
+
+    if (ret != EHTTP_OK) {
+        cloudPushFailures_->Add();
+        SPDLOG_WARN("push usage to cloud failed:{0}, keep {1} samples", ret, samples.size());
+        usage_.PutBack(samples);
+        return false;
+    }
+
+    return true;
+}
+
+void LicsServer::requestCloudFetch() {
+    cloud_->RequestFetch();
+}
+
+void LicsServer::requestCloudPush() {
+    std::map<long, std::shared_ptr<AlgoLics>> local;
+    getLocalLics(local);
+    pushAlgosUsedLicToCloud(local);
+}
+
+/*
+* sleeps until the earliest task deadline or an event, whichever comes first. a task is
+* rescheduled from its own deadline rather than from when it ran, so periods do not drift;
+* a task that fell behind by more than one period skips the runs it missed.
+*/
+void LicsServer::doLoop() {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    for (auto& task : tasks_) {
+        task.due = now + task.period;
+    }
+
+    while (running_) {
+        std::chrono::steady_clock::time_point deadline = now + std::chrono::hours(1);
+        for (auto& task : tasks_) {
+            deadline = task.due < deadline ? task.due : deadline;
+        }
+
+        std::shared_ptr<LicsServerEvent> ev = dequeue(deadline);
+        if (gotExitSignal(ev)) {
+            SPDLOG_ERROR("got a signal to exit");
+            return;
+        }
+
+        now = std::chrono::steady_clock::now();
+        for (auto& task : tasks_) {
+            if (task.due > now) {
+                continue;
+            }
+
+            (this->*task.run)();
+            task.due += task.period;
+            if (task.due <= now) {
+                task.due = now + task.period;
+            }
+        }
     }
 }
 
 void LicsServer::licsQuery(long token, long algoID, int& total, int& used) {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
     total = 0;
     used = 0;
-    // add lock
-    auto client = clientQ.find(token); // search client
-    if (client == clientQ.end()) {
+
+    if (!findClient(token)) {
         SPDLOG_ERROR("client({0}) query license failed:no exist user", token);
         return ;
     }
 
-    auto algo = licenseQ.find(algoID);
-    if (algo == licenseQ.end()) {
+    AlgoLedgerEntry* algo = ledger_.Find(algoID);
+    if (!algo) {
         SPDLOG_ERROR("client({0}) query license failed:no exist algorithm id:{1}", token, algoID);
         return ;
     }
 
     // get total and used lics by algorithm id
-    total = algo->second->totallics();
-    used = algo->second->usedlics();
+    total = algo->total;
+    used = algo->used;
 }
 
 int LicsServer::totalClientNum() {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
-    return clientQ.size();
+    LICS_READ_LOCK_GUARD(lk, exclusive_write_or_read_server_license);
+    return clientQ.Size();
 }
 
 int LicsServer::clientNumByAlgoID(long algoID) {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
-    int num = 0;
-    for(auto client : clientQ) {
-        if (client.second->HaveAlgoID(algoID)) {
-            ++num;
-        }
+    AlgoLedgerEntry* algo = ledger_.Find(algoID);
+    if (!algo) {
+        return 0;
     }
-    return num;
+
+    return algo->clients;
 }
 
-int LicsServer::licsAlloc(long token, long algoID, int expected) {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
+int LicsServer::reservedLicsByAlgoID(long algoID) {
+    AlgoLedgerEntry* algo = ledger_.Find(algoID);
+    if (!algo) {
+        return 0;
+    }
 
-    auto client = clientQ.find(token); // search client
-    if (client == clientQ.end()) {
+    return algo->reserved;
+}
+
+// keep per-algorithm client count in step with clientQ, delta is 1 on register and -1 on eviction.
+void LicsServer::registerClientAlgos(std::shared_ptr<Client> client, int delta) {
+    for (int slot = 0; slot < client->Slots(); ++slot) {
+        if (client->Registered(slot)) {
+            ledger_.At(slot)->clients += delta;
+        }
+    }
+}
+
+/*
+* clientQ is only locked for the lookup, the grant itself is a CAS on the ledger counter,
+* so allocations on different algorithms (or different clients) never wait for each other.
+*/
+int LicsServer::licsAlloc(long token, long algoID, int expected, bool reservoir) {
+    std::shared_ptr<Client> client = findClient(token); // search client
+    if (!client) {
         SPDLOG_ERROR("client({0}) alloc license failed:no exist user", token);
         return 0;
     }
 
-    auto algo = licenseQ.find(algoID);
-    if (algo == licenseQ.end()) {
+    return licsAlloc(client, algoID, expected, reservoir);
+}
+
+int LicsServer::licsAlloc(const std::shared_ptr<Client>& client, long algoID, int expected, bool reservoir) {
+    long token = client->GetToken();
+    AlgoLedgerEntry* algo = ledger_.Find(algoID);
+    if (!algo) {
         SPDLOG_ERROR("client({0}) alloc license failed:no exist algorithm id:{1}", token, algoID);
         return 0;
     }
+    client->UpdateTimestamp(); // a request of a known client counts as a heartbeat
 
-    if (algo->second->algo().type() != TaskType::VIDEO) {
+    if (algo->type != TaskType::VIDEO) {
         SPDLOG_ERROR("incorrect call, only support VIDEO lics alloc:client({0}), algorithm id({1})", token, algoID);
         return 0;
     }
 
-    // get total and used lics by algorithm id
-    int total = algo->second->totallics();
-    int used = algo->second->usedlics();
+    if (reservoir) {
+        // concurrent leases of one client are checked against the same holding, so they may overshoot
+        // the ceiling by one lease at most.
+        int room = reservoirCeiling_ - client->ReservedLics(algo->slot);
+        expected = expected < room ? expected : room;
+        if (expected <= 0) {
+            return 0;
+        }
+    }
 
-    int actualAllocedLics = (total - used) >= expected ? expected : (total - used);
-    algo->second->set_usedlics(used + actualAllocedLics);// update used licenses for algorithm
-    client->second->AddLics(algoID, actualAllocedLics); // update used licenses for client
+    int actualAllocedLics = ledger_.Grant(algo, expected); // update used licenses for algorithm
+    if (reservoir) {
+        client->AddReserved(algo->slot, actualAllocedLics);
+        algo->reserved += actualAllocedLics;
+    } else {
+        client->AddLics(algo->slot, actualAllocedLics); // update used licenses for client
+    }
 
+    if (client->Evicted()) {
+        // sweeper removed the client during the grant, whatever it did not drain is given back here.
+        int reserved = client->DrainReserved(algo->slot);
+        algo->reserved -= reserved;
+        ledger_.Release(algo, client->DrainLics(algo->slot) + reserved);
+        SPDLOG_ERROR("client({0}) alloc license failed:user evicted", token);
+        return 0;
+    }
+    if (wal_ && actualAllocedLics > 0) {
+        wal_->Grant(token, algoID, actualAllocedLics, reservoir);
+    }
+
+    auto algoMetrics = algoMetrics_.find(algoID); // ledger algorithm, always there
+    algoMetrics->second.granted->Add(actualAllocedLics);
+    if (expected > actualAllocedLics) {
+        algoMetrics->second.denied->Add(expected - actualAllocedLics);
+    }
     return actualAllocedLics;
 }
 
-int LicsServer::licsFree(long token, long algoID, int expected) { 
-
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
+int LicsServer::licsFree(long token, long algoID, int expected, bool reservoir) { 
 
-    auto client = clientQ.find(token); // search client
-    if (client == clientQ.end()) {
+    std::shared_ptr<Client> client = findClient(token); // search client
+    if (!client) {
         SPDLOG_ERROR("client({0}) free license failed:no exist user", token);
         return 0;
     }
 
-    auto algo = licenseQ.find(algoID);
-    if (algo == licenseQ.end()) {
-        SPDLOG_ERROR("client({0}) free license failed:no exist algorithm id:{1}", token, algoID);
+    return licsFree(client, algoID, expected, reservoir);
+}
+
+int LicsServer::licsFree(const std::shared_ptr<Client>& client, long algoID, int expected, bool reservoir) {
+    AlgoLedgerEntry* algo = ledger_.Find(algoID);
+    if (!algo) {
+        SPDLOG_ERROR("client({0}) free license failed:no exist algorithm id:{1}", client->GetToken(), algoID);
         return 0;
     }
+    client->UpdateTimestamp();
 
-    int used = algo->second->usedlics();
-
-    int actualFreeLics = used >= expected ? expected : used;
-    algo->second->set_usedlics(used - actualFreeLics);// update used licenses for algorithm
-    client->second->DecLics(algoID, actualFreeLics); // update used licenses for client
+    // a client can only give back what it holds.
+    int actualFreeLics = 0;
+    if (reservoir) {
+        actualFreeLics = client->DecReserved(algo->slot, expected);
+        algo->reserved -= actualFreeLics;
+    } else {
+        actualFreeLics = client->DecLics(algo->slot, expected); // update used licenses for client
+    }
+    ledger_.Release(algo, actualFreeLics);// update used licenses for algorithm
+    if (wal_ && actualFreeLics > 0) {
+        wal_->Free(client->GetToken(), algoID, actualFreeLics, reservoir);
+    }
 
     return actualFreeLics;
 }
 
-long LicsServer::newClientToken() {
+// give every license of an evicted client back to the ledger, task grants and reservoir leases alike.
+void LicsServer::evictClientLics(const std::shared_ptr<Client>& client) {
+    for (int slot = 0; slot < client->Slots(); ++slot) {
+        AlgoLedgerEntry* entry = ledger_.At(slot);
+        int reserved = client->DrainReserved(slot);
+        entry->reserved -= reserved;
+        ledger_.Release(entry, client->DrainLics(slot) + reserved);
+    }
+}
+
+// one block of clientPool_ for the client and its control block, no matter who drops it last.
+std::shared_ptr<Client> LicsServer::newClient(long token) {
+    return std::allocate_shared<Client>(PoolAllocator<Client>(clientPool_), token, ledger_);
+}
 
-    // TODO: add lock
-    tokenBase_++;
-    return tokenBase_;
+long LicsServer::newClientToken() {
+    return ++tokenBase_;
 }
 
 
 Status LicsServer::createLics(const CreateLicsRequest* request, CreateLicsResponse* response) {
+    MetricsTimer timer(rpcLatency_[RPC_CREATE_LICS]);
     // when SPDLOG_ACTIVE_LEVEL macro beyond SPDLOG_LEVEL_DEBUG, all SPDLOG_DEBUG will be not compiled.
     SPDLOG_DEBUG("client({0}) send lics alloc request: vendor({1}), type({2}), algorithm_id({3}), expected_lics({4})", 
                 request->token(),
@@ -563,7 +865,8 @@ Status LicsServer::createLics(const CreateLicsRequest* request, CreateLicsRespon
     response->mutable_algo()->set_type(request->algo().type());
     response->mutable_algo()->set_algorithmid(request->algo().algorithmid());
 
-    int licsNum = licsAlloc(clientToken, request->algo().algorithmid(), request->clientexpectedlicsnum());
+    int licsNum = licsAlloc(clientToken, request->algo().algorithmid(), request->clientexpectedlicsnum(), request->reservoir());
+    walSync();
     response->set_clientgetactuallicsnum(licsNum);
     response->set_respcode(ELICS_OK);
 
@@ -579,6 +882,7 @@ Status LicsServer::createLics(const CreateLicsRequest* request, CreateLicsRespon
 }
 
 Status LicsServer::deleteLics(const DeleteLicsRequest* request, DeleteLicsResponse* response) {
+    MetricsTimer timer(rpcLatency_[RPC_DELETE_LICS]);
     SPDLOG_DEBUG("client({0}) send lics free request: vendor({1}), type({2}), algorithm_id({3}), lics({4}), request_id({5})",
                 request->token(),
                 request->algo().vendor(),
@@ -593,7 +897,8 @@ Status LicsServer::deleteLics(const DeleteLicsRequest* request, DeleteLicsRespon
     response->mutable_algo()->set_type(request->algo().type());
     response->mutable_algo()->set_algorithmid(request->algo().algorithmid());
 
-    int licsNum = licsFree(clientToken, request->algo().algorithmid(), request->licsnum());
+    int licsNum = licsFree(clientToken, request->algo().algorithmid(), request->licsnum(), request->reservoir());
+    walSync();
     response->set_licsnum(licsNum);
     response->set_respcode(ELICS_OK);
 
@@ -608,35 +913,130 @@ Status LicsServer::deleteLics(const DeleteLicsRequest* request, DeleteLicsRespon
     return Status::OK;                   
 }
 
+/*
+* the client is looked up once for the whole batch, so the only lock a batch takes is one
+* read side of the client map. items are then granted one by one on the ledger counters.
+*/
+Status LicsServer::batchCreateLics(const BatchCreateLicsRequest* request, BatchCreateLicsResponse* response) {
+    MetricsTimer timer(rpcLatency_[RPC_BATCH_CREATE_LICS]);
+    long clientToken = request->token();
+    response->set_token(clientToken);
+
+    std::shared_ptr<Client> client = findClient(clientToken);
+    if (!client) {
+        SPDLOG_ERROR("client({0}) batch alloc license failed:no exist user", clientToken);
+        response->set_respcode(ELICS_CLIENT_NOT_EXIST);
+        return Status::OK;
+    }
+
+    for (int idx = 0; idx < request->items_size(); ++idx) {
+        const CreateLicsRequest& item = request->items(idx);
+        CreateLicsResponse* result = response->add_items();
+        result->set_token(clientToken);
+        result->set_requestid(0);// to be fixed
+        result->mutable_algo()->CopyFrom(item.algo());
+        result->set_clientgetactuallicsnum(licsAlloc(client, item.algo().algorithmid(), item.clientexpectedlicsnum(), item.reservoir()));
+        result->set_respcode(ELICS_OK);
+    }
+    walSync();
+    SPDLOG_DEBUG("response client({0}) batch lics alloc request: items({1})", clientToken, response->items_size());
+
+    response->set_respcode(ELICS_OK);
+    return Status::OK;
+}
+
+Status LicsServer::batchDeleteLics(const BatchDeleteLicsRequest* request, BatchDeleteLicsResponse* response) {
+    MetricsTimer timer(rpcLatency_[RPC_BATCH_DELETE_LICS]);
+    long clientToken = request->token();
+    response->set_token(clientToken);
+
+    std::shared_ptr<Client> client = findClient(clientToken);
+    if (!client) {
+        SPDLOG_ERROR("client({0}) batch free license failed:no exist user", clientToken);
+        response->set_respcode(ELICS_CLIENT_NOT_EXIST);
+        return Status::OK;
+    }
+
+    for (int idx = 0; idx < request->items_size(); ++idx) {
+        const DeleteLicsRequest& item = request->items(idx);
+        DeleteLicsResponse* result = response->add_items();
+        result->set_token(clientToken);
+        result->set_requestid(0);// to be fixed
+        result->mutable_algo()->CopyFrom(item.algo());
+        result->set_licsnum(licsFree(client, item.algo().algorithmid(), item.licsnum(), item.reservoir()));
+        result->set_respcode(ELICS_OK);
+    }
+    walSync();
+    SPDLOG_DEBUG("response client({0}) batch lics free request: items({1})", clientToken, response->items_size());
+
+    response->set_respcode(ELICS_OK);
+    return Status::OK;
+}
+
 Status LicsServer::queryLics(const QueryLicsRequest* request, QueryLicsResponse* response) {
+    MetricsTimer timer(rpcLatency_[RPC_QUERY_LICS]);
     //response->set_total(300);
     return Status::OK;              
 }
 
 Status LicsServer::getAuthAccess(const GetAuthAccessRequest* request, GetAuthAccessResponse* response) {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
-
+    MetricsTimer timer(rpcLatency_[RPC_GET_AUTH_ACCESS]);
     SPDLOG_DEBUG("client({0}) send auth access request: ip({1}), port({2})",
                 request->token(),
                 request->ip(),
                 request->port());
     long token = request->token(); // bug to be fixed:: make sure token is 64bits field.
 
-    // TODO: check if token is exist or not, if exist then reallocted a token for client and print error
-    auto search = clientQ.find(token);
-    if (search != clientQ.end()) {
-        SPDLOG_INFO("find a same token client:{0}", token);
+    // a client coming back with a token server still knows resumes it, licenses and leases included.
+    std::shared_ptr<Client> known = findClient(token);
+    if (known && !known->Evicted()) {
+        known->UpdateTimestamp();
+        int intervalMs = 0;
+        int jitterMs = 0;
+        heartbeatPace(token, intervalMs, jitterMs);
+        response->set_heartbeatintervalms(intervalMs);
+        response->set_heartbeatjitterms(jitterMs);
+        response->set_token(token);
+        response->set_respcode(ELICS_OK);
+        SPDLOG_INFO("client({0}) resumed", token);
+        return Status::OK;
     }
     long newToken = newClientToken();
     //SPDLOG_INFO("allocate a new token:{0}", newToken);
 
-    std::map<long, std::shared_ptr<AlgoLics>> algo;
+    // build client outside of the lock, only the insertion needs it.
+    std::shared_ptr<Client> c = newClient(newToken);
     for (int idx = 0; idx < request->lics_size(); ++idx ) {
-        algo[request->lics(idx).algo().algorithmid()] = std::make_shared<AlgoLics>(request->lics(idx));
+        AlgoLedgerEntry* entry = ledger_.Find(request->lics(idx).algo().algorithmid());
+        if (entry) {
+            c->Register(entry->slot, request->lics(idx).maxlimit());
+        }
     }
-    std::shared_ptr<Client> c = std::make_shared<Client>(newToken, algo);
-    clientQ[newToken] = c;
+    std::map<long, std::string> logged;
+    for (int idx = 0; wal_ && idx < request->lics_size(); ++idx) {
+        request->lics(idx).SerializeToString(&logged[request->lics(idx).algo().algorithmid()]);
+    }
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        LICS_LOCK_GUARD(lk, exclusive_write_or_read_server_license);
+        clientWriteLockWait_->Record(MetricsSinceNs(start));
+        clientQ.Insert(newToken, c);
+        ++clientNum_;
+        clientsRegistered_->Add();
+        heartbeatWheel_.Add(newToken, c->Deadline());
+        c->SetArmedDeadline(c->Deadline());
+        registerClientAlgos(c, 1);
+        if (wal_) {
+            wal_->Register(newToken, logged); // in the lock, so it comes before any grant of the client
+        }
+    }
+    walSync();
 
+    int intervalMs = 0;
+    int jitterMs = 0;
+    heartbeatPace(newToken, intervalMs, jitterMs);
+    response->set_heartbeatintervalms(intervalMs);
+    response->set_heartbeatjitterms(jitterMs);
     response->set_token(newToken);
     response->set_respcode(ELICS_OK);
 
@@ -650,38 +1050,69 @@ Status LicsServer::getAuthAccess(const GetAuthAccessRequest* request, GetAuthAcc
     return Status::OK;             
 }
 
-void LicsServer::clientTellServerStillAlive(long token) {
-    std::lock_guard<std::mutex> lk(exclusive_write_or_read_server_license);
-    auto client = clientQ.find(token);
-    if (client == clientQ.end()) {
+std::shared_ptr<Client> LicsServer::clientTellServerStillAlive(long token) {
+    std::shared_ptr<Client> client = findClient(token);
+    if (!client) {
         SPDLOG_INFO("client({0}) not exist", token);
-        return;
+        return nullptr;
     }
-    // update client timestamp
-    client->second->UpdateTimestamp();
-    return;
+    // re-arm the heartbeat timer, the wheel picks the new deadline up when the old one comes due.
+    client->UpdateTimestamp();
+    return client;
+}
+
+// unknown client or algorithm get nothing, same as licsQuery.
+int LicsServer::pictureShare(const std::shared_ptr<Client>& client, const AlgoLics& lics) {
+    AlgoLedgerEntry* algo = client ? ledger_.Find(lics.algo().algorithmid()) : nullptr;
+    if (!algo) {
+        return 0;
+    }
+
+    int clientMaxLimit = lics.maxlimit();
+    int clientNum = algo->clients;
+    int totalLics = algo->total;
+    int average = clientNum > 0 ? (totalLics / clientNum) : totalLics;
+    return average > clientMaxLimit ? clientMaxLimit : average;
+}
+
+/*
+* the interval grows in proportion to the client count once it passes heartbeat_busy_clients,
+* up to the detect interval. the jitter spreads clients over HEARTBEAT_JITTER_SLOTS slots of one
+* interval by token, so it stays the same for a client as long as the interval does.
+*/
+void LicsServer::heartbeatPace(long token, int& intervalMs, int& jitterMs) {
+    long interval = heartbeatIntervalMs_ > 0 ? heartbeatIntervalMs_ : DEFAULT_HEARTBEAT_INTERVAL_MS;
+    int clients = clientNum_;
+    if (heartbeatBusyClients_ > 0 && clients > heartbeatBusyClients_) {
+        interval = interval * clients / heartbeatBusyClients_;
+    }
+
+    intervalMs = interval < MAX_HEARTBEAT_INTERVAL_MS ? interval : MAX_HEARTBEAT_INTERVAL_MS;
+    jitterMs = (token % HEARTBEAT_JITTER_SLOTS) * (intervalMs / HEARTBEAT_JITTER_SLOTS);
 }
 
 Status LicsServer::keepAlive(const KeepAliveRequest* request, KeepAliveResponse* response) {
+    MetricsTimer timer(rpcLatency_[RPC_KEEP_ALIVE]);
 
     long clientToken = request->token();
-    clientTellServerStillAlive(clientToken);
+    // the only lock a heartbeat takes, fair share below reads ledger counters directly.
+    std::shared_ptr<Client> client = clientTellServerStillAlive(clientToken);
 
     // TODO: allocte licence for picture
-    std::string kp = "client({0}) lics: {1} \nvendor type algorithmID requestID totalLics usedLics clientMaxLimit\n";
     for (int idx = 0; idx < request->lics_size(); ++idx ) {
         if (request->lics(idx).algo().type() == TaskType::PICTURE) {
-            int clientMaxLimit = request->lics(idx).maxlimit();
-            long algoID = request->lics(idx).algo().algorithmid();
-
-            int clientNum = clientNumByAlgoID(algoID);
-            int totalLics = 0;
-            int usedLics = 0;
-            licsQuery(clientToken, algoID, totalLics,usedLics);
-            int average = clientNum > 0 ? (totalLics / clientNum) : totalLics;
-            int clientFetchLics = average > clientMaxLimit ? clientMaxLimit : average;
-            response->add_lics()->set_totallics(clientFetchLics);
+            AlgoLics* lics = response->add_lics();
+            lics->mutable_algo()->set_vendor(request->lics(idx).algo().vendor());
+            lics->mutable_algo()->set_type(request->lics(idx).algo().type());
+            lics->mutable_algo()->set_algorithmid(request->lics(idx).algo().algorithmid());
+            lics->set_totallics(pictureShare(client, request->lics(idx)));
         }
+    }
+
+// the dump is only built when debug logs are compiled in.
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+    std::string kp = "client({0}) lics: {1} \nvendor type algorithmID requestID totalLics usedLics clientMaxLimit\n";
+    for (int idx = 0; idx < request->lics_size(); ++idx ) {
         kp += std::to_string(request->lics(idx).algo().vendor()) + "\t" + 
                 std::to_string(request->lics(idx).algo().type()) + "\t" +
                 std::to_string(request->lics(idx).algo().algorithmid()) + "\t" +
@@ -691,11 +1122,120 @@ Status LicsServer::keepAlive(const KeepAliveRequest* request, KeepAliveResponse*
                 std::to_string(request->lics(idx).maxlimit()) + "\n";
     }
     SPDLOG_DEBUG(kp, clientToken, request->lics_size());
+#endif
+    int intervalMs = 0;
+    int jitterMs = 0;
+    heartbeatPace(clientToken, intervalMs, jitterMs);
+    response->set_heartbeatintervalms(intervalMs);
+    response->set_heartbeatjitterms(jitterMs);
     response->set_token(clientToken);
     response->set_respcode(ELICS_OK);
     return Status::OK;             
 }
 
+bool LicsServer::keepAliveStream(KeepAliveSession& session, const KeepAliveRequest* request, KeepAliveResponse* response) {
+    MetricsTimer timer(rpcLatency_[RPC_KEEP_ALIVE_STREAM]);
+    if (!session.client) {
+        session.token = request->token();
+        session.client = findClient(session.token);
+    }
+
+    response->set_token(session.token);
+    if (!session.client || session.client->Evicted()) {
+        // tell client to get authorized again, its token is gone.
+        SPDLOG_INFO("client({0}) not exist", session.token);
+        response->set_respcode(ELICS_CLIENT_NOT_EXIST);
+        return true;
+    }
+    session.client->UpdateTimestamp();
+
+    if (request->delta()) {
+        // an empty delta keeps the version, any change moves it by one.
+        long expected = request->lics_size() > 0 ? session.version + 1 : session.version;
+        if (request->version() != expected) {
+            SPDLOG_WARN("client({0}) heartbeat version({1}) out of sync, expect {2}", session.token, request->version(), expected);
+            response->set_respcode(ELICS_HEARTBEAT_OUT_OF_SYNC);
+            return true;
+        }
+    } else {
+        session.lics.clear(); // full snapshot replaces what client reported before
+    }
+    session.version = request->version();
+
+    for (int idx = 0; idx < request->lics_size(); ++idx ) {
+        if (request->lics(idx).algo().type() == TaskType::PICTURE) {
+            session.lics[request->lics(idx).algo().algorithmid()] = request->lics(idx);
+        }
+    }
+
+    // forget shares of algorithms a full snapshot no longer carries.
+    for (auto iter = session.shares.begin(); !request->delta() && iter != session.shares.end();) {
+        if (session.lics.find(iter->first) == session.lics.end()) {
+            iter = session.shares.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+
+    // shares move with totals and client counts, so every beat recomputes all of them.
+    for (auto& iter : session.lics) {
+        int share = pictureShare(session.client, iter.second);
+        auto last = session.shares.find(iter.first);
+        if (session.answered && last != session.shares.end() && last->second == share) {
+            continue;
+        }
+        session.shares[iter.first] = share;
+
+        AlgoLics* lics = response->add_lics();
+        lics->mutable_algo()->set_vendor(iter.second.algo().vendor());
+        lics->mutable_algo()->set_type(iter.second.algo().type());
+        lics->mutable_algo()->set_algorithmid(iter.first);
+        lics->set_totallics(share);
+    }
+
+    int intervalMs = 0;
+    int jitterMs = 0;
+    heartbeatPace(session.token, intervalMs, jitterMs);
+    bool paceChanged = (intervalMs != session.heartbeatIntervalMs);
+    if (session.answered && response->lics_size() == 0 && !paceChanged) {
+        return false;
+    }
+    session.heartbeatIntervalMs = intervalMs;
+    response->set_heartbeatintervalms(intervalMs);
+    response->set_heartbeatjitterms(jitterMs);
+
+    response->set_version(session.version);
+    response->set_respcode(ELICS_OK);
+    session.answered = true;
+    return true;
+}
+
+/*
+* stream is gone, so is the client, unless it comes back with a unary heartbeat or a new
+* stream before the next sweep. the wheel entry is pulled forward to now.
+*/
+void LicsServer::keepAliveStreamBroken(KeepAliveSession& session) {
+    if (!session.client || session.client->Evicted()) {
+        return;
+    }
+    SPDLOG_INFO("client({0}) keepalive stream closed", session.token);
+
+    long now = GetTimeSecsFromEpoch();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    LICS_LOCK_GUARD(lk, exclusive_write_or_read_server_license);
+    clientWriteLockWait_->Record(MetricsSinceNs(start));
+    session.client->Expire(now);
+    if (session.client->ArmedDeadline() > now) {
+        heartbeatWheel_.Add(session.token, now);
+        session.client->SetArmedDeadline(now);
+    }
+}
+
+Status LicsServer::getMetrics(const GetMetricsRequest* request, GetMetricsResponse* response) {
+    response->set_text(metrics_.Render() + LockProfileReport());
+    return Status::OK;
+}
+
 Status LicsServer::CreateLics(ServerContext* context, 
                 const CreateLicsRequest* request, 
                 CreateLicsResponse* response) {
@@ -709,6 +1249,18 @@ Status LicsServer::DeleteLics(ServerContext* context,
     return deleteLics(request, response);
 }
 
+Status LicsServer::BatchCreateLics(ServerContext* context,
+                const BatchCreateLicsRequest* request,
+                BatchCreateLicsResponse* response) {
+    return batchCreateLics(request, response);
+}
+
+Status LicsServer::BatchDeleteLics(ServerContext* context,
+                const BatchDeleteLicsRequest* request,
+                BatchDeleteLicsResponse* response) {
+    return batchDeleteLics(request, response);
+}
+
 Status LicsServer::QueryLics(ServerContext* context, 
                 const QueryLicsRequest* request, 
                 QueryLicsResponse* response) {
@@ -727,24 +1279,107 @@ Status LicsServer::KeepAlive(ServerContext* context,
     return keepAlive(request, response);
 }
 
+/*
+* a stream served here would hold a grpc sync thread for the whole session, one thread per client.
+* only mode=async serves it, see AsyncKeepAliveStreamCall, sync clients fall back to unary KeepAlive.
+*/
+Status LicsServer::KeepAliveStream(ServerContext* context,
+            grpc::ServerReaderWriter<KeepAliveResponse, KeepAliveRequest>* stream) {
+    return Status(grpc::StatusCode::UNIMPLEMENTED, "keepalive stream is served in async mode only");
+}
+
+Status LicsServer::GetMetrics(ServerContext* context,
+            const GetMetricsRequest* request,
+            GetMetricsResponse* response) {
+    return getMetrics(request, response);
+}
+
+
+#define SERVER_DEFAULT_CQ_NUM   (1)
+#define SERVER_DEFAULT_POLLER_NUM   (2)
+
+// parse cpu list like "0,1,2,3", empty means no pinning.
+static std::vector<int> parseCpuList(const std::string& conf) {
+    std::vector<int> cpus;
+    std::stringstream ss(conf);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            cpus.push_back(std::atoi(item.c_str()));
+        }
+    }
+    return cpus;
+}
+
+/*
+* SIGINT and SIGTERM are blocked in every thread and taken by one of their own, which shuts the
+* server down gracefully. once serving stopped for another reason, it is woken up by SIGTERM and
+* sees there is nothing left to do.
+*/
+static void shutdownOnSignal(LicsServer* service, const sigset_t* signals, std::atomic<bool>* served) {
+    int sig = 0;
+    sigwait(signals, &sig);
+    if (!*served) {
+        SPDLOG_INFO("got signal {0}, shut down", sig);
+        service->Shutdown();
+    }
+}
 
 void RunServer() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr); // before any thread starts, they inherit it
+
     std::string server_address("0.0.0.0:" + getServerConf()->GetItem("port")); 
     LicsServer service;
+    std::atomic<bool> served{false};
+    std::thread signalWaiter(shutdownOnSignal, &service, &signals, &served);
 
     grpc::EnableDefaultHealthCheckService(true);
     grpc::reflection::InitProtoReflectionServerBuilderPlugin();
     ServerBuilder builder;
     // Listen on the given address without any authentication mechanism.
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-    // Register "service" as the instance through which we'll communicate with
-    // clients. In this case it corresponds to an *synchronous* service.
-    builder.RegisterService(&service);
-    // Finally assemble the server.
-    std::unique_ptr<Server> server(builder.BuildAndStart());
-    SPDLOG_INFO("Server listening on {0}", server_address);
-
-    // Wait for the server to shutdown. Note that some other thread must be
-    // responsible for shutting down the server for this call to ever return.
-    server->Wait();
-}
\ No newline at end of file
+
+    // mode=async serves rpcs from completion queues with a fixed number of pollers,
+    // otherwise every in-flight rpc occupies a grpc sync thread.
+    if (getServerConf()->GetItem("mode") == "async") {
+        LicsAsyncServer asyncService(&service,
+                    getServerConf()->GetIntItem("cq_num", SERVER_DEFAULT_CQ_NUM),
+                    getServerConf()->GetIntItem("poller_num", SERVER_DEFAULT_POLLER_NUM),
+                    parseCpuList(getServerConf()->GetItem("poller_cpus")));
+        if (asyncService.BuildAndStart(builder)) {
+            service.OnShutdown([&asyncService]() { asyncService.Shutdown(); });
+            SPDLOG_INFO("Server listening on {0}, async mode", server_address);
+
+            // pollers run until Shutdown drained the completion queues.
+            asyncService.Run();
+            service.OnShutdown(nullptr);
+        } else {
+            SPDLOG_ERROR("failed to start server on {0}", server_address);
+        }
+    } else {
+        // Register "service" as the instance through which we'll communicate with
+        // clients. In this case it corresponds to an *synchronous* service.
+        builder.RegisterService(&service);
+        // Finally assemble the server.
+        std::unique_ptr<Server> server(builder.BuildAndStart());
+        if (server) {
+            grpc::Server* s = server.get();
+            service.OnShutdown([s]() { s->Shutdown(); });
+            SPDLOG_INFO("Server listening on {0}", server_address);
+
+            // returns once Shutdown shut the server down.
+            server->Wait();
+            service.OnShutdown(nullptr);
+        } else {
+            SPDLOG_ERROR("failed to start server on {0}", server_address);
+        }
+    }
+
+    served = true;
+    pthread_kill(signalWaiter.native_handle(), SIGTERM);
+    signalWaiter.join();
+}
@@ -0,0 +1,65 @@
+#include "slab_pool.h"
+
+SlabPool::~SlabPool() {
+    for (char* slab : slabs_) {
+        ::operator delete(slab);
+    }
+}
+
+void* SlabPool::Alloc(size_t size) {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (objectSize_ == 0) {
+            // a block must be able to hold the free list link and keep the alignment of the next one.
+            size_t align = alignof(std::max_align_t);
+            objectSize_ = size;
+            blockSize_ = (size < sizeof(FreeBlock) ? sizeof(FreeBlock) : size);
+            blockSize_ = (blockSize_ + align - 1) / align * align;
+        }
+
+        if (size == objectSize_) {
+            if (!free_) {
+                char* slab = static_cast<char*>(::operator new(blockSize_ * SLAB_POOL_BLOCKS));
+                slabs_.push_back(slab);
+                for (size_t idx = SLAB_POOL_BLOCKS; idx > 0; --idx) {
+                    FreeBlock* block = reinterpret_cast<FreeBlock*>(slab + (idx - 1) * blockSize_);
+                    block->next = free_;
+                    free_ = block;
+                }
+                freeBlocks_ += SLAB_POOL_BLOCKS;
+            }
+
+            FreeBlock* block = free_;
+            free_ = block->next;
+            --freeBlocks_;
+            return block;
+        }
+    }
+
+    return ::operator new(size);
+}
+
+void SlabPool::Free(void* block, size_t size) {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (size == objectSize_) {
+            FreeBlock* freed = static_cast<FreeBlock*>(block);
+            freed->next = free_;
+            free_ = freed;
+            ++freeBlocks_;
+            return;
+        }
+    }
+
+    ::operator delete(block);
+}
+
+size_t SlabPool::Slabs() {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return slabs_.size();
+}
+
+size_t SlabPool::FreeBlocks() {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return freeBlocks_;
+}
@@ -0,0 +1,42 @@
+#include "timer_wheel.h"
+
+TimerWheel::TimerWheel(int slots, long now) : slots_(slots > 0 ? slots : 1), current_(now) {
+
+}
+
+void TimerWheel::Add(long id, long deadline) {
+    // an overdue timer goes into the next slot to be processed.
+    long due = deadline > current_ ? deadline : current_ + 1;
+    slots_[due % slots_.size()].push_back(Timer{id, deadline});
+    ++size_;
+}
+
+void TimerWheel::Advance(long now, std::vector<Timer>& expired) {
+    if (now <= current_) {
+        return;
+    }
+
+    // after a long pause every slot is visited once, not once per missed second.
+    long n = static_cast<long>(slots_.size());
+    long from = (now - current_) > n ? now - n + 1 : current_ + 1;
+
+    for (long sec = from; sec <= now; ++sec) {
+        std::vector<Timer>& slot = slots_[sec % n];
+        for (size_t idx = 0; idx < slot.size();) {
+            if (slot[idx].deadline <= now) {
+                expired.push_back(slot[idx]);
+                slot[idx] = slot.back();
+                slot.pop_back();
+                --size_;
+            } else {
+                ++idx; // belongs to a later round
+            }
+        }
+    }
+
+    current_ = now;
+}
+
+size_t TimerWheel::Size() {
+    return size_;
+}
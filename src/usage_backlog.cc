@@ -0,0 +1,102 @@
+#include "usage_backlog.h"
+
+#include "rapidjson/writer.h"
+#include "rapidjson/stringbuffer.h"
+
+UsageSample UsageSample::Merge(const UsageSample& a, const UsageSample& b) {
+    UsageSample merged = b;
+    merged.from = a.from;
+    merged.snapshots = a.snapshots + b.snapshots;
+    for (const auto& algo : a.algos) {
+        auto search = merged.algos.find(algo.first);
+        if (search == merged.algos.end()) {
+            merged.algos.insert(algo);
+        } else if (algo.second.peak > search->second.peak) {
+            search->second.peak = algo.second.peak;
+        }
+    }
+
+    return merged;
+}
+
+UsageBacklog::UsageBacklog(size_t capacity) : capacity_(capacity > 1 ? capacity : 1) {
+
+}
+
+void UsageBacklog::Add(const UsageSample& sample) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    samples_.push_back(sample);
+    shrink();
+}
+
+void UsageBacklog::Take(std::vector<UsageSample>& samples) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    samples.assign(samples_.begin(), samples_.end());
+    samples_.clear();
+}
+
+void UsageBacklog::PutBack(std::vector<UsageSample>& samples) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    samples_.insert(samples_.begin(), samples.begin(), samples.end());
+    samples.clear();
+    shrink();
+}
+
+size_t UsageBacklog::Size() {
+    std::lock_guard<std::mutex> lk(mtx_);
+    return samples_.size();
+}
+
+void UsageBacklog::shrink() {
+    while (samples_.size() > capacity_) {
+        size_t pick = 0;
+        long shortest = samples_[1].to - samples_[0].from;
+        for (size_t idx = 1; idx + 1 < samples_.size(); ++idx) {
+            long span = samples_[idx + 1].to - samples_[idx].from;
+            if (span < shortest) {
+                shortest = span;
+                pick = idx;
+            }
+        }
+
+        samples_[pick] = UsageSample::Merge(samples_[pick], samples_[pick + 1]);
+        samples_.erase(samples_.begin() + pick + 1);
+    }
+}
+
+std::string UsageBacklog::Encode(const std::vector<UsageSample>& samples) {
+    rapidjson::StringBuffer buffer;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+    writer.StartObject();
+    writer.Key("samples");
+    writer.StartArray();
+    for (const auto& sample : samples) {
+        writer.StartObject();
+        writer.Key("from");
+        writer.Int64(sample.from);
+        writer.Key("to");
+        writer.Int64(sample.to);
+        writer.Key("snapshots");
+        writer.Int(sample.snapshots);
+        writer.Key("algos");
+        writer.StartArray();
+        for (const auto& algo : sample.algos) {
+            writer.StartObject();
+            writer.Key("id");
+            writer.Int64(algo.first);
+            writer.Key("total");
+            writer.Int(algo.second.total);
+            writer.Key("used");
+            writer.Int(algo.second.used);
+            writer.Key("peak");
+            writer.Int(algo.second.peak);
+            writer.EndObject();
+        }
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+
+    return std::string(buffer.GetString(), buffer.GetSize());
+}
@@ -8,6 +8,7 @@
 #include "spdlog/sinks/rotating_file_sink.h"
 
 #include <stdlib.h>
+#include <strings.h>
 
 
 
@@ -27,6 +28,23 @@ static size_t doCurlWriteCB(void *data, size_t size, size_t nmemb, void *userp)
     return realsize;
 }
 
+// keeps the value of an ETag header, the header name is case insensitive.
+static size_t doCurlHeaderCB(char *data, size_t size, size_t nitems, void *userp) {
+    size_t realsize = size * nitems;
+    std::string *etag = (std::string*)userp;
+
+    static const char key[] = "etag:";
+    size_t keyLen = sizeof(key) - 1;
+    if (realsize > keyLen && strncasecmp(data, key, keyLen) == 0) {
+        std::string value(data + keyLen, realsize - keyLen);
+        size_t first = value.find_first_not_of(" \t");
+        size_t last = value.find_last_not_of(" \t\r\n");
+        *etag = first == std::string::npos ? "" : value.substr(first, last - first + 1);
+    }
+
+    return realsize;
+}
+
 HttpClient::HttpClient() {
     CURLcode ret = curl_global_init(CURL_GLOBAL_DEFAULT);
     if(ret != CURLE_OK) {
@@ -34,22 +52,43 @@ HttpClient::HttpClient() {
         abort();
     }
     ppCurlHandle = new (CURL*);
-    
+    *ppCurlHandle = nullptr;
+
+    // dns lookups and open connections outlive the easy handle, all calls are serialized by execlusive_op_protect.
+    share_ = curl_share_init();
+    if (share_) {
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    }
 }
 
 HttpClient::~HttpClient() {
 
     if (ppCurlHandle) {
+        closeConn();
         delete ppCurlHandle;
         ppCurlHandle = nullptr;
     }
+    if (share_) {
+        curl_share_cleanup(share_);
+    }
     curl_global_cleanup();
 }
 
 
-// bug to be fixed: cause the method is a syc-ping-pong, it will block indefinity when remote peer don't send a response.
+void HttpClient::SetTimeout(long connectMs, long totalMs) {
+    connectTimeoutMs_ = connectMs;
+    timeoutMs_ = totalMs;
+}
+
 int HttpClient::Get(const std::string& url, std::string& reply) {
-    std::lock_guard<std::mutex> lk(execlusive_op_protect);
+    std::string etag;
+    return Get(url, reply, etag);
+}
+
+// a sync ping-pong, it blocks until the remote peer answers or the timeout set by SetTimeout passes.
+int HttpClient::Get(const std::string& url, std::string& reply, std::string& etag) {
+    LICS_LOCK_GUARD(lk, execlusive_op_protect);
 
     // make sure connection is opened before use, if fail return error
     if (!connIsOpened()) {
@@ -59,40 +98,102 @@ int HttpClient::Get(const std::string& url, std::string& reply) {
         }
     }
 
+    struct curl_slist* headers = nullptr;
+    if (!etag.empty()) {
+        headers = curl_slist_append(headers, ("If-None-Match: " + etag).c_str());
+    }
+
     CURLcode res;
     curl_easy_setopt(*ppCurlHandle, CURLOPT_URL, url.c_str());
     curl_easy_setopt(*ppCurlHandle, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(connectTimeoutMs_));
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_TIMEOUT_MS, static_cast<long>(timeoutMs_));
     //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
     
-    curl_easy_setopt(*ppCurlHandle, CURLOPT_WRITEFUNCTION, doCurlWriteCB);/* send all data to this function  */
     /* we pass our 'chunk' struct to the callback function */
     HttpReply httpReply;
     curl_easy_setopt(*ppCurlHandle, CURLOPT_WRITEDATA, (void *)&httpReply);
-    curl_easy_setopt(*ppCurlHandle, CURLOPT_FOLLOWLOCATION, 1L); // tell us to follow redirection if redirected is need
+    std::string newETag;
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_HEADERDATA, (void *)&newETag);
     res = curl_easy_perform(*ppCurlHandle);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_HTTPHEADER, nullptr);
+    curl_slist_free_all(headers);
+
+    long code = 0;
+    curl_easy_getinfo(*ppCurlHandle, CURLINFO_RESPONSE_CODE, &code);
+    std::unique_ptr<char, void (*)(void*)> response(httpReply.response, free);
     if(res != CURLE_OK) {
-        closeConn();// go around broken connection.
+        // the handle stays, curl drops the broken connection from its cache by itself.
         SPDLOG_ERROR("curl_easy_perform() failed:{0}, URL:{1}", curl_easy_strerror(res), url);
         return EHTTP_GET_FAILURE;
-    }  
-
-    reply.assign(httpReply.response, httpReply.size);
+    }
 
-    if (httpReply.response) {
-        delete httpReply.response;
-        httpReply.size = 0;
+    if (code == 304) {
+        return EHTTP_NOT_MODIFIED;
     }
 
+    etag = newETag;
+    reply.assign(httpReply.response ? httpReply.response : "", httpReply.size);
     return EHTTP_OK;
     
 }
 
-int HttpClient::Put(const std::string& url, HttpReply& reply) {
-    std::lock_guard<std::mutex> lk(execlusive_op_protect);
+int HttpClient::Put(const std::string& url, const std::string& body, std::string& reply) {
+    LICS_LOCK_GUARD(lk, execlusive_op_protect);
+    return send("PUT", url, body, reply);
 }
 
-int HttpClient::Post(const std::string& url, HttpReply& reply) {
-    std::lock_guard<std::mutex> lk(execlusive_op_protect);
+int HttpClient::Post(const std::string& url, const std::string& body, std::string& reply) {
+    LICS_LOCK_GUARD(lk, execlusive_op_protect);
+    return send("POST", url, body, reply);
+}
+
+// caller holds execlusive_op_protect, bounded by the timeouts set by SetTimeout like Get.
+int HttpClient::send(const char* method, const std::string& url, const std::string& body, std::string& reply) {
+    if (!connIsOpened()) {
+        int ret = openConn();
+        if (ret != EHTTP_OK) {
+            return ret;
+        }
+    }
+
+    struct curl_slist* headers = curl_slist_append(nullptr, "Content-Type: application/json");
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_POST, 1L);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_CUSTOMREQUEST, method);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_POSTFIELDS, body.c_str());
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_POSTFIELDSIZE, static_cast<long>(body.size()));
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(connectTimeoutMs_));
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_TIMEOUT_MS, static_cast<long>(timeoutMs_));
+
+    HttpReply httpReply;
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_WRITEDATA, (void *)&httpReply);
+    std::string etag;
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_HEADERDATA, (void *)&etag);
+    CURLcode res = curl_easy_perform(*ppCurlHandle);
+    // the handle is shared with Get, which only switches CURLOPT_HTTPGET back on.
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_CUSTOMREQUEST, nullptr);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_POSTFIELDS, nullptr);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_HTTPHEADER, nullptr);
+    curl_slist_free_all(headers);
+
+    long code = 0;
+    curl_easy_getinfo(*ppCurlHandle, CURLINFO_RESPONSE_CODE, &code);
+    std::unique_ptr<char, void (*)(void*)> response(httpReply.response, free);
+    if (res != CURLE_OK) {
+        SPDLOG_ERROR("curl_easy_perform() failed:{0}, {1} URL:{2}", curl_easy_strerror(res), method, url);
+        return EHTTP_SEND_FAILURE;
+    }
+
+    reply.assign(httpReply.response ? httpReply.response : "", httpReply.size);
+    if (code < 200 || code >= 300) {
+        SPDLOG_ERROR("{0} URL:{1} answered with status {2}", method, url, code);
+        return EHTTP_BAD_STATUS;
+    }
+
+    return EHTTP_OK;
 }
 
 bool HttpClient::connIsOpened() {
@@ -106,6 +207,16 @@ int HttpClient::openConn() {
         return EHTTP_OPEN_CONN_FAILURE;
     }
 
+    // options that never change for the handle, the rest is set per request.
+    if (share_) {
+        curl_easy_setopt(*ppCurlHandle, CURLOPT_SHARE, share_);
+    }
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_NOSIGNAL, 1L); // timeouts must not raise SIGALRM in a threaded server
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_TCP_KEEPALIVE, 1L); // the connection idles between polls
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_WRITEFUNCTION, doCurlWriteCB);/* send all data to this function  */
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_HEADERFUNCTION, doCurlHeaderCB);
+    curl_easy_setopt(*ppCurlHandle, CURLOPT_FOLLOWLOCATION, 1L); // tell us to follow redirection if redirected is need
+
     connOpened = true;
     return EHTTP_OK;
 }
@@ -147,6 +258,22 @@ std::string ServerConf::GetItem(const std::string& key) {
     return std::string("");
 }
 
+int ServerConf::GetIntItem(const std::string& key, int def) {
+    std::string value = GetItem(key);
+    if (value.empty()) {
+        return def;
+    }
+
+    char* end = nullptr;
+    long num = strtol(value.c_str(), &end, 10);
+    if (*end != '\0') {
+        SPDLOG_WARN("conf item({0}) is not a number:{1}, use default:{2}", key, value, def);
+        return def;
+    }
+
+    return static_cast<int>(num);
+}
+
 std::string ServerConf::trim(const std::string& str) {
     std::string trimStr;
 
@@ -177,12 +304,49 @@ void ServerConf::parse(const std::string& line) {
     return;
 }
 
-static std::mutex mtxOfLics;
+RWMutex::RWMutex() {
+    // glibc prefers readers by default, a steady stream of readers would starve writers.
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&rwlock_, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+RWMutex::~RWMutex() {
+    pthread_rwlock_destroy(&rwlock_);
+}
+
+void RWMutex::lock() {
+    pthread_rwlock_wrlock(&rwlock_);
+}
+
+bool RWMutex::try_lock() {
+    return pthread_rwlock_trywrlock(&rwlock_) == 0;
+}
+
+void RWMutex::unlock() {
+    pthread_rwlock_unlock(&rwlock_);
+}
+
+void RWMutex::lock_shared() {
+    pthread_rwlock_rdlock(&rwlock_);
+}
+
+bool RWMutex::try_lock_shared() {
+    return pthread_rwlock_tryrdlock(&rwlock_) == 0;
+}
+
+void RWMutex::unlock_shared() {
+    pthread_rwlock_unlock(&rwlock_);
+}
+
+static LicsMutex mtxOfLics;
 static std::shared_ptr<HttpClient> httpClientOfLics = nullptr;
 static std::shared_ptr<ServerConf> srvConfOfLics = nullptr;
 
 std::shared_ptr<HttpClient> getHttpClient() {
-    std::lock_guard<std::mutex> lk(mtxOfLics);
+    LICS_LOCK_GUARD(lk, mtxOfLics);
     if (!httpClientOfLics) {
         httpClientOfLics = std::make_shared<HttpClient>();
     }
@@ -192,7 +356,7 @@ std::shared_ptr<HttpClient> getHttpClient() {
 
 #define SERVER_CONF_FILE   ("/var/unis/license/server/conf/server.conf")
 std::shared_ptr<ServerConf> getServerConf() {
-    std::lock_guard<std::mutex> lk(mtxOfLics);
+    LICS_LOCK_GUARD(lk, mtxOfLics);
     if (!srvConfOfLics) {
         srvConfOfLics = std::make_shared<ServerConf>(SERVER_CONF_FILE);
     }
@@ -0,0 +1,536 @@
+#include "wal.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+#define WAL_FRAME_HEADER    (8) // payload size and crc, 4 bytes each
+#define WAL_MAX_RECORD  (1 << 20) // anything longer is a torn or garbage header
+#define WAL_SNAPSHOT_MAGIC  (0x4c575331) // "LWS1"
+#define WAL_SEGMENT_PREFIX  "wal."
+#define WAL_SNAPSHOT_FILE   "snapshot"
+
+// records are read back by the host that wrote them, so numbers go in host byte order.
+static void putLong(std::string& out, long value) {
+    int64_t num = value;
+    out.append(reinterpret_cast<const char*>(&num), sizeof(num));
+}
+
+static void putUint(std::string& out, uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+static bool getLong(const char*& pos, const char* end, long& value) {
+    int64_t num = 0;
+    if (end - pos < static_cast<long>(sizeof(num))) {
+        return false;
+    }
+    memcpy(&num, pos, sizeof(num));
+    pos += sizeof(num);
+    value = num;
+    return true;
+}
+
+static bool getUint(const char*& pos, const char* end, uint32_t& value) {
+    if (end - pos < static_cast<long>(sizeof(value))) {
+        return false;
+    }
+    memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+}
+
+static bool getBytes(const char*& pos, const char* end, std::string& value) {
+    uint32_t size = 0;
+    if (!getUint(pos, end, size) || static_cast<uint32_t>(end - pos) < size) {
+        return false;
+    }
+    value.assign(pos, size);
+    pos += size;
+    return true;
+}
+
+static void putAlgos(std::string& out, const std::map<long, std::string>& algos) {
+    putUint(out, algos.size());
+    for (const auto& algo : algos) {
+        putLong(out, algo.first);
+        putUint(out, algo.second.size());
+        out.append(algo.second);
+    }
+}
+
+static bool getAlgos(const char*& pos, const char* end, std::map<long, std::string>& algos) {
+    uint32_t count = 0;
+    if (!getUint(pos, end, count)) {
+        return false;
+    }
+    for (uint32_t idx = 0; idx < count; ++idx) {
+        long algoID = 0;
+        if (!getLong(pos, end, algoID) || !getBytes(pos, end, algos[algoID])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const std::string& data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t ret = write(fd, data.data() + done, data.size() - done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
+static bool readAll(const std::string& path, std::string& data) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    char buf[65536];
+    ssize_t ret = 0;
+    data.clear();
+    while ((ret = read(fd, buf, sizeof(buf))) != 0) {
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            close(fd);
+            return false;
+        }
+        data.append(buf, ret);
+    }
+    close(fd);
+    return true;
+}
+
+// a new or renamed file is only durable once its directory is.
+static void syncDir(const std::string& dir) {
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+bool WalState::Apply(const char* data, size_t size) {
+    const char* pos = data;
+    const char* end = data + size;
+    if (size < 1) {
+        return false;
+    }
+    int type = *pos++;
+    long token = 0;
+    if (!getLong(pos, end, token)) {
+        return false;
+    }
+
+    if (type == WAL_REGISTER) {
+        WalClient client;
+        if (!getAlgos(pos, end, client.algos)) {
+            return false;
+        }
+        clients[token] = client;
+        tokenBase = token > tokenBase ? token : tokenBase;
+        return true;
+    }
+
+    if (type == WAL_EVICT) {
+        clients.erase(token);
+        return true;
+    }
+
+    long algoID = 0;
+    uint32_t num = 0;
+    if ((type != WAL_GRANT && type != WAL_FREE) || !getLong(pos, end, algoID) || !getUint(pos, end, num) || pos == end) {
+        return false;
+    }
+    bool reservoir = *pos;
+
+    // the client was evicted while the grant was on its way, eviction gave everything back.
+    auto search = clients.find(token);
+    if (search == clients.end()) {
+        return true;
+    }
+    long& counter = reservoir ? search->second.reserved[algoID] : search->second.held[algoID];
+    counter += type == WAL_GRANT ? static_cast<long>(num) : -static_cast<long>(num);
+    return true;
+}
+
+unsigned LicsWal::Crc32(const char* data, size_t size) {
+    static uint32_t table[256] = {0};
+    static bool ready = [](uint32_t* t) {
+        for (uint32_t idx = 0; idx < 256; ++idx) {
+            uint32_t crc = idx;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+            }
+            t[idx] = crc;
+        }
+        return true;
+    }(table);
+    (void)ready;
+
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t idx = 0; idx < size; ++idx) {
+        crc = table[(crc ^ static_cast<unsigned char>(data[idx])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+LicsWal::LicsWal(const std::string& dir) : dir_(dir) {
+
+}
+
+// records appended before are still written, Sync callers are not left waiting.
+LicsWal::~LicsWal() {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stopping_ = true;
+    }
+    cv_.notify_one();
+    if (flusher_.joinable()) {
+        flusher_.join();
+    }
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stopped_ = true;
+    }
+    synced_.notify_all();
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+bool LicsWal::Recover(WalState& state) {
+    if (mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+        SPDLOG_ERROR("wal dir({0}) can not be created:{1}", dir_, strerror(errno));
+        return false;
+    }
+
+    if (!loadSnapshot(base_, baseNext_)) {
+        return false;
+    }
+
+    std::vector<long> seqs;
+    DIR* dir = opendir(dir_.c_str());
+    if (!dir) {
+        SPDLOG_ERROR("wal dir({0}) can not be read:{1}", dir_, strerror(errno));
+        return false;
+    }
+    size_t prefixLen = strlen(WAL_SEGMENT_PREFIX);
+    for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+        char* end = nullptr;
+        if (strncmp(entry->d_name, WAL_SEGMENT_PREFIX, prefixLen) != 0) {
+            continue;
+        }
+        long seq = strtol(entry->d_name + prefixLen, &end, 10);
+        if (*end != '\0') {
+            continue;
+        }
+        if (seq < baseNext_) {
+            unlink(segmentPath(seq).c_str()); // folded already, a crash came before it was deleted
+            continue;
+        }
+        seqs.push_back(seq);
+    }
+    closedir(dir);
+    std::sort(seqs.begin(), seqs.end());
+
+    state = base_;
+    for (long seq : seqs) {
+        replaySegment(seq, state);
+    }
+
+    // a crash may have torn the last segment, the log goes on in a new one.
+    long next = seqs.empty() ? baseNext_ : seqs.back() + 1;
+    if (!openSegment(next)) {
+        return false;
+    }
+
+    flusher_ = std::thread(&LicsWal::run, this);
+    std::lock_guard<std::mutex> lk(mtx_);
+    sealed_ = next - 1;
+    started_ = true;
+    return true;
+}
+
+void LicsWal::Register(long token, const std::map<long, std::string>& algos) {
+    std::string record(1, static_cast<char>(WAL_REGISTER));
+    putLong(record, token);
+    putAlgos(record, algos);
+    append(record);
+}
+
+void LicsWal::Evict(long token) {
+    std::string record(1, static_cast<char>(WAL_EVICT));
+    putLong(record, token);
+    append(record);
+}
+
+void LicsWal::Grant(long token, long algoID, int num, bool reservoir) {
+    std::string record(1, static_cast<char>(WAL_GRANT));
+    putLong(record, token);
+    putLong(record, algoID);
+    putUint(record, num);
+    record.push_back(reservoir ? 1 : 0);
+    append(record);
+}
+
+void LicsWal::Free(long token, long algoID, int num, bool reservoir) {
+    std::string record(1, static_cast<char>(WAL_FREE));
+    putLong(record, token);
+    putLong(record, algoID);
+    putUint(record, num);
+    record.push_back(reservoir ? 1 : 0);
+    append(record);
+}
+
+void LicsWal::Sync() {
+    std::unique_lock<std::mutex> lk(mtx_);
+    long target = appended_;
+    synced_.wait(lk, [this, target]() { return durable_ >= target || failed_ || !started_ || stopped_; });
+}
+
+bool LicsWal::Checkpoint() {
+    long upto = 0;
+    {
+        std::unique_lock<std::mutex> lk(mtx_);
+        if (!started_ || failed_) {
+            return false;
+        }
+        long before = sealed_;
+        rotate_ = true;
+        cv_.notify_one();
+        synced_.wait(lk, [this, before]() { return sealed_ != before || failed_; });
+        if (failed_) {
+            return false;
+        }
+        upto = sealed_;
+    }
+
+    // folded into a copy, the segments stay the source until the snapshot holding them is written.
+    WalState folded = base_;
+    for (long seq = baseNext_; seq <= upto; ++seq) {
+        replaySegment(seq, folded);
+    }
+    if (!writeSnapshot(folded, upto + 1)) {
+        return false;
+    }
+    base_ = std::move(folded);
+    for (long seq = baseNext_; seq <= upto; ++seq) {
+        unlink(segmentPath(seq).c_str());
+    }
+    baseNext_ = upto + 1;
+    return true;
+}
+
+void LicsWal::append(const std::string& record) {
+    std::string frame;
+    putUint(frame, record.size());
+    putUint(frame, Crc32(record.data(), record.size()));
+
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (!started_ || failed_) {
+            return;
+        }
+        pending_.append(frame);
+        pending_.append(record);
+        ++appended_;
+    }
+    cv_.notify_one();
+}
+
+void LicsWal::run() {
+    while (true) {
+        std::string group;
+        bool rotate = false;
+        long upto = 0;
+        {
+            std::unique_lock<std::mutex> lk(mtx_);
+            cv_.wait(lk, [this]() { return stopping_ || !pending_.empty() || rotate_; });
+            if (stopping_ && pending_.empty() && !rotate_) {
+                return;
+            }
+            group.swap(pending_);
+            rotate = rotate_;
+            rotate_ = false;
+            upto = appended_;
+        }
+
+        // records appended while this group is on its way make up the next one.
+        bool ok = writeAll(fd_, group) && fdatasync(fd_) == 0;
+        long sealed = -1;
+        if (ok && rotate) {
+            sealed = seq_;
+            ok = openSegment(seq_ + 1);
+        }
+        if (!ok) {
+            SPDLOG_ERROR("wal segment({0}) write failed:{1}, stop logging", segmentPath(seq_), strerror(errno));
+        }
+
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            failed_ = failed_ || !ok;
+            durable_ = upto;
+            sealed_ = sealed >= 0 ? sealed : sealed_;
+        }
+        synced_.notify_all();
+        if (!ok) {
+            return;
+        }
+    }
+}
+
+bool LicsWal::openSegment(long seq) {
+    int fd = open(segmentPath(seq).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        SPDLOG_ERROR("wal segment({0}) can not be opened:{1}", segmentPath(seq), strerror(errno));
+        return false;
+    }
+    syncDir(dir_);
+
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    fd_ = fd;
+    seq_ = seq;
+    return true;
+}
+
+std::string LicsWal::segmentPath(long seq) {
+    return dir_ + "/" + WAL_SEGMENT_PREFIX + std::to_string(seq);
+}
+
+// stops at the first frame that is short or fails its crc, that is where the writer stopped.
+bool LicsWal::replaySegment(long seq, WalState& state) {
+    std::string data;
+    if (!readAll(segmentPath(seq), data)) {
+        return false;
+    }
+
+    const char* pos = data.data();
+    const char* end = pos + data.size();
+    while (end - pos >= WAL_FRAME_HEADER) {
+        uint32_t size = 0;
+        uint32_t crc = 0;
+        getUint(pos, end, size);
+        getUint(pos, end, crc);
+        if (size > WAL_MAX_RECORD || static_cast<uint32_t>(end - pos) < size || Crc32(pos, size) != crc) {
+            SPDLOG_WARN("wal segment({0}) ends with a torn record at {1}", segmentPath(seq), pos - data.data() - WAL_FRAME_HEADER);
+            return true;
+        }
+        if (!state.Apply(pos, size)) {
+            SPDLOG_WARN("wal segment({0}) has an unknown record at {1}", segmentPath(seq), pos - data.data() - WAL_FRAME_HEADER);
+        }
+        pos += size;
+    }
+    return true;
+}
+
+bool LicsWal::loadSnapshot(WalState& state, long& nextSeq) {
+    std::string data;
+    state = WalState();
+    nextSeq = 0;
+    if (!readAll(dir_ + "/" + WAL_SNAPSHOT_FILE, data)) {
+        return errno == ENOENT; // first start
+    }
+
+    // written to a temporary file and renamed, a bad one is not a torn write but a broken disk.
+    uint32_t crc = 0;
+    if (data.size() < sizeof(crc)) {
+        SPDLOG_ERROR("wal snapshot of {0} is corrupted", dir_);
+        return false;
+    }
+    const char* end = data.data() + data.size() - sizeof(crc);
+    memcpy(&crc, end, sizeof(crc));
+    if (Crc32(data.data(), end - data.data()) != crc) {
+        SPDLOG_ERROR("wal snapshot of {0} is corrupted", dir_);
+        return false;
+    }
+
+    const char* pos = data.data();
+    uint32_t magic = 0;
+    uint32_t count = 0;
+    bool ok = getUint(pos, end, magic) && magic == WAL_SNAPSHOT_MAGIC && getLong(pos, end, state.tokenBase) &&
+                getLong(pos, end, nextSeq) && getUint(pos, end, count);
+    for (uint32_t idx = 0; ok && idx < count; ++idx) {
+        long token = 0;
+        uint32_t counters = 0;
+        ok = getLong(pos, end, token) && getAlgos(pos, end, state.clients[token].algos) && getUint(pos, end, counters);
+        for (uint32_t num = 0; ok && num < counters; ++num) {
+            long algoID = 0;
+            WalClient& client = state.clients[token];
+            ok = getLong(pos, end, algoID) && getLong(pos, end, client.held[algoID]) && getLong(pos, end, client.reserved[algoID]);
+        }
+    }
+
+    if (!ok) {
+        SPDLOG_ERROR("wal snapshot of {0} does not decode", dir_);
+    }
+    return ok;
+}
+
+bool LicsWal::writeSnapshot(const WalState& state, long nextSeq) {
+    std::string data;
+    putUint(data, WAL_SNAPSHOT_MAGIC);
+    putLong(data, state.tokenBase);
+    putLong(data, nextSeq);
+    putUint(data, state.clients.size());
+    for (const auto& client : state.clients) {
+        putLong(data, client.first);
+        putAlgos(data, client.second.algos);
+
+        std::map<long, std::pair<long, long>> counters; // algorithm id to held and reserved, zeros left out
+        for (const auto& held : client.second.held) {
+            if (held.second != 0) {
+                counters[held.first].first = held.second;
+            }
+        }
+        for (const auto& reserved : client.second.reserved) {
+            if (reserved.second != 0) {
+                counters[reserved.first].second = reserved.second;
+            }
+        }
+        putUint(data, counters.size());
+        for (const auto& counter : counters) {
+            putLong(data, counter.first);
+            putLong(data, counter.second.first);
+            putLong(data, counter.second.second);
+        }
+    }
+    putUint(data, Crc32(data.data(), data.size()));
+
+    std::string path = dir_ + "/" + WAL_SNAPSHOT_FILE;
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        SPDLOG_ERROR("wal snapshot({0}) can not be opened:{1}", tmp, strerror(errno));
+        return false;
+    }
+    bool ok = writeAll(fd, data) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        SPDLOG_ERROR("wal snapshot({0}) write failed:{1}", path, strerror(errno));
+        unlink(tmp.c_str());
+        return false;
+    }
+    syncDir(dir_);
+    return true;
+}
@@ -2,16 +2,38 @@
 
 #include "gtest/gtest.h"
 #include <iostream>
+#include <set>
 
 #define USER_TOKEN  (16888)
 #define MAX_LICS_NUM    (10)
 
+#define TEST_RECONNECT_ADDR "127.0.0.1:50081"
+#define TEST_RECONNECT_CLIENTS  (8)
+#define TEST_RECONNECT_DOWN_MS  (3000) // how long the server stays away
+#define TEST_RECONNECT_HEARTBEAT_MS (100) // a lost server is noticed this fast
+#define TEST_RECONNECT_BASE_MS  (100) // client CLIENT_RECONNECT_BASE_MS
+#define TEST_RECONNECT_MAX_MS   (10000) // client CLIENT_RECONNECT_MAX_MS
+#define TEST_RECONNECT_SPREAD_MS    (1000) // client CLIENT_RECONNECT_SPREAD_MS
+#define TEST_RECONNECT_SLACK_MS (300) // rpc and scheduling time on top of a backoff wait
+#define TEST_CHANNEL_READY_MS   (1000) // a channel notices the restarted server within this
+#define TEST_CLIENT_EXIT_MS (2000) // a backing off client is gone within this, a pending channel watch included
+
+static std::atomic<int> stubCreateCalls{0};
+static thread_local int stubReservoirLeases = 0; // reservoir leases made on the calling thread
+static thread_local int stubBlockingCalls = 0; // blocking create and delete rpcs made on the calling thread
+static std::atomic<bool> stubBatchUnavailable{false}; // batch rpcs fail as if server were gone
+
 int lics_global_init_internal(const char* remote, AlgoCapability* algoLics, int size, std::shared_ptr<LicsClient> client);
 
 class LicsClientStub : public LicsClient {
 public:
     LicsClientStub(std::shared_ptr<Channel> channel, AlgoCapability* algoLics, int size) : LicsClient{channel, algoLics, size} {}
     Status createLics(CreateLicsRequest& req, CreateLicsResponse& resp) override {
+        ++stubCreateCalls;
+        ++stubBlockingCalls;
+        if (req.reservoir()) {
+            ++stubReservoirLeases;
+        }
 
         int expectedNum = req.clientexpectedlicsnum();
         if (expectedNum <= MAX_LICS_NUM) {
@@ -25,6 +47,44 @@ public:
         return Status();
     }
     Status deleteLics(DeleteLicsRequest& req, DeleteLicsResponse& resp) override {
+        ++stubBlockingCalls;
+        resp.set_licsnum(req.licsnum());
+        return Status();
+    }
+    // answered from another thread, like the completion queue thread does.
+    void createLicsAsync(CreateLicsRequest& req, AsyncUnaryClientCall<CreateLicsResponse>::DoneFn done) override {
+        std::thread([this, req, done]() mutable {
+            usleep(10000); // keep the rpc in flight for a while
+            CreateLicsResponse resp;
+            Status status = createLics(req, resp);
+            done(status, resp);
+        }).detach();
+    }
+    void deleteLicsAsync(DeleteLicsRequest& req, AsyncUnaryClientCall<DeleteLicsResponse>::DoneFn done) override {
+        std::thread([this, req, done]() mutable {
+            DeleteLicsResponse resp;
+            Status status = deleteLics(req, resp);
+            done(status, resp);
+        }).detach();
+    }
+    Status batchCreateLics(BatchCreateLicsRequest& req, BatchCreateLicsResponse& resp) override {
+        if (stubBatchUnavailable) {
+            return Status(grpc::StatusCode::UNAVAILABLE, "server unavailable");
+        }
+        for (int idx = 0; idx < req.items_size(); ++idx) {
+            createLics(*req.mutable_items(idx), *resp.add_items());
+        }
+        resp.set_respcode(0);
+        return Status();
+    }
+    Status batchDeleteLics(BatchDeleteLicsRequest& req, BatchDeleteLicsResponse& resp) override {
+        if (stubBatchUnavailable) {
+            return Status(grpc::StatusCode::UNAVAILABLE, "server unavailable");
+        }
+        for (int idx = 0; idx < req.items_size(); ++idx) {
+            resp.add_items()->set_licsnum(req.items(idx).licsnum());
+        }
+        resp.set_respcode(0);
         return Status();
     }
 
@@ -153,6 +213,417 @@ TEST_F(LicsServerTests, LicsFreeOAShouldReturnNok) {
     EXPECT_EQ(ret, ELICS_OK);
 }
 
+TEST_F(LicsServerTests, LicsApplyBatchODAndOA) {
+
+    sleep(1);// make enough time to sync picture with server.
+
+    LicsBatchItem items[3];
+    items[0].algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD;
+    items[0].licsNum = 1;
+    items[1].algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA;
+    items[1].licsNum = 100;
+    items[2].algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD;
+    items[2].licsNum = 100;
+
+    int ret = lics_apply_batch(items, 3);
+    EXPECT_EQ(ret, ELICS_OK);
+    EXPECT_EQ(items[0].actualLicsNum, 1);
+    EXPECT_EQ(items[1].actualLicsNum, 10);
+    EXPECT_EQ(items[2].actualLicsNum, 10);
+
+    items[0].licsNum = items[0].actualLicsNum;
+    items[2].licsNum = items[2].actualLicsNum;
+    LicsBatchItem video[2] = {items[0], items[2]};
+    ret = lics_free_batch(video, 2);
+    EXPECT_EQ(ret, ELICS_OK);
+    EXPECT_EQ(video[0].actualLicsNum, 1);
+    EXPECT_EQ(video[1].actualLicsNum, 10);
+
+    items[0].algoID = -1;
+    ret = lics_apply_batch(items, 1);
+    EXPECT_EQ(ret, ELICS_ALGO_NOT_EXIST);
+}
+
+TEST_F(LicsServerTests, LicsApplyBatchFailureGrantsNothing) {
+
+    sleep(1);// make enough time to sync picture with server.
+
+    LicsBatchItem items[2];
+    items[0].algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA;
+    items[0].licsNum = MAX_LICS_NUM;
+    items[1].algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD;
+    items[1].licsNum = 1;
+
+    stubBatchUnavailable = true;
+    int ret = lics_apply_batch(items, 2);
+    stubBatchUnavailable = false;
+    EXPECT_EQ(ret, grpc::StatusCode::UNAVAILABLE);
+
+    // the picture item was not served by the failed batch, all of its licenses are still there.
+    ret = lics_apply_batch(items, 1);
+    EXPECT_EQ(ret, ELICS_OK);
+    EXPECT_EQ(items[0].actualLicsNum, MAX_LICS_NUM);
+}
+
+struct AsyncApplyResult {
+    std::mutex mtx;
+    std::condition_variable cv;
+    int done{0};
+    int licsNum{0};
+};
+
+static void asyncApplyDone(int ret, int algoID, int actualLicsNum, void* userData) {
+    AsyncApplyResult* result = static_cast<AsyncApplyResult*>(userData);
+    std::lock_guard<std::mutex> lk(result->mtx);
+    EXPECT_EQ(ret, ELICS_OK);
+    EXPECT_EQ(algoID, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+    result->licsNum += actualLicsNum;
+    ++result->done;
+    result->cv.notify_one();
+}
+
+TEST_F(LicsServerTests, LicsApplyODAsyncManyInFlight) {
+    AsyncApplyResult result;
+    for (int idx = 0; idx < MAX_LICS_NUM; ++idx) {
+        int ret = lics_apply_async(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1, asyncApplyDone, &result);
+        EXPECT_EQ(ret, ELICS_OK);
+    }
+
+    std::unique_lock<std::mutex> lk(result.mtx);
+    EXPECT_TRUE(result.cv.wait_for(lk, std::chrono::seconds(5), [&]{ return result.done == MAX_LICS_NUM; }));
+    EXPECT_EQ(result.licsNum, MAX_LICS_NUM);
+}
+
+TEST_F(LicsServerTests, LicsApplyODCoalescesConcurrentCalls) {
+    std::atomic<int> granted{0};
+    std::thread t[MAX_LICS_NUM];
+
+    stubCreateCalls = 0;
+    for (int idx = 0; idx < MAX_LICS_NUM; ++idx) {
+        t[idx] = std::thread([&granted]() {
+            int actualLicsNum = 0;
+            EXPECT_EQ(lics_apply(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1, &actualLicsNum), ELICS_OK);
+            granted += actualLicsNum;
+        });
+    }
+    for (int idx = 0; idx < MAX_LICS_NUM; ++idx) {
+        t[idx].join();
+    }
+
+    // every caller still gets what it asked for, in fewer rpcs.
+    EXPECT_EQ(granted, MAX_LICS_NUM);
+    EXPECT_LT(stubCreateCalls, MAX_LICS_NUM);
+}
+
+TEST_F(LicsServerTests, LicsApplyODFromReservoir) {
+    int ret = lics_set_reservoir(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 2, 8);
+    EXPECT_EQ(ret, ELICS_OK);
+
+    sleep(1);// make enough time to fill the reservoir.
+
+    int actualLicsNum = 0;
+    ret = lics_apply(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 3, &actualLicsNum);
+    EXPECT_EQ(ret, ELICS_OK);
+    EXPECT_EQ(actualLicsNum, 3);
+
+    ret = lics_free(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 3);
+    EXPECT_EQ(ret, ELICS_OK);
+
+    ret = lics_set_reservoir(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, 2, 8);
+    EXPECT_EQ(ret, ELICS_ALGO_NOT_EXIST);
+}
+
+TEST_F(LicsServerTests, LicsApplyBatchNeverLeasesOnCallerThread) {
+    int ret = lics_set_reservoir(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 2, 8);
+    EXPECT_EQ(ret, ELICS_OK);
+
+    // the reservoir may still be dry, the shortfall is granted directly and the refill left to doLoop.
+    stubReservoirLeases = 0;
+    LicsBatchItem item;
+    item.algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD;
+    item.licsNum = 3;
+    ret = lics_apply_batch(&item, 1);
+    EXPECT_EQ(ret, ELICS_OK);
+    EXPECT_EQ(item.actualLicsNum, 3);
+    EXPECT_EQ(stubReservoirLeases, 0);
+}
+
+struct AsyncFreeResult {
+    std::mutex mtx;
+    std::condition_variable cv;
+    int done{0};
+    int licsNum{0};
+};
+
+static void asyncFreeDone(int ret, int algoID, int licsNum, void* userData) {
+    AsyncFreeResult* result = static_cast<AsyncFreeResult*>(userData);
+    std::lock_guard<std::mutex> lk(result->mtx);
+    EXPECT_EQ(ret, ELICS_OK);
+    result->licsNum += licsNum;
+    ++result->done;
+    result->cv.notify_one();
+}
+
+TEST_F(LicsServerTests, LicsApplyAsyncWithReservoirNeverBlocks) {
+    int ret = lics_set_reservoir(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 2, 8);
+    EXPECT_EQ(ret, ELICS_OK);
+
+    // dry or not, the reservoir part is served in place and the rest on the completion queue.
+    stubBlockingCalls = 0;
+    AsyncApplyResult applied;
+    ret = lics_apply_async(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 3, asyncApplyDone, &applied);
+    EXPECT_EQ(ret, ELICS_OK);
+    {
+        std::unique_lock<std::mutex> lk(applied.mtx);
+        EXPECT_TRUE(applied.cv.wait_for(lk, std::chrono::seconds(5), [&]{ return applied.done == 1; }));
+    }
+    EXPECT_EQ(applied.licsNum, 3);
+
+    AsyncFreeResult freed;
+    ret = lics_free_async(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 3, asyncFreeDone, &freed);
+    EXPECT_EQ(ret, ELICS_OK);
+    {
+        std::unique_lock<std::mutex> lk(freed.mtx);
+        EXPECT_TRUE(freed.cv.wait_for(lk, std::chrono::seconds(5), [&]{ return freed.done == 1; }));
+    }
+    EXPECT_EQ(freed.licsNum, 3);
+    EXPECT_EQ(stubBlockingCalls, 0);
+}
+
+TEST(LicsReservoir, TakeNeverExceedsLease) {
+    LicsReservoir reservoir;
+    reservoir.SetWatermarks(2, 8);
+    EXPECT_EQ(reservoir.Deficit(), 8);
+
+    reservoir.AddLeased(8);
+    EXPECT_EQ(reservoir.Deficit(), 0);
+    EXPECT_EQ(reservoir.Take(5), 5);
+    EXPECT_EQ(reservoir.Take(5), 3);
+    EXPECT_EQ(reservoir.Take(1), 0);
+    EXPECT_EQ(reservoir.Deficit(), 8);
+
+    EXPECT_EQ(reservoir.Put(10), 8);
+    EXPECT_EQ(reservoir.Surplus(), 0);
+    reservoir.AddLeased(4);
+    EXPECT_EQ(reservoir.Surplus(), 4);
+    EXPECT_EQ(reservoir.Reclaim(reservoir.Surplus()), 4);
+    EXPECT_EQ(reservoir.Leased(), 8);
+}
+
+TEST(LicsReservoir, ResetLeaseLeasesUsedAgain) {
+    LicsReservoir reservoir;
+    reservoir.SetWatermarks(2, 8);
+    reservoir.AddLeased(8);
+    EXPECT_EQ(reservoir.Take(3), 3);
+
+    reservoir.ResetLease();
+    EXPECT_EQ(reservoir.Idle(), -3);
+    EXPECT_EQ(reservoir.Take(1), 0);
+    EXPECT_EQ(reservoir.Deficit(), 11);
+}
+
+// a license server which goes away and comes back, tokens survive the restart as they do with the WAL.
+class RestartingLicsService : public License::Service {
+public:
+    Status GetAuthAccess(grpc::ServerContext* ctx, const GetAuthAccessRequest* req, GetAuthAccessResponse* resp) override {
+        std::lock_guard<std::mutex> lk(mtx_);
+        long token = req->token();
+        if (tokens_.count(token) == 0) {
+            token = USER_TOKEN + (long)tokens_.size();
+            tokens_.insert(token);
+        }
+        resp->set_token(token);
+        resp->set_respcode(ELICS_OK);
+        resp->set_heartbeatintervalms(TEST_RECONNECT_HEARTBEAT_MS);
+        return Status::OK;
+    }
+
+    Status KeepAlive(grpc::ServerContext* ctx, const KeepAliveRequest* req, KeepAliveResponse* resp) override {
+        resp->set_token(req->token());
+        resp->set_respcode(ELICS_OK);
+        return Status::OK;
+    }
+
+    int Issued() {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return tokens_.size();
+    }
+
+private:
+    std::mutex mtx_;
+    std::set<long> tokens_;
+};
+
+static std::unique_ptr<grpc::Server> startLicsServer(License::Service* service) {
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort(TEST_RECONNECT_ADDR, grpc::InsecureServerCredentials());
+    builder.RegisterService(service);
+    return builder.BuildAndStart();
+}
+
+struct ReconnectAttempt {
+    std::chrono::steady_clock::time_point at;
+    long token; // token sent
+    long granted; // token got back, -1 if the rpc failed
+};
+
+// kept apart from the probes, the first attempt may come before a probe is fully constructed.
+static std::mutex probeMtx;
+static std::map<const LicsClient*, std::vector<ReconnectAttempt>> probeAttempts;
+
+// a client on a real channel which notes every authentication it tries.
+class LicsReconnectProbe : public LicsClient {
+public:
+    LicsReconnectProbe(std::shared_ptr<Channel> channel, AlgoCapability* algoLics, int size) : LicsClient{channel, algoLics, size} {}
+    Status getAuthAccess(const GetAuthAccessRequest& req, GetAuthAccessResponse& resp) override {
+        ReconnectAttempt attempt{std::chrono::steady_clock::now(), req.token(), -1};
+        Status status = LicsClient::getAuthAccess(req, resp);
+        if (status.ok()) {
+            attempt.granted = resp.token();
+        }
+        std::lock_guard<std::mutex> lk(probeMtx);
+        probeAttempts[this].push_back(attempt);
+        return status;
+    }
+};
+
+// a connection of its own which is retried quickly once lost, like clients on different hosts.
+static std::shared_ptr<Channel> reconnectChannel() {
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    args.SetInt(GRPC_ARG_INITIAL_RECONNECT_BACKOFF_MS, 100);
+    args.SetInt(GRPC_ARG_MIN_RECONNECT_BACKOFF_MS, 100);
+    args.SetInt(GRPC_ARG_MAX_RECONNECT_BACKOFF_MS, 200);
+    return grpc::CreateCustomChannel(TEST_RECONNECT_ADDR, grpc::InsecureChannelCredentials(), args);
+}
+
+static long elapsedMs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+}
+
+// clients of a server which restarts back off with full jitter while it is away, come back spread out
+// once their channel sees it again and keep their tokens.
+TEST(LicsReconnect, RetriesSpreadOutAndResumeTokens) {
+    RestartingLicsService service;
+    std::unique_ptr<grpc::Server> server = startLicsServer(&service);
+    ASSERT_TRUE(server != nullptr);
+
+    AlgoCapability cap[1];
+    cap[0].algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD;
+    cap[0].maxLimit = 16;
+    cap[0].type = AlgoLicsType::VIDEO;
+
+    std::vector<std::shared_ptr<LicsClient>> clients;
+    for (int idx = 0; idx < TEST_RECONNECT_CLIENTS; ++idx) {
+        clients.push_back(std::make_shared<LicsReconnectProbe>(reconnectChannel(), cap, 1));
+    }
+    for (int waited = 0; service.Issued() < TEST_RECONNECT_CLIENTS && waited < 5000; waited += 10) {
+        usleep(10000);
+    }
+    ASSERT_EQ(service.Issued(), TEST_RECONNECT_CLIENTS);
+
+    std::chrono::steady_clock::time_point down = std::chrono::steady_clock::now();
+    server->Shutdown(std::chrono::system_clock::now() + std::chrono::milliseconds(100));
+    server.reset();
+    usleep(TEST_RECONNECT_DOWN_MS * 1000);
+    std::chrono::steady_clock::time_point up = std::chrono::steady_clock::now();
+    server = startLicsServer(&service);
+    ASSERT_TRUE(server != nullptr);
+
+    auto reconnected = [&]() {
+        std::lock_guard<std::mutex> lk(probeMtx);
+        int num = 0;
+        for (auto& client : clients) {
+            for (const ReconnectAttempt& attempt : probeAttempts[client.get()]) {
+                if (attempt.at >= up && attempt.granted != -1) {
+                    ++num;
+                    break;
+                }
+            }
+        }
+        return num;
+    };
+    for (int waited = 0; reconnected() < TEST_RECONNECT_CLIENTS && waited < 10000; waited += 10) {
+        usleep(10000);
+    }
+
+    for (auto& client : clients) {
+        client->Stop();
+    }
+
+    std::lock_guard<std::mutex> lk(probeMtx);
+    int retries = 0;
+    long firstBack = TEST_RECONNECT_MAX_MS;
+    long lastBack = 0;
+    for (auto& client : clients) {
+        std::vector<ReconnectAttempt> outage;
+        for (const ReconnectAttempt& attempt : probeAttempts[client.get()]) {
+            if (attempt.at >= down) {
+                outage.push_back(attempt);
+            }
+        }
+
+        // failed attempts while server is away, the first one which got through ends them.
+        size_t back = 0;
+        while (back < outage.size() && outage[back].granted == -1) {
+            ++back;
+        }
+        ASSERT_LT(back, outage.size());
+        EXPECT_GE(back, 1u);
+        retries += back;
+
+        // attempt n waits a random time up to the base window doubled n times.
+        for (size_t idx = 1; idx <= back; ++idx) {
+            long window = (long)TEST_RECONNECT_BASE_MS << (idx - 1 < 16 ? idx - 1 : 16);
+            window = window < TEST_RECONNECT_MAX_MS ? window : TEST_RECONNECT_MAX_MS;
+            EXPECT_LE(elapsedMs(outage[idx - 1].at, outage[idx].at), window + TEST_RECONNECT_SLACK_MS);
+        }
+
+        // a channel watch cuts a long backoff short once server is back, the old token is resumed.
+        long backMs = elapsedMs(up, outage[back].at);
+        EXPECT_LE(backMs, TEST_CHANNEL_READY_MS + TEST_RECONNECT_SPREAD_MS);
+        firstBack = backMs < firstBack ? backMs : firstBack;
+        lastBack = backMs > lastBack ? backMs : lastBack;
+        EXPECT_NE(outage[back].token, -1);
+        EXPECT_EQ(outage[back].granted, outage[back].token);
+    }
+    EXPECT_EQ(service.Issued(), TEST_RECONNECT_CLIENTS);
+
+    // polling every base window would have retried down time / base window times.
+    EXPECT_LT(retries, TEST_RECONNECT_CLIENTS * TEST_RECONNECT_DOWN_MS / TEST_RECONNECT_BASE_MS / 2);
+    // the restarted server does not see every client in the same instant.
+    EXPECT_GE(lastBack - firstBack, TEST_RECONNECT_SPREAD_MS / 10);
+
+    probeAttempts.clear();
+    clients.clear();
+    server->Shutdown();
+}
+
+// a client backing off from an absent server is destroyed without Stop and without waiting for it first.
+TEST(LicsReconnect, DestroyWhileBackingOff) {
+    AlgoCapability cap[1];
+    cap[0].algoID = UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD;
+    cap[0].maxLimit = 16;
+    cap[0].type = AlgoLicsType::VIDEO;
+
+    std::shared_ptr<LicsClient> client = std::make_shared<LicsReconnectProbe>(reconnectChannel(), cap, 1);
+    auto attempts = [&]() {
+        std::lock_guard<std::mutex> lk(probeMtx);
+        return probeAttempts[client.get()].size();
+    };
+    for (int waited = 0; attempts() < 2 && waited < 5000; waited += 10) {
+        usleep(10000);
+    }
+    ASSERT_GE(attempts(), 2u);
+
+    std::chrono::steady_clock::time_point from = std::chrono::steady_clock::now();
+    client.reset();
+    EXPECT_LE(elapsedMs(from, std::chrono::steady_clock::now()), TEST_CLIENT_EXIT_MS);
+
+    std::lock_guard<std::mutex> lk(probeMtx);
+    probeAttempts.clear();
+}
+
 TEST(LicsVersion, ShouldRetrunOk) {
 
 }
@@ -0,0 +1,419 @@
+#include <grpcpp/grpcpp.h>
+#include "license.grpc.pb.h"
+#include "lics_error.h"
+#include "lics_interface.h"
+
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+using grpc::Channel;
+using grpc::ClientContext;
+using grpc::Status;
+using UnisAlgoLics::License;
+using UnisAlgoLics::GetAuthAccessRequest;
+using UnisAlgoLics::GetAuthAccessResponse;
+using UnisAlgoLics::KeepAliveRequest;
+using UnisAlgoLics::KeepAliveResponse;
+using UnisAlgoLics::CreateLicsRequest;
+using UnisAlgoLics::CreateLicsResponse;
+using UnisAlgoLics::DeleteLicsRequest;
+using UnisAlgoLics::DeleteLicsResponse;
+using UnisAlgoLics::AlgoLics;
+using UnisAlgoLics::Algorithm;
+using UnisAlgoLics::TaskType;
+using UnisAlgoLics::Vendor;
+
+/*
+* load generator for the Server binary. many logical clients share a few channels, each worker
+* thread owns a slice of them: it authorizes them all, then keeps them beating on their interval
+* and applies/frees video licenses in between, like lics_apply/lics_free would.
+*   ./LoadGen --server=localhost:50057 --clients=10000 --duration=60 --server_pid=$(pidof Server)
+*/
+
+struct LoadOptions {
+    std::string server{"localhost:50057"};
+    int clients{10000};
+    int channels{8};
+    int threads{32};
+    int duration{30}; // seconds of heartbeats and apply/free after every client is authorized
+    int heartbeatMs{10000}; // used until server paces the client
+    int opsPerSec{1000}; // video apply/free of all clients together, 0 for as fast as possible
+    int freePercent{50}; // a client holding licenses frees instead of applying this often
+    int maxHold{4}; // licenses one client holds at most
+    int pid{0}; // server process to report rss and cpu of, 0 to skip
+};
+
+enum LoadRpc {
+    AUTH = 0,
+    KEEPALIVE,
+    APPLY,
+    FREE,
+    RPC_NUM,
+};
+
+static const char* rpcNames[RPC_NUM] = {"GetAuthAccess", "KeepAlive", "CreateLics", "DeleteLics"};
+
+struct LoadSession {
+    long token{-1};
+    int held{0};
+    int heartbeatMs{0};
+    std::chrono::steady_clock::time_point nextBeat;
+};
+
+// per worker, merged when every worker is done.
+struct LoadStats {
+    std::vector<uint32_t> latencyUs[RPC_NUM];
+    long failed[RPC_NUM] = {0};
+};
+
+struct ProcSample {
+    long rssKb{0};
+    long hwmKb{0};
+    long cpuTicks{0};
+};
+
+static bool parseOption(const char* arg, const char* key, std::string& value) {
+    size_t len = strlen(key);
+    if (strncmp(arg, key, len) != 0 || arg[len] != '=') {
+        return false;
+    }
+    value = arg + len + 1;
+    return true;
+}
+
+static int parseOptions(int argc, char** argv, LoadOptions& opt) {
+    for (int idx = 1; idx < argc; ++idx) {
+        std::string value;
+        if (parseOption(argv[idx], "--server", value)) {
+            opt.server = value;
+        } else if (parseOption(argv[idx], "--clients", value)) {
+            opt.clients = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--channels", value)) {
+            opt.channels = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--threads", value)) {
+            opt.threads = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--duration", value)) {
+            opt.duration = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--heartbeat_ms", value)) {
+            opt.heartbeatMs = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--ops_per_sec", value)) {
+            opt.opsPerSec = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--free_percent", value)) {
+            opt.freePercent = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--max_hold", value)) {
+            opt.maxHold = std::atoi(value.c_str());
+        } else if (parseOption(argv[idx], "--server_pid", value)) {
+            opt.pid = std::atoi(value.c_str());
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[idx]);
+            return -1;
+        }
+    }
+
+    if (opt.clients <= 0 || opt.channels <= 0 || opt.threads <= 0 || opt.heartbeatMs <= 0) {
+        fprintf(stderr, "clients, channels, threads and heartbeat_ms must be positive\n");
+        return -1;
+    }
+    opt.threads = opt.threads < opt.clients ? opt.threads : opt.clients;
+    return 0;
+}
+
+static ProcSample sampleProc(int pid) {
+    ProcSample sample;
+    if (pid <= 0) {
+        return sample;
+    }
+
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            sample.rssKb = std::atol(line.c_str() + 6);
+        } else if (line.compare(0, 6, "VmHWM:") == 0) {
+            sample.hwmKb = std::atol(line.c_str() + 6);
+        }
+    }
+
+    // utime and stime are fields 14 and 15, counted after the parenthesized command name.
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string content((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+    size_t end = content.rfind(')');
+    if (end != std::string::npos) {
+        std::istringstream fields(content.substr(end + 2));
+        std::string field;
+        long utime = 0;
+        long stime = 0;
+        for (int idx = 3; idx <= 15 && (fields >> field); ++idx) {
+            if (idx == 14) {
+                utime = std::atol(field.c_str());
+            } else if (idx == 15) {
+                stime = std::atol(field.c_str());
+            }
+        }
+        sample.cpuTicks = utime + stime;
+    }
+    return sample;
+}
+
+static void fillVideoAlgo(Algorithm* algo) {
+    algo->set_vendor(Vendor::UNISINSIGHT);
+    algo->set_type(TaskType::VIDEO);
+    algo->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+}
+
+class LoadWorker {
+public:
+    LoadWorker(const LoadOptions& opt, std::shared_ptr<Channel> channel, int clientNum, int seed)
+        : opt_(opt), stub_(License::NewStub(channel)), sessions_(clientNum), rng_(seed) {}
+
+    void Auth() {
+        for (auto& session : sessions_) {
+            auth(session);
+        }
+    }
+
+    void Run(std::chrono::steady_clock::time_point until, double opsPerSec) {
+        // spread first beats over one interval, as server jitter would.
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        for (auto& session : sessions_) {
+            session.nextBeat = now + std::chrono::milliseconds(randomInt(0, session.heartbeatMs - 1));
+        }
+
+        std::chrono::steady_clock::time_point nextOp = now;
+        std::chrono::microseconds opGap(opsPerSec > 0 ? (long)(1000000 / opsPerSec) : 0);
+        size_t nextBeat = 0;
+        while ((now = std::chrono::steady_clock::now()) < until) {
+            bool busy = false;
+
+            // sessions due for a heartbeat, one sweep over the slice at a time.
+            for (size_t cnt = 0; cnt < sessions_.size(); ++cnt) {
+                LoadSession& session = sessions_[nextBeat];
+                nextBeat = (nextBeat + 1) % sessions_.size();
+                if (session.nextBeat <= now) {
+                    keepAlive(session);
+                    session.nextBeat += std::chrono::milliseconds(session.heartbeatMs);
+                    busy = true;
+                    break;
+                }
+            }
+
+            if (opGap.count() == 0 || nextOp <= now) {
+                applyOrFree(sessions_[randomInt(0, sessions_.size() - 1)]);
+                nextOp += opGap;
+                busy = true;
+            }
+
+            if (!busy) {
+                usleep(1000);
+            }
+        }
+    }
+
+    // give back what is still held, so the server ends up where it started.
+    void Release() {
+        for (auto& session : sessions_) {
+            if (session.held > 0) {
+                release(session, session.held);
+            }
+        }
+    }
+
+    LoadStats& Stats() {
+        return stats_;
+    }
+
+private:
+    int randomInt(int min, int max) {
+        return std::uniform_int_distribution<int>(min, max > min ? max : min)(rng_);
+    }
+
+    void record(LoadRpc rpc, std::chrono::steady_clock::time_point start, bool ok) {
+        if (!ok) {
+            ++stats_.failed[rpc];
+            return;
+        }
+        stats_.latencyUs[rpc].push_back(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+
+    void auth(LoadSession& session) {
+        GetAuthAccessRequest req;
+        GetAuthAccessResponse resp;
+        ClientContext ctx;
+        req.set_token(session.token);
+        AlgoLics* lics = req.add_lics();
+        fillVideoAlgo(lics->mutable_algo());
+
+        auto start = std::chrono::steady_clock::now();
+        Status status = stub_->GetAuthAccess(&ctx, req, &resp);
+        bool ok = status.ok() && resp.respcode() == ELICS_OK;
+        record(AUTH, start, ok);
+        if (ok) {
+            session.token = resp.token();
+            session.heartbeatMs = resp.heartbeatintervalms() > 0 ? resp.heartbeatintervalms() : opt_.heartbeatMs;
+        } else if (session.heartbeatMs <= 0) {
+            session.heartbeatMs = opt_.heartbeatMs;
+        }
+    }
+
+    void keepAlive(LoadSession& session) {
+        KeepAliveRequest req;
+        KeepAliveResponse resp;
+        ClientContext ctx;
+        req.set_token(session.token);
+
+        auto start = std::chrono::steady_clock::now();
+        Status status = stub_->KeepAlive(&ctx, req, &resp);
+        bool ok = status.ok() && resp.respcode() == ELICS_OK;
+        record(KEEPALIVE, start, ok);
+        if (ok && resp.heartbeatintervalms() > 0) {
+            session.heartbeatMs = resp.heartbeatintervalms();
+        }
+    }
+
+    void applyOrFree(LoadSession& session) {
+        bool doFree = session.held >= opt_.maxHold || (session.held > 0 && randomInt(0, 99) < opt_.freePercent);
+        if (doFree) {
+            release(session, 1);
+            return;
+        }
+
+        CreateLicsRequest req;
+        CreateLicsResponse resp;
+        ClientContext ctx;
+        req.set_token(session.token);
+        req.set_clientexpectedlicsnum(1);
+        fillVideoAlgo(req.mutable_algo());
+
+        auto start = std::chrono::steady_clock::now();
+        Status status = stub_->CreateLics(&ctx, req, &resp);
+        bool ok = status.ok() && resp.respcode() == ELICS_OK;
+        record(APPLY, start, ok);
+        if (ok) {
+            session.held += resp.clientgetactuallicsnum();
+        }
+    }
+
+    void release(LoadSession& session, int num) {
+        DeleteLicsRequest req;
+        DeleteLicsResponse resp;
+        ClientContext ctx;
+        req.set_token(session.token);
+        req.set_licsnum(num);
+        fillVideoAlgo(req.mutable_algo());
+
+        auto start = std::chrono::steady_clock::now();
+        Status status = stub_->DeleteLics(&ctx, req, &resp);
+        bool ok = status.ok() && resp.respcode() == ELICS_OK;
+        record(FREE, start, ok);
+        if (ok) {
+            session.held -= resp.licsnum();
+        }
+    }
+
+private:
+    const LoadOptions& opt_;
+    std::unique_ptr<License::Stub> stub_;
+    std::vector<LoadSession> sessions_;
+    std::mt19937 rng_;
+    LoadStats stats_;
+};
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = (size_t)(p * (sorted.size() - 1));
+    return sorted[idx];
+}
+
+static void report(const char* phase, std::vector<std::unique_ptr<LoadWorker>>& workers, double seconds, const std::vector<int>& rpcs) {
+    printf("%s, %.1fs\n", phase, seconds);
+    printf("%-14s %10s %8s %12s %8s %8s %8s %8s\n", "rpc", "ok", "failed", "ops/s", "p50us", "p99us", "p999us", "maxus");
+    for (int rpc : rpcs) {
+        std::vector<uint32_t> all;
+        long failed = 0;
+        for (auto& worker : workers) {
+            std::vector<uint32_t>& latency = worker->Stats().latencyUs[rpc];
+            all.insert(all.end(), latency.begin(), latency.end());
+            latency.clear();
+            failed += worker->Stats().failed[rpc];
+            worker->Stats().failed[rpc] = 0;
+        }
+        std::sort(all.begin(), all.end());
+        printf("%-14s %10zu %8ld %12.0f %8u %8u %8u %8u\n", rpcNames[rpc], all.size(), failed,
+                seconds > 0 ? all.size() / seconds : 0.0,
+                percentile(all, 0.5), percentile(all, 0.99), percentile(all, 0.999), all.empty() ? 0 : all.back());
+    }
+}
+
+static void reportProc(int pid, const ProcSample& from, const ProcSample& to, double seconds) {
+    if (pid <= 0) {
+        return;
+    }
+    double cpu = seconds > 0 ? (to.cpuTicks - from.cpuTicks) * 100.0 / sysconf(_SC_CLK_TCK) / seconds : 0.0;
+    printf("server(%d) rss %ldKB -> %ldKB, peak %ldKB, cpu %.1f%%\n", pid, from.rssKb, to.rssKb, to.hwmKb, cpu);
+}
+
+template <class Fn>
+static double runWorkers(std::vector<std::unique_ptr<LoadWorker>>& workers, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        LoadWorker* w = worker.get();
+        threads.push_back(std::thread([w, fn]() { fn(w); }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    LoadOptions opt;
+    if (parseOptions(argc, argv, opt) != 0) {
+        return 1;
+    }
+
+    // a channel argument of its own keeps channels from sharing one connection.
+    std::vector<std::shared_ptr<Channel>> channels;
+    for (int idx = 0; idx < opt.channels; ++idx) {
+        grpc::ChannelArguments args;
+        args.SetInt("lics.loadgen.channel", idx);
+        channels.push_back(grpc::CreateCustomChannel(opt.server, grpc::InsecureChannelCredentials(), args));
+    }
+
+    std::vector<std::unique_ptr<LoadWorker>> workers;
+    for (int idx = 0; idx < opt.threads; ++idx) {
+        int clientNum = opt.clients / opt.threads + (idx < opt.clients % opt.threads ? 1 : 0);
+        workers.push_back(std::unique_ptr<LoadWorker>(new LoadWorker(opt, channels[idx % channels.size()], clientNum, idx + 1)));
+    }
+    printf("%d clients on %d channels, %d threads, against %s\n", opt.clients, opt.channels, opt.threads, opt.server.c_str());
+
+    ProcSample before = sampleProc(opt.pid);
+    double seconds = runWorkers(workers, [](LoadWorker* w) { w->Auth(); });
+    ProcSample authed = sampleProc(opt.pid);
+    report("auth", workers, seconds, std::vector<int>{AUTH});
+    reportProc(opt.pid, before, authed, seconds);
+
+    auto until = std::chrono::steady_clock::now() + std::chrono::seconds(opt.duration);
+    double perWorker = opt.opsPerSec > 0 ? (double)opt.opsPerSec / opt.threads : 0;
+    seconds = runWorkers(workers, [until, perWorker](LoadWorker* w) { w->Run(until, perWorker); });
+    ProcSample steady = sampleProc(opt.pid);
+    report("steady", workers, seconds, std::vector<int>{KEEPALIVE, APPLY, FREE});
+    reportProc(opt.pid, authed, steady, seconds);
+
+    runWorkers(workers, [](LoadWorker* w) { w->Release(); });
+    return 0;
+}
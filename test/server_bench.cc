@@ -0,0 +1,473 @@
+#include "server.h"
+
+#include "benchmark/benchmark.h"
+#include <google/protobuf/arena.h>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/*
+* microbenchmarks of the server hot paths, driven through the same protected hooks as LicsServerTests.
+* emit json to diff across builds:
+*   ./ServerBench --benchmark_format=json --benchmark_out=bench.json
+*/
+
+#define BENCH_TOTAL_LICS    (1 << 30) // never runs out
+#define BENCH_HEARTBEAT_TIMEOUT_SEC    (90) // server CLIENT_HEARTBEAT_TIMEOUT_SEC
+#define BENCH_CLIENT_LIMIT  (500)
+#define BENCH_ARENA_BYTES   (1024) // async server ASYNC_CALL_ARENA_BYTES
+#define BENCH_WHEEL_SLOTS   (128) // server HEARTBEAT_WHEEL_SLOTS
+
+// heap allocations made by the calling thread, lets a benchmark report allocations per op.
+static thread_local long allocations_ = 0;
+static thread_local long allocatedBytes_ = 0;
+
+void* operator new(std::size_t size) {
+    ++allocations_;
+    allocatedBytes_ += size;
+    void* ptr = std::malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+/*
+* request and response of one rpc, on an arena with its first block inline as LicsAsyncServer
+* serves them, or on the heap as the sync service does.
+*/
+template <typename Request, typename Response>
+class BenchCall {
+public:
+    explicit BenchCall(bool onArena) : arena_(arenaOptions(block_)),
+        req(google::protobuf::Arena::CreateMessage<Request>(onArena ? &arena_ : nullptr)),
+        resp(google::protobuf::Arena::CreateMessage<Response>(onArena ? &arena_ : nullptr)), onArena_(onArena) {}
+
+    ~BenchCall() {
+        if (!onArena_) {
+            delete req;
+            delete resp;
+        }
+    }
+
+    BenchCall(const BenchCall&) = delete;
+    BenchCall& operator=(const BenchCall&) = delete;
+
+private:
+    static google::protobuf::ArenaOptions arenaOptions(char* block) {
+        google::protobuf::ArenaOptions options;
+        options.initial_block = block;
+        options.initial_block_size = BENCH_ARENA_BYTES;
+        return options;
+    }
+
+    alignas(std::max_align_t) char block_[BENCH_ARENA_BYTES];
+    google::protobuf::Arena arena_;
+
+public:
+    Request* req;
+    Response* resp;
+
+private:
+    bool onArena_;
+};
+
+class LicsServerBench : public LicsServer {
+public:
+    LicsServerBench() {
+        // cloud sync may fetch before the overrides below are in place, load the totals explicitly.
+        std::map<long, std::shared_ptr<AlgoLics>> remote;
+        fetchAlgosTotalLicFromCloud(remote);
+        updateLocalLics(remote);
+    }
+
+    void pushAlgosUsedLicToCloud(const std::map<long, std::shared_ptr<AlgoLics>>& local) override {
+
+    }
+
+    void fetchAlgosTotalLicFromCloud(std::map<long, std::shared_ptr<AlgoLics>>& remote) override {
+        long algos[] = {UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, UNIS_VAS_OA};
+        for (long algo : algos) {
+            std::shared_ptr<AlgoLics> lics = std::make_shared<AlgoLics>();
+            lics->set_totallics(BENCH_TOTAL_LICS);
+            lics->set_usedlics(0);
+            remote[algo] = lics;
+        }
+    }
+
+    // algoNum picture algorithms are registered.
+    long Auth(int algoNum = 0, bool onArena = false) {
+        BenchCall<GetAuthAccessRequest, GetAuthAccessResponse> call(onArena);
+        addPictureLics(call.req->mutable_lics(), algoNum);
+        getAuthAccess(call.req, call.resp);
+        return call.resp->token();
+    }
+
+    // a client coming back with the token it had.
+    long Resume(long token) {
+        BenchCall<GetAuthAccessRequest, GetAuthAccessResponse> call(false);
+        call.req->set_token(token);
+        getAuthAccess(call.req, call.resp);
+        return call.resp->token();
+    }
+
+    void Create(long token, long algoID, int num, bool onArena = false) {
+        BenchCall<CreateLicsRequest, CreateLicsResponse> call(onArena);
+        call.req->set_token(token);
+        call.req->set_clientexpectedlicsnum(num);
+        call.req->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+        call.req->mutable_algo()->set_type(TaskType::VIDEO);
+        call.req->mutable_algo()->set_algorithmid(algoID);
+        createLics(call.req, call.resp);
+    }
+
+    void Delete(long token, long algoID, int num, bool onArena = false) {
+        BenchCall<DeleteLicsRequest, DeleteLicsResponse> call(onArena);
+        call.req->set_token(token);
+        call.req->set_licsnum(num);
+        call.req->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+        call.req->mutable_algo()->set_type(TaskType::VIDEO);
+        call.req->mutable_algo()->set_algorithmid(algoID);
+        deleteLics(call.req, call.resp);
+    }
+
+    void Beat(long token, int algoNum, bool onArena = false) {
+        BenchCall<KeepAliveRequest, KeepAliveResponse> call(onArena);
+        call.req->set_token(token);
+        addPictureLics(call.req->mutable_lics(), algoNum);
+        keepAlive(call.req, call.resp);
+    }
+
+    /*
+    * sweeps run on a clock of their own which jumps past every deadline, as the heartbeat wheel
+    * never goes back. clients authorized later are overdue on that clock and evicted by the next
+    * sweep, the real time sweep of doLoop never catches up with it during a run.
+    */
+    void EvictAll() {
+        long now = GetTimeSecsFromEpoch();
+        clock_ = (clock_ > now ? clock_ : now) + BENCH_HEARTBEAT_TIMEOUT_SEC + 1;
+        serverClearDeadClients(clock_);
+    }
+
+private:
+    static void addPictureLics(google::protobuf::RepeatedPtrField<AlgoLics>* lics, int algoNum) {
+        long algos[] = {UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA, UNIS_VAS_OA};
+        for (int idx = 0; idx < algoNum && idx < 2; ++idx) {
+            AlgoLics* l = lics->Add();
+            l->set_maxlimit(BENCH_CLIENT_LIMIT);
+            l->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+            l->mutable_algo()->set_type(TaskType::PICTURE);
+            l->mutable_algo()->set_algorithmid(algos[idx]);
+        }
+    }
+
+private:
+    long clock_{0};
+};
+
+// one server for the whole run, the logger it registers can not be registered twice.
+static LicsServerBench& benchServer() {
+    static LicsServerBench server;
+    return server;
+}
+
+static std::vector<long> tokens_; // clients of the running benchmark, filled up by thread 0
+
+static void setUpClients(benchmark::State& state, int clientNum) {
+    if (state.thread_index() != 0) {
+        return;
+    }
+    tokens_.clear();
+    for (int idx = 0; idx < clientNum; ++idx) {
+        tokens_.push_back(benchServer().Auth());
+    }
+}
+
+static void tearDownClients(benchmark::State& state) {
+    if (state.thread_index() != 0) {
+        return;
+    }
+    benchServer().EvictAll();
+    tokens_.clear();
+}
+
+// args: clients. one op is a grant and a release of one video license.
+static void BM_CreateDeleteLics(benchmark::State& state) {
+    setUpClients(state, state.range(0));
+    size_t next = state.thread_index();
+    for (auto _ : state) {
+        long token = tokens_[next % tokens_.size()];
+        benchServer().Create(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1);
+        benchServer().Delete(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1);
+        next += state.threads();
+    }
+    state.SetItemsProcessed(state.iterations());
+    tearDownClients(state);
+}
+BENCHMARK(BM_CreateDeleteLics)->Arg(1)->Arg(1000)->Arg(10000)->ThreadRange(1, 16)->UseRealTime();
+
+/*
+* args: clients. every fourth thread keeps registering clients and heartbeating, the others grant and
+* release one video license per op as BM_CreateDeleteLics does.
+*/
+static void BM_CreateDeleteLicsUnderAuthLoad(benchmark::State& state) {
+    setUpClients(state, state.range(0));
+    bool noise = (state.thread_index() % 4 == 3);
+    size_t next = state.thread_index();
+    for (auto _ : state) {
+        long token = tokens_[next % tokens_.size()];
+        if (noise) {
+            benchServer().Beat(benchServer().Auth(), 0);
+        } else {
+            benchServer().Create(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1);
+            benchServer().Delete(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1);
+        }
+        next += state.threads();
+    }
+    state.SetItemsProcessed(noise ? 0 : state.iterations());
+    tearDownClients(state);
+}
+BENCHMARK(BM_CreateDeleteLicsUnderAuthLoad)->Arg(1000)->ThreadRange(4, 16)->UseRealTime();
+
+// args: clients, picture algorithms per heartbeat.
+static void BM_KeepAlive(benchmark::State& state) {
+    setUpClients(state, state.range(0));
+    size_t next = state.thread_index();
+    for (auto _ : state) {
+        benchServer().Beat(tokens_[next % tokens_.size()], state.range(1));
+        next += state.threads();
+    }
+    state.SetItemsProcessed(state.iterations());
+    tearDownClients(state);
+}
+BENCHMARK(BM_KeepAlive)->ArgsProduct({{1, 1000, 10000}, {1, 2}})->ThreadRange(1, 16)->UseRealTime();
+
+// every op registers a new client, they are all evicted at the end.
+static void BM_GetAuthAccess(benchmark::State& state) {
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(benchServer().Auth());
+    }
+    state.SetItemsProcessed(state.iterations());
+    tearDownClients(state);
+}
+BENCHMARK(BM_GetAuthAccess)->ThreadRange(1, 16)->UseRealTime();
+
+// args: clients. a sweep evicting every client, each holding one video license.
+static void BM_SweepEvictAll(benchmark::State& state) {
+    for (auto _ : state) {
+        state.PauseTiming();
+        setUpClients(state, state.range(0));
+        for (long token : tokens_) {
+            benchServer().Create(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1);
+        }
+        state.ResumeTiming();
+
+        benchServer().EvictAll();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    tokens_.clear();
+}
+BENCHMARK(BM_SweepEvictAll)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+/*
+* args: clients, tokens server still knows (1) or lost to a restart (0). one op is a client coming
+* back with its old token at the same time as the others, resumed or registered anew.
+*/
+static void BM_ReconnectStorm(benchmark::State& state) {
+    setUpClients(state, state.range(0));
+    if (state.thread_index() == 0 && !state.range(1)) {
+        benchServer().EvictAll();
+    }
+    size_t next = state.thread_index();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(benchServer().Resume(tokens_[next % tokens_.size()]));
+        next += state.threads();
+    }
+    state.SetItemsProcessed(state.iterations());
+    tearDownClients(state);
+}
+BENCHMARK(BM_ReconnectStorm)->ArgsProduct({{1000, 10000}, {1, 0}})->ThreadRange(1, 16)->UseRealTime();
+
+/*
+* args: armed timers. one op is the sweep of one second on the heartbeat wheel, timers are spread over
+* the heartbeat timeout and what comes due is re-armed a timeout later, as for clients beating in time.
+*/
+static void BM_TimerWheelAdvance(benchmark::State& state) {
+    long now = 0;
+    TimerWheel wheel(BENCH_WHEEL_SLOTS, now);
+    for (long id = 0; id < state.range(0); ++id) {
+        wheel.Add(id, 1 + id % BENCH_HEARTBEAT_TIMEOUT_SEC);
+    }
+
+    std::vector<TimerWheel::Timer> expired;
+    for (auto _ : state) {
+        expired.clear();
+        wheel.Advance(++now, expired);
+        for (auto& timer : expired) {
+            wheel.Add(timer.id, now + BENCH_HEARTBEAT_TIMEOUT_SEC);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TimerWheelAdvance)->Arg(1000)->Arg(10000)->Arg(100000);
+
+enum BenchRpc { BENCH_RPC_CREATE_LICS, BENCH_RPC_DELETE_LICS, BENCH_RPC_KEEP_ALIVE, BENCH_RPC_GET_AUTH_ACCESS };
+
+/*
+* args: rpc, messages on an arena (1) or on the heap (0). heap allocations of one rpc, from building
+* the request to dropping the response, handler included. one client, two picture algorithms.
+*/
+static void BM_RpcAllocs(benchmark::State& state) {
+    static const char* names[] = {"CreateLics", "DeleteLics", "KeepAlive", "GetAuthAccess"};
+    bool onArena = state.range(1) != 0;
+    setUpClients(state, 1);
+    long token = tokens_[0];
+    benchServer().Create(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, BENCH_CLIENT_LIMIT);
+
+    long allocations = allocations_;
+    for (auto _ : state) {
+        switch (state.range(0)) {
+        case BENCH_RPC_CREATE_LICS:
+            benchServer().Create(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1, onArena);
+            break;
+        case BENCH_RPC_DELETE_LICS:
+            benchServer().Delete(token, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1, onArena);
+            break;
+        case BENCH_RPC_KEEP_ALIVE:
+            benchServer().Beat(token, 2, onArena);
+            break;
+        case BENCH_RPC_GET_AUTH_ACCESS:
+            benchmark::DoNotOptimize(benchServer().Auth(2, onArena));
+            break;
+        }
+    }
+    state.counters["allocs_per_rpc"] = static_cast<double>(allocations_ - allocations) / state.iterations();
+    state.SetLabel(std::string(names[state.range(0)]) + (onArena ? "/arena" : "/heap"));
+    tearDownClients(state);
+}
+BENCHMARK(BM_RpcAllocs)->ArgsProduct({{BENCH_RPC_CREATE_LICS, BENCH_RPC_DELETE_LICS, BENCH_RPC_KEEP_ALIVE, BENCH_RPC_GET_AUTH_ACCESS}, {0, 1}});
+
+// clients of the client table benchmarks register no algorithm, they weigh what the table adds only.
+static LicsLedger emptyLedger_;
+
+// args: clients. one op is a lookup of a random registered token.
+static void BM_ClientTableFind(benchmark::State& state) {
+    std::shared_ptr<SlabPool> pool = std::make_shared<SlabPool>();
+    ClientTable table;
+    long base = GetTimeSecsFromEpoch() << 20;
+    for (long idx = 0; idx < state.range(0); ++idx) {
+        table.Insert(base + idx, std::allocate_shared<Client>(PoolAllocator<Client>(pool), base + idx, emptyLedger_));
+    }
+
+    unsigned long seed = 1;
+    for (auto _ : state) {
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        benchmark::DoNotOptimize(table.Find(base + static_cast<long>((seed >> 33) % state.range(0))));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ClientTableFind)->Arg(10000)->Arg(100000)->Arg(1000000);
+
+// the std::map and make_shared the table replaced, same workload.
+static void BM_ClientMapFind(benchmark::State& state) {
+    std::map<long, std::shared_ptr<Client>> table;
+    long base = GetTimeSecsFromEpoch() << 20;
+    for (long idx = 0; idx < state.range(0); ++idx) {
+        table[base + idx] = std::make_shared<Client>(base + idx, emptyLedger_);
+    }
+
+    unsigned long seed = 1;
+    for (auto _ : state) {
+        seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+        auto search = table.find(base + static_cast<long>((seed >> 33) % state.range(0)));
+        benchmark::DoNotOptimize(search == table.end() ? nullptr : search->second);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ClientMapFind)->Arg(10000)->Arg(100000)->Arg(1000000);
+
+// args: clients. one op registers a client and evicts the oldest one, the table stays at its size.
+static void BM_ClientTableInsertErase(benchmark::State& state) {
+    std::shared_ptr<SlabPool> pool = std::make_shared<SlabPool>();
+    ClientTable table;
+    long base = GetTimeSecsFromEpoch() << 20;
+    long next = base;
+    for (; next < base + state.range(0); ++next) {
+        table.Insert(next, std::allocate_shared<Client>(PoolAllocator<Client>(pool), next, emptyLedger_));
+    }
+
+    for (auto _ : state) {
+        table.Insert(next, std::allocate_shared<Client>(PoolAllocator<Client>(pool), next, emptyLedger_));
+        table.Erase(next - state.range(0));
+        ++next;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ClientTableInsertErase)->Arg(10000)->Arg(100000)->Arg(1000000);
+
+static void BM_ClientMapInsertErase(benchmark::State& state) {
+    std::map<long, std::shared_ptr<Client>> table;
+    long base = GetTimeSecsFromEpoch() << 20;
+    long next = base;
+    for (; next < base + state.range(0); ++next) {
+        table[next] = std::make_shared<Client>(next, emptyLedger_);
+    }
+
+    for (auto _ : state) {
+        table[next] = std::make_shared<Client>(next, emptyLedger_);
+        table.erase(next - state.range(0));
+        ++next;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ClientMapInsertErase)->Arg(10000)->Arg(100000)->Arg(1000000);
+
+// args: algorithms in the ledger, the client registers all of them. reports heap cost of one client
+// built from a pool as the server does, beyond the pool block that is recycled.
+static void BM_NewClient(benchmark::State& state) {
+    LicsLedger ledger;
+    for (long algo = 0; algo < state.range(0); ++algo) {
+        ledger.AddAlgo(algo, TaskType::VIDEO);
+    }
+    std::shared_ptr<SlabPool> pool = std::make_shared<SlabPool>();
+
+    long allocations = allocations_;
+    long bytes = allocatedBytes_;
+    for (auto _ : state) {
+        std::shared_ptr<Client> client = std::allocate_shared<Client>(PoolAllocator<Client>(pool), 1, ledger);
+        for (int slot = 0; slot < ledger.Slots(); ++slot) {
+            client->Register(slot, BENCH_CLIENT_LIMIT);
+        }
+        benchmark::DoNotOptimize(client);
+    }
+    state.counters["allocs_per_client"] = benchmark::Counter(static_cast<double>(allocations_ - allocations) / state.iterations());
+    state.counters["bytes_per_client"] = benchmark::Counter(static_cast<double>(allocatedBytes_ - bytes) / state.iterations());
+}
+BENCHMARK(BM_NewClient)->Arg(3)->Arg(CLIENT_INLINE_SLOTS)->Arg(64);
+
+// args: license classes in the document, one in eight has a rule. one op parses the whole document.
+static void BM_ParseEntitlement(benchmark::State& state) {
+    std::vector<EntitlementRule> rules = EntitlementParser::DefaultRules();
+    EntitlementParser parser(rules);
+    std::string json = "{\"code\": 0, \"message\": \"ok\", \"data\": {\"res\": {";
+    for (long idx = 0; idx < state.range(0); ++idx) {
+        std::string key = idx % 8 == 0 ? rules[idx / 8 % rules.size()].key : "CLASS" + std::to_string(idx) + "-MAX-CLASSES";
+        json += (idx ? ", \"" : "\"") + key + "\": {\"num\": " + std::to_string(idx) + ", \"expire\": \"2099-12-31 23:59:59\"}";
+    }
+    json += "}}}";
+
+    std::map<long, int> totals;
+    long allocations = allocations_;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(parser.Parse(json.c_str(), totals));
+    }
+    state.SetBytesProcessed(state.iterations() * json.size());
+    state.counters["allocs_per_parse"] = static_cast<double>(allocations_ - allocations) / state.iterations();
+}
+BENCHMARK(BM_ParseEntitlement)->Arg(8)->Arg(1000)->Arg(100000);
+
+BENCHMARK_MAIN();
@@ -1,6 +1,12 @@
 #include "server.h"
+#include "async_server.h"
 
 #include "gtest/gtest.h"
+#include "spdlog/spdlog.h"
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
 
 #define TEST_MAX_OA_LICS_NUM    (100000)
 #define TEST_MAX_OD_LICS_NUM    (100000)
@@ -8,13 +14,40 @@
 #define TEST_MAX_CLIENT_LIMIT   (500)
 
 #define TEST_10_LICS  (10)
+#define TEST_LOOP_CNT   (100)
+#define TEST_HEARTBEAT_TIMEOUT_SEC    (90)
+#define TEST_RESERVOIR_CEILING    (64) // server default, used when conf has no reservoir_ceiling
+#define TEST_HEARTBEAT_INTERVAL_MS    (10000) // server default
+#define TEST_HEARTBEAT_BUSY_CLIENTS   (1000) // server default
+
+// a WAL dir of its own for every fixture, made before the server starts logging into it, so it
+// replays nothing earlier tests or a real server left behind and writes nothing they will see.
+struct TestWalDir {
+  TestWalDir() {
+    if (!mkdtemp(walDir)) {
+      walDir[0] = '\0'; // WAL off
+    }
+  }
 
-class LicsServerTests : public testing::Test, public LicsServer {
+  char walDir[32] = "/tmp/lics_server_wal_XXXXXX";
+};
+
+class LicsServerTests : public testing::Test, private TestWalDir, public LicsServer {
+public:
+    LicsServerTests() : LicsServer(walDir) {}
+
+private:
     // virtual void SetUp() will be called before each test is run.  You
     // should define it if you need to initialize the variables.
     // Otherwise, this can be skipped.
     void SetUp() override {
       sleep(1);// make some time to get server ready for loading data.
+
+      // cloud sync starts inside the LicsServer constructor and may fetch before the overrides below
+      // are in place, so load the test totals explicitly.
+      std::map<long, std::shared_ptr<AlgoLics>> remote;
+      fetchAlgosTotalLicFromCloud(remote);
+      updateLocalLics(remote);
     }
 
     // virtual void TearDown() will be called after each test is run.
@@ -23,6 +56,9 @@ class LicsServerTests : public testing::Test, public LicsServer {
     //
     void TearDown() {
       Shutdown();
+      if (walDir[0] != '\0') {
+        std::system((std::string("rm -rf ") + walDir).c_str());
+      }
     }
 
 
@@ -95,6 +131,70 @@ public:
     EXPECT_EQ(deleteResp.respcode(), ELICS_OK);
   }
 
+  void CreateOdLicAsMuchAsPossible(int expected, std::atomic<int>* granted) {
+    GetAuthAccessRequest authReq;
+    GetAuthAccessResponse authResp;
+    Status ret = getAuthAccess(&authReq,  &authResp);
+    EXPECT_TRUE(ret.ok());
+
+    CreateLicsRequest createReq;
+    CreateLicsResponse createResp;
+    createReq.set_token(authResp.token());
+    createReq.set_clientexpectedlicsnum(expected);
+    createReq.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    createReq.mutable_algo()->set_type(TaskType::VIDEO);
+    createReq.mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+    ret = createLics(&createReq, &createResp);
+    EXPECT_TRUE(ret.ok());
+    EXPECT_LE(createResp.clientgetactuallicsnum(), expected);
+    *granted += createResp.clientgetactuallicsnum();
+  }
+
+  void CreateAndDeleteOdLicLoop(long token, int loop) {
+    CreateLicsRequest createReq;
+    CreateLicsResponse createResp;
+    createReq.set_token(token);
+    createReq.set_clientexpectedlicsnum(TEST_10_LICS);
+    createReq.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    createReq.mutable_algo()->set_type(TaskType::VIDEO);
+    createReq.mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+
+    DeleteLicsRequest deleteReq;
+    DeleteLicsResponse deleteResp;
+    deleteReq.set_token(token);
+    deleteReq.set_licsnum(TEST_10_LICS);
+    deleteReq.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    deleteReq.mutable_algo()->set_type(TaskType::VIDEO);
+    deleteReq.mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+
+    for (int cnt = 0; cnt < loop; ++cnt) {
+      createLics(&createReq, &createResp);
+      EXPECT_EQ(createResp.clientgetactuallicsnum(), TEST_10_LICS);
+      deleteLics(&deleteReq, &deleteResp);
+      EXPECT_EQ(deleteResp.licsnum(), TEST_10_LICS);
+    }
+  }
+
+  std::string MetricsText() {
+    GetMetricsRequest req;
+    GetMetricsResponse resp;
+    getMetrics(&req, &resp);
+    return resp.text();
+  }
+
+  void AuthAndKeepAliveLoop(int loop) {
+    for (int cnt = 0; cnt < loop; ++cnt) {
+      GetAuthAccessRequest authReq;
+      GetAuthAccessResponse authResp;
+      getAuthAccess(&authReq,  &authResp);
+
+      KeepAliveRequest req;
+      KeepAliveResponse resp;
+      req.set_token(authResp.token());
+      keepAlive(&req, &resp);
+    }
+  }
+
 };
 
 // interface tests
@@ -108,6 +208,28 @@ TEST_F(LicsServerTests, AuthShouldOk) {
   EXPECT_GT(response.token(), 0);
 }
 
+// a client coming back with its token keeps it while server knows it, and gets a new one after eviction.
+TEST_F(LicsServerTests, AuthResumesKnownToken) {
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  getAuthAccess(&authReq,  &authResp);
+  long token = authResp.token();
+  EXPECT_EQ(totalClientNum(), 1);
+
+  authReq.set_token(token);
+  getAuthAccess(&authReq,  &authResp);
+  EXPECT_EQ(authResp.respcode(), ELICS_OK);
+  EXPECT_EQ(authResp.token(), token);
+  EXPECT_EQ(totalClientNum(), 1);
+
+  serverClearDeadClients(GetTimeSecsFromEpoch() + TEST_HEARTBEAT_TIMEOUT_SEC + 1);
+  EXPECT_EQ(totalClientNum(), 0);
+  getAuthAccess(&authReq,  &authResp);
+  EXPECT_EQ(authResp.respcode(), ELICS_OK);
+  EXPECT_NE(authResp.token(), token);
+  EXPECT_EQ(totalClientNum(), 1);
+}
+
 TEST_F(LicsServerTests, CreateOdLicsShouldReturn10) {
 
   GetAuthAccessRequest authReq;
@@ -162,9 +284,11 @@ TEST_F(LicsServerTests, 1ClientFetchOaLics) {
   EXPECT_TRUE(ret.ok());
   EXPECT_EQ(resp.respcode(), ELICS_OK);
 
+  EXPECT_EQ(resp.lics_size(), 1);
   for (int idx = 0; idx < resp.lics_size(); ++idx ) {
       int algoID = resp.lics(idx).algo().algorithmid();
       int total = resp.lics(idx).totallics();
+      EXPECT_EQ(algoID, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA);
       EXPECT_EQ(total, TEST_MAX_CLIENT_LIMIT); 
   }
 }
@@ -206,6 +330,127 @@ TEST_F(LicsServerTests, DeleteOdLicsShouldReturnOk) {
 
 }
 
+TEST_F(LicsServerTests, BatchCreateAndDeleteOdLics) {
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  Status ret = getAuthAccess(&authReq,  &authResp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_EQ(authResp.respcode(), ELICS_OK);
+
+  BatchCreateLicsRequest createReq;
+  BatchCreateLicsResponse createResp;
+  createReq.set_token(authResp.token());
+  for (int idx = 0; idx < TEST_10_LICS; ++idx) {
+    CreateLicsRequest* item = createReq.add_items();
+    item->set_clientexpectedlicsnum(TEST_10_LICS);
+    item->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    item->mutable_algo()->set_type(TaskType::VIDEO);
+    item->mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+  }
+  // picture licenses are not granted by server
+  CreateLicsRequest* oa = createReq.add_items();
+  oa->set_clientexpectedlicsnum(TEST_10_LICS);
+  oa->mutable_algo()->set_type(TaskType::PICTURE);
+  oa->mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA);
+
+  ret = batchCreateLics(&createReq, &createResp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_EQ(createResp.respcode(), ELICS_OK);
+  ASSERT_EQ(createResp.items_size(), TEST_10_LICS + 1);
+  for (int idx = 0; idx < TEST_10_LICS; ++idx) {
+    EXPECT_EQ(createResp.items(idx).clientgetactuallicsnum(), TEST_10_LICS);
+  }
+  EXPECT_EQ(createResp.items(TEST_10_LICS).clientgetactuallicsnum(), 0);
+
+  int total, used;
+  licsQuery(authResp.token(), UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+  EXPECT_EQ(used, TEST_10_LICS * TEST_10_LICS);
+
+  BatchDeleteLicsRequest deleteReq;
+  BatchDeleteLicsResponse deleteResp;
+  deleteReq.set_token(authResp.token());
+  for (int idx = 0; idx < TEST_10_LICS; ++idx) {
+    DeleteLicsRequest* item = deleteReq.add_items();
+    item->set_licsnum(TEST_10_LICS);
+    item->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    item->mutable_algo()->set_type(TaskType::VIDEO);
+    item->mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+  }
+  ret = batchDeleteLics(&deleteReq, &deleteResp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_EQ(deleteResp.respcode(), ELICS_OK);
+  ASSERT_EQ(deleteResp.items_size(), TEST_10_LICS);
+  for (int idx = 0; idx < TEST_10_LICS; ++idx) {
+    EXPECT_EQ(deleteResp.items(idx).licsnum(), TEST_10_LICS);
+  }
+
+  licsQuery(authResp.token(), UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+  EXPECT_EQ(used, 0);
+
+  // unknown token fails the whole batch
+  createReq.set_token(-1);
+  createResp.Clear();
+  ret = batchCreateLics(&createReq, &createResp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_EQ(createResp.respcode(), ELICS_CLIENT_NOT_EXIST);
+  EXPECT_EQ(createResp.items_size(), 0);
+}
+
+TEST_F(LicsServerTests, ReservoirLeaseIsCappedAndKeptApart) {
+  int ceiling = getServerConf()->GetIntItem("reservoir_ceiling", TEST_RESERVOIR_CEILING);
+
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  Status ret = getAuthAccess(&authReq,  &authResp);
+  EXPECT_TRUE(ret.ok());
+
+  CreateLicsRequest createReq;
+  CreateLicsResponse createResp;
+  createReq.set_token(authResp.token());
+  createReq.set_clientexpectedlicsnum(ceiling * 2);
+  createReq.set_reservoir(true);
+  createReq.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+  createReq.mutable_algo()->set_type(TaskType::VIDEO);
+  createReq.mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+  ret = createLics(&createReq, &createResp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_EQ(createResp.clientgetactuallicsnum(), ceiling);
+
+  // ceiling reached
+  ret = createLics(&createReq, &createResp);
+  EXPECT_EQ(createResp.clientgetactuallicsnum(), 0);
+
+  int total, used;
+  licsQuery(authResp.token(), UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+  EXPECT_EQ(used, ceiling);
+  EXPECT_EQ(reservedLicsByAlgoID(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD), ceiling);
+
+  // a lease is not a task grant, and the other way round
+  DeleteLicsRequest deleteReq;
+  DeleteLicsResponse deleteResp;
+  deleteReq.set_token(authResp.token());
+  deleteReq.set_licsnum(TEST_10_LICS);
+  deleteReq.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+  deleteReq.mutable_algo()->set_type(TaskType::VIDEO);
+  deleteReq.mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+  ret = deleteLics(&deleteReq, &deleteResp);
+  EXPECT_EQ(deleteResp.licsnum(), 0);
+
+  deleteReq.set_reservoir(true);
+  ret = deleteLics(&deleteReq, &deleteResp);
+  EXPECT_EQ(deleteResp.licsnum(), TEST_10_LICS);
+  EXPECT_EQ(reservedLicsByAlgoID(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD), ceiling - TEST_10_LICS);
+
+  // eviction gives leases back too
+  serverClearDeadClients(GetTimeSecsFromEpoch() + TEST_HEARTBEAT_TIMEOUT_SEC + 1);
+  EXPECT_EQ(totalClientNum(), 0);
+  EXPECT_EQ(reservedLicsByAlgoID(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD), 0);
+
+  ret = getAuthAccess(&authReq,  &authResp);
+  licsQuery(authResp.token(), UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+  EXPECT_EQ(used, 0);
+}
+
 TEST_F(LicsServerTests,KeepAlive) {
   GetAuthAccessRequest authReq;
   GetAuthAccessResponse authResp;
@@ -234,6 +479,522 @@ TEST_F(LicsServerTests,KeepAlive) {
   EXPECT_EQ(resp.respcode(), ELICS_OK);
 }
 
+TEST_F(LicsServerTests, KeepAliveStreamDelta) {
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  Status ret = getAuthAccess(&authReq,  &authResp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_EQ(authResp.respcode(), ELICS_OK);
+
+  KeepAliveSession session;
+  KeepAliveRequest req;
+  KeepAliveResponse resp;
+  req.set_token(authResp.token());
+  req.set_version(1);
+  AlgoLics* lics = req.add_lics();
+  lics->set_maxlimit(TEST_MAX_CLIENT_LIMIT);
+  lics->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+  lics->mutable_algo()->set_type(TaskType::PICTURE);
+  lics->mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA);
+
+  // full snapshot is answered with every share
+  EXPECT_TRUE(keepAliveStream(session, &req, &resp));
+  EXPECT_EQ(resp.respcode(), ELICS_OK);
+  EXPECT_EQ(resp.version(), 1);
+  EXPECT_EQ(resp.lics_size(), 1);
+  EXPECT_EQ(resp.lics(0).totallics(), TEST_MAX_CLIENT_LIMIT);
+
+  // empty delta: alive, nothing changed, nothing to answer
+  KeepAliveRequest beat;
+  beat.set_token(authResp.token());
+  beat.set_delta(true);
+  beat.set_version(1);
+  resp.Clear();
+  EXPECT_FALSE(keepAliveStream(session, &beat, &resp));
+
+  // a changed maxLimit moves the version and the share
+  req.set_delta(true);
+  req.set_version(2);
+  req.mutable_lics(0)->set_maxlimit(TEST_10_LICS);
+  resp.Clear();
+  EXPECT_TRUE(keepAliveStream(session, &req, &resp));
+  EXPECT_EQ(resp.lics_size(), 1);
+  EXPECT_EQ(resp.lics(0).totallics(), TEST_10_LICS);
+
+  // a skipped version is refused
+  req.set_version(4);
+  resp.Clear();
+  EXPECT_TRUE(keepAliveStream(session, &req, &resp));
+  EXPECT_EQ(resp.respcode(), ELICS_HEARTBEAT_OUT_OF_SYNC);
+}
+
+TEST_F(LicsServerTests, HeartbeatPaceSlowsDownWhenBusy) {
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  Status ret = getAuthAccess(&authReq,  &authResp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_EQ(authResp.heartbeatintervalms(), TEST_HEARTBEAT_INTERVAL_MS);
+  EXPECT_LT(authResp.heartbeatjitterms(), authResp.heartbeatintervalms());
+
+  for (int idx = 0; idx < 2 * TEST_HEARTBEAT_BUSY_CLIENTS; ++idx) {
+    getAuthAccess(&authReq,  &authResp);
+  }
+
+  KeepAliveRequest req;
+  KeepAliveResponse resp;
+  req.set_token(authResp.token());
+  ret = keepAlive(&req, &resp);
+  EXPECT_TRUE(ret.ok());
+  EXPECT_GT(resp.heartbeatintervalms(), TEST_HEARTBEAT_INTERVAL_MS);
+  EXPECT_LT(resp.heartbeatjitterms(), resp.heartbeatintervalms());
+}
+
+TEST_F(LicsServerTests, MetricsCountRpcsAndGrants) {
+  // a bucket holds its lower bound and is at most 1/16 wide.
+  long values[] = {0, 15, 16, 17, 1000, 123456789};
+  for (long value : values) {
+    long lower = LatencyHistogram::BucketLowerBound(LatencyHistogram::BucketOf(value));
+    EXPECT_LE(lower, value);
+    EXPECT_LE(value - lower, value / 16);
+  }
+
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  getAuthAccess(&authReq,  &authResp);
+
+  CreateLicsRequest req;
+  CreateLicsResponse resp;
+  req.set_token(authResp.token());
+  req.set_clientexpectedlicsnum(TEST_10_LICS);
+  req.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+  req.mutable_algo()->set_type(TaskType::VIDEO);
+  req.mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+  createLics(&req, &resp);
+  req.set_clientexpectedlicsnum(TEST_MAX_OD_LICS_NUM);
+  createLics(&req, &resp);
+
+  GetMetricsRequest metricsReq;
+  GetMetricsResponse metricsResp;
+  Status ret = getMetrics(&metricsReq, &metricsResp);
+  EXPECT_TRUE(ret.ok());
+  std::string text = metricsResp.text();
+  EXPECT_NE(text.find("lics_rpc_latency_ns_count{rpc=\"CreateLics\"} 2\n"), std::string::npos);
+  EXPECT_NE(text.find("lics_rpc_latency_ns_count{rpc=\"GetAuthAccess\"} 1\n"), std::string::npos);
+  EXPECT_NE(text.find("lics_licenses_granted_total{algo=\"100\"} " + std::to_string(TEST_MAX_OD_LICS_NUM) + "\n"), std::string::npos);
+  EXPECT_NE(text.find("lics_licenses_denied_total{algo=\"100\"} " + std::to_string(TEST_10_LICS) + "\n"), std::string::npos);
+  EXPECT_NE(text.find("lics_clients_registered_total 1\n"), std::string::npos);
+  EXPECT_NE(text.find("lics_clients 1\n"), std::string::npos);
+}
+
+TEST_F(LicsServerTests, AsyncServerShutsDownWithCallsInFlight) {
+  LicsAsyncServer asyncService(this, 1, 2, std::vector<int>());
+  grpc::ServerBuilder builder;
+  builder.AddListeningPort("127.0.0.1:50071", grpc::InsecureServerCredentials());
+  ASSERT_TRUE(asyncService.BuildAndStart(builder));
+  OnShutdown([&asyncService]() { asyncService.Shutdown(); });
+  std::thread runner([&asyncService]() { asyncService.Run(); });
+
+  std::unique_ptr<License::Stub> stub = License::NewStub(grpc::CreateChannel("127.0.0.1:50071", grpc::InsecureChannelCredentials()));
+  grpc::ClientContext ctx;
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  EXPECT_TRUE(stub->GetAuthAccess(&ctx, authReq, &authResp).ok());
+
+  // a keepalive stream left open is cancelled by the shutdown.
+  grpc::ClientContext streamCtx;
+  std::unique_ptr<grpc::ClientReaderWriter<KeepAliveRequest, KeepAliveResponse>> stream = stub->KeepAliveStream(&streamCtx);
+  KeepAliveRequest beat;
+  KeepAliveResponse answer;
+  beat.set_token(authResp.token());
+  EXPECT_TRUE(stream->Write(beat));
+  EXPECT_TRUE(stream->Read(&answer));
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  Shutdown();
+  runner.join(); // Run returns once the queues are drained
+  OnShutdown(nullptr);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  EXPECT_FALSE(stream->Read(&answer));
+
+  grpc::ClientContext lateCtx;
+  lateCtx.set_deadline(std::chrono::system_clock::now() + std::chrono::milliseconds(500));
+  EXPECT_FALSE(stub->GetAuthAccess(&lateCtx, authReq, &authResp).ok());
+}
+
+TEST(LatencyHistogramTests, LargestValuesStayInLastBucket) {
+  // the last power of two that gets buckets of its own ends in the last bucket.
+  EXPECT_EQ(LatencyHistogram::BucketOf((1L << HISTOGRAM_MAX_BITS) - 1), HISTOGRAM_BUCKETS - 1);
+  long values[] = {1L << HISTOGRAM_MAX_BITS, (1L << (HISTOGRAM_MAX_BITS + 1)) - 1, 1L << 62, LONG_MAX};
+  for (long value : values) {
+    EXPECT_EQ(LatencyHistogram::BucketOf(value), HISTOGRAM_BUCKETS - 1);
+  }
+
+  LatencyHistogram histogram;
+  histogram.Record(LONG_MAX);
+  histogram.Record(1L << HISTOGRAM_MAX_BITS);
+  LatencyHistogram::Snapshot snapshot;
+  histogram.Snap(snapshot);
+  EXPECT_EQ(snapshot.count, 2);
+  EXPECT_EQ(snapshot.buckets[HISTOGRAM_BUCKETS - 1], 2);
+}
+
+TEST(LatencyHistogramTests, HeapMetricsAreCacheLineAligned) {
+  for (int idx = 0; idx < 8; ++idx) {
+    std::unique_ptr<MetricsCounter> counter(new MetricsCounter());
+    std::unique_ptr<LatencyHistogram> histogram(new LatencyHistogram());
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(counter.get()) % METRICS_CACHE_LINE, 0);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(histogram.get()) % METRICS_CACHE_LINE, 0);
+  }
+}
+
+TEST(CircuitBreakerTests, OpensAfterFailuresAndBacksOff) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  CircuitBreaker breaker(3, std::chrono::milliseconds(100), std::chrono::milliseconds(300));
+
+  breaker.Fail(now);
+  breaker.Fail(now);
+  EXPECT_TRUE(breaker.Allow(now));
+  EXPECT_FALSE(breaker.Opened());
+
+  breaker.Fail(now);
+  EXPECT_TRUE(breaker.Opened());
+  EXPECT_FALSE(breaker.Allow(now + std::chrono::milliseconds(99)));
+  EXPECT_TRUE(breaker.Allow(now + std::chrono::milliseconds(100)));
+
+  // failed trial, backoff doubles and stops at the max.
+  now += std::chrono::milliseconds(100);
+  breaker.Fail(now);
+  EXPECT_FALSE(breaker.Allow(now + std::chrono::milliseconds(199)));
+  EXPECT_TRUE(breaker.Allow(now + std::chrono::milliseconds(200)));
+  now += std::chrono::milliseconds(200);
+  breaker.Fail(now);
+  EXPECT_FALSE(breaker.Allow(now + std::chrono::milliseconds(299)));
+  EXPECT_TRUE(breaker.Allow(now + std::chrono::milliseconds(300)));
+
+  breaker.Succeed();
+  EXPECT_FALSE(breaker.Opened());
+  EXPECT_TRUE(breaker.Allow(now));
+}
+
+TEST(EntitlementParserTests, SumsClassesByRuleTable) {
+  EntitlementParser parser(EntitlementParser::DefaultRules());
+  std::map<long, int> totals;
+
+  const char* json = "{\"code\": 0, \"res\": {\"VIASOD-MAX-CLASSES\": {\"num\": 99}},"
+      "\"data\": {\"res\": {"
+      "\"VIASFACEP-MAX-CLASSES\": {\"num\": 10, \"expire\": \"2099-01-01\"},"
+      "\"VIASCAR-MAX-CLASSES\": {\"meta\": {\"num\": 7}, \"num\": 172800},"
+      "\"VIASOD-MAX-CLASSES\": {\"num\": 5, \"tags\": [1, {\"num\": 3}]},"
+      "\"FVSAOD-MAX-CLASSES\": {\"num\": 2},"
+      "\"UNKNOWN-MAX-CLASSES\": {\"num\": 1000}}}}";
+  ASSERT_TRUE(parser.Parse(json, totals));
+  EXPECT_EQ(totals.size(), 2);
+  EXPECT_EQ(totals[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA], 12); // 10 + 172800 / 86400
+  EXPECT_EQ(totals[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD], 7);
+
+  // algorithms of the table without any class in the document are zero.
+  ASSERT_TRUE(parser.Parse("{\"data\": {\"res\": {}}}", totals));
+  EXPECT_EQ(totals[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA], 0);
+  EXPECT_EQ(totals[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD], 0);
+
+  EXPECT_FALSE(parser.Parse("{\"data\": {}}", totals));
+  EXPECT_FALSE(parser.Parse("{\"data\": {\"res\": {\"VIASOD-MAX-CLASSES\": {\"num\": 5}", totals));
+  EXPECT_FALSE(parser.Parse("", totals));
+}
+
+TEST(EntitlementParserTests, ParseRulesFromConf) {
+  std::vector<EntitlementRule> rules;
+  ASSERT_TRUE(EntitlementParser::ParseRules("VIASOD-MAX-CLASSES:100,VIASCAR-MAX-CLASSES:101/86400", rules));
+  ASSERT_EQ(rules.size(), 2);
+  EXPECT_EQ(rules[1].key, "VIASCAR-MAX-CLASSES");
+  EXPECT_EQ(rules[1].algoID, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA);
+  EXPECT_EQ(rules[1].divisor, 86400);
+
+  // a class may feed more than one algorithm.
+  ASSERT_TRUE(EntitlementParser::ParseRules("VIASOA-MAX-CLASSES:101,VIASOA-MAX-CLASSES:102/2", rules));
+  EntitlementParser parser(rules);
+  std::map<long, int> totals;
+  ASSERT_TRUE(parser.Parse("{\"data\": {\"res\": {\"VIASOA-MAX-CLASSES\": {\"num\": 8}}}}", totals));
+  EXPECT_EQ(totals[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA], 8);
+  EXPECT_EQ(totals[UNIS_VAS_OA], 4);
+
+  EXPECT_FALSE(EntitlementParser::ParseRules("", rules));
+  EXPECT_FALSE(EntitlementParser::ParseRules("VIASOD-MAX-CLASSES", rules));
+  EXPECT_FALSE(EntitlementParser::ParseRules("VIASOD-MAX-CLASSES:od", rules));
+  EXPECT_FALSE(EntitlementParser::ParseRules("VIASCAR-MAX-CLASSES:101/0", rules));
+  EXPECT_EQ(rules.size(), 2);
+}
+
+static UsageSample usageSampleAt(long at, int used) {
+  UsageSample sample;
+  sample.from = at;
+  sample.to = at;
+  sample.algos[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD].total = 100;
+  sample.algos[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD].used = used;
+  sample.algos[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD].peak = used;
+  return sample;
+}
+
+TEST(UsageBacklogTests, MergesShortestNeighboursWhenFull) {
+  UsageBacklog backlog(3);
+  backlog.Add(usageSampleAt(0, 5));
+  backlog.Add(usageSampleAt(30, 9));
+  backlog.Add(usageSampleAt(40, 2));
+  backlog.Add(usageSampleAt(100, 4)); // 30 and 40 are closest, they merge
+  EXPECT_EQ(backlog.Size(), 3);
+
+  std::vector<UsageSample> samples;
+  backlog.Take(samples);
+  EXPECT_EQ(backlog.Size(), 0);
+  ASSERT_EQ(samples.size(), 3);
+  EXPECT_EQ(samples[1].from, 30);
+  EXPECT_EQ(samples[1].to, 40);
+  EXPECT_EQ(samples[1].snapshots, 2);
+  EXPECT_EQ(samples[1].algos[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD].used, 2);
+  EXPECT_EQ(samples[1].algos[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD].peak, 9);
+
+  // a failed upload puts its samples back in front of newer ones, still bounded.
+  backlog.Add(usageSampleAt(130, 1));
+  backlog.PutBack(samples);
+  EXPECT_TRUE(samples.empty());
+  backlog.Take(samples);
+  ASSERT_EQ(samples.size(), 3);
+  EXPECT_EQ(samples.front().from, 0);
+  EXPECT_EQ(samples.back().to, 130);
+  EXPECT_EQ(samples[0].snapshots + samples[1].snapshots + samples[2].snapshots, 5);
+
+  std::vector<UsageSample> one{usageSampleAt(7, 3)};
+  EXPECT_EQ(UsageBacklog::Encode(one),
+      "{\"samples\":[{\"from\":7,\"to\":7,\"snapshots\":1,\"algos\":[{\"id\":100,\"total\":100,\"used\":3,\"peak\":3}]}]}");
+}
+
+TEST(LicsWalTests, RecoversSnapshotAndSegments) {
+  char dir[] = "/tmp/lics_wal_XXXXXX";
+  ASSERT_NE(mkdtemp(dir), nullptr);
+  std::map<long, std::string> algos{{UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, "od"}};
+
+  {
+    LicsWal wal(dir);
+    WalState state;
+    ASSERT_TRUE(wal.Recover(state));
+    EXPECT_TRUE(state.clients.empty());
+
+    wal.Register(1001, algos);
+    wal.Grant(1001, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 5, false);
+    wal.Grant(1001, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 2, true);
+    wal.Register(1002, algos);
+    wal.Grant(1002, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 9, false);
+    wal.Free(1001, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 2, false);
+    wal.Evict(1002);
+    ASSERT_TRUE(wal.Checkpoint());
+
+    // a free may be logged before the grant it gives back, replay only keeps the sum.
+    wal.Register(1003, algos);
+    wal.Free(1003, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 1, false);
+    wal.Grant(1003, UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, 4, false);
+    wal.Sync();
+  }
+
+  // a crash in the middle of a write leaves a torn record behind.
+  std::ofstream torn(std::string(dir) + "/wal.1", std::ios::app | std::ios::binary);
+  torn.write("\x20\x00\x00\x00\x01", 5);
+  torn.close();
+
+  WalState state;
+  {
+    LicsWal wal(dir);
+    ASSERT_TRUE(wal.Recover(state));
+    EXPECT_EQ(state.tokenBase, 1003);
+    ASSERT_EQ(state.clients.size(), 2);
+    EXPECT_EQ(state.clients[1001].algos[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD], "od");
+    EXPECT_EQ(state.clients[1001].held[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD], 3);
+    EXPECT_EQ(state.clients[1001].reserved[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD], 2);
+    EXPECT_EQ(state.clients[1003].held[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD], 3);
+    EXPECT_EQ(state.clients.count(1002), 0);
+
+    // the log goes on after the torn segment and folds it into the next snapshot.
+    wal.Evict(1001);
+    ASSERT_TRUE(wal.Checkpoint());
+  }
+
+  LicsWal wal(dir);
+  ASSERT_TRUE(wal.Recover(state));
+  EXPECT_EQ(state.clients.size(), 1);
+  EXPECT_EQ(state.clients[1003].held[UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD], 3);
+
+  std::system((std::string("rm -rf ") + dir).c_str());
+}
+
+TEST(LicsWalTests, RejectsTruncatedSnapshot) {
+  char dir[] = "/tmp/lics_wal_XXXXXX";
+  ASSERT_NE(mkdtemp(dir), nullptr);
+
+  // server fixtures shut spdlog down when they go, the error logged below needs a logger.
+  if (!spdlog::default_logger()) {
+    spdlog::set_default_logger(std::make_shared<spdlog::logger>("wal_test"));
+  }
+
+  // shorter than its own checksum.
+  std::ofstream snapshot(std::string(dir) + "/snapshot", std::ios::binary);
+  snapshot.write("\x01\x02", 2);
+  snapshot.close();
+
+  LicsWal wal(dir);
+  WalState state;
+  EXPECT_FALSE(wal.Recover(state));
+  wal.Sync(); // the log never started, nothing to wait for
+
+  std::system((std::string("rm -rf ") + dir).c_str());
+}
+
+TEST(TimerWheelTests, CollectsOnlyDueTimers) {
+  TimerWheel wheel(8, 100);
+  wheel.Add(1, 102);
+  wheel.Add(2, 103);
+  wheel.Add(3, 90); // overdue, goes into the next slot
+  EXPECT_EQ(wheel.Size(), 3u);
+
+  std::vector<TimerWheel::Timer> expired;
+  wheel.Advance(101, expired);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_EQ(expired[0].id, 3);
+
+  expired.clear();
+  wheel.Advance(101, expired); // not moving, nothing comes due twice
+  wheel.Advance(100, expired);
+  EXPECT_TRUE(expired.empty());
+
+  wheel.Advance(102, expired);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_EQ(expired[0].id, 1);
+  EXPECT_EQ(wheel.Size(), 1u);
+}
+
+TEST(TimerWheelTests, LaterRoundsStayInTheirSlot) {
+  TimerWheel wheel(8, 100);
+  wheel.Add(1, 103); // this round
+  wheel.Add(2, 111); // same slot, next round
+  wheel.Add(3, 127); // same slot, three rounds later
+
+  std::vector<TimerWheel::Timer> expired;
+  wheel.Advance(103, expired);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_EQ(expired[0].id, 1);
+
+  expired.clear();
+  wheel.Advance(110, expired);
+  EXPECT_TRUE(expired.empty());
+  wheel.Advance(111, expired);
+  ASSERT_EQ(expired.size(), 1u);
+  EXPECT_EQ(expired[0].id, 2);
+
+  // a pause longer than a revolution visits every slot once and misses nothing.
+  expired.clear();
+  wheel.Add(4, 115);
+  wheel.Advance(200, expired);
+  EXPECT_EQ(expired.size(), 2u);
+  EXPECT_EQ(wheel.Size(), 0u);
+}
+
+TEST(ClientTableTests, MatchesMapUnderChurn) {
+  LicsLedger ledger;
+  std::shared_ptr<SlabPool> pool = std::make_shared<SlabPool>();
+  ClientTable table;
+  std::map<long, std::shared_ptr<Client>> expected;
+
+  // sequential tokens like newClientToken hands out, evicted in a scattered order.
+  long base = 1L << 40;
+  unsigned seed = 7;
+  for (int round = 0; round < 20000; ++round) {
+    seed = seed * 1103515245 + 12345;
+    long token = base + (seed >> 8) % 4096;
+    if (seed & 1) {
+      std::shared_ptr<Client> client = std::allocate_shared<Client>(PoolAllocator<Client>(pool), token, ledger);
+      table.Insert(token, client);
+      expected[token] = client;
+    } else {
+      EXPECT_EQ(table.Erase(token), expected.erase(token) == 1);
+    }
+  }
+
+  EXPECT_EQ(table.Size(), expected.size());
+  for (long token = base; token < base + 4096; ++token) {
+    auto search = expected.find(token);
+    EXPECT_EQ(table.Find(token), search == expected.end() ? nullptr : search->second);
+  }
+  size_t visited = 0;
+  table.ForEach([&visited](long token, const std::shared_ptr<Client>& client) { ++visited; });
+  EXPECT_EQ(visited, expected.size());
+  EXPECT_EQ(table.Find(0), nullptr);
+  EXPECT_EQ(table.Find(CLIENT_TABLE_EMPTY), nullptr);
+
+  // evicted clients give their blocks back, new ones take them over without new slabs.
+  size_t slabs = pool->Slabs();
+  expected.clear();
+  for (long token = base; token < base + 4096; ++token) {
+    table.Erase(token);
+  }
+  EXPECT_EQ(table.Size(), 0);
+  EXPECT_EQ(pool->FreeBlocks(), slabs * SLAB_POOL_BLOCKS);
+  std::shared_ptr<Client> again = std::allocate_shared<Client>(PoolAllocator<Client>(pool), base, ledger);
+  EXPECT_EQ(pool->Slabs(), slabs);
+  EXPECT_EQ(again->GetToken(), base);
+}
+
+TEST(LicsLedgerTests, ClientCountersFollowSlots) {
+  LicsLedger ledger;
+  ledger.AddAlgo(300, TaskType::VIDEO);
+  ledger.AddAlgo(100, TaskType::PICTURE);
+  ledger.AddAlgo(300, TaskType::VIDEO); // added again, keeps its slot
+  ASSERT_EQ(ledger.Slots(), 2);
+  EXPECT_EQ(ledger.Find(300)->slot, 0);
+  EXPECT_EQ(ledger.Find(100)->slot, 1);
+  EXPECT_EQ(ledger.At(1), ledger.Find(100));
+  EXPECT_EQ(ledger.At(2), nullptr);
+
+  Client client(1, ledger);
+  client.Register(ledger.Find(100)->slot, 5);
+  client.Register(7, 5); // out of the ledger, ignored
+  EXPECT_FALSE(client.Registered(0));
+  EXPECT_TRUE(client.Registered(1));
+  EXPECT_EQ(client.MaxLimit(1), 5);
+
+  client.AddLics(0, 3);
+  client.AddReserved(0, 2);
+  client.AddLics(7, 3);
+  EXPECT_EQ(client.DecLics(0, 5), 3);
+  EXPECT_EQ(client.HeldLics(0), 0);
+  EXPECT_EQ(client.DrainReserved(0), 2);
+  EXPECT_EQ(client.HeldLics(7), 0);
+
+  // a catalog larger than the slots inside the client works the same.
+  LicsLedger large;
+  for (long algo = 0; algo < CLIENT_INLINE_SLOTS * 2; ++algo) {
+    large.AddAlgo(algo, TaskType::VIDEO);
+  }
+  Client wide(2, large);
+  int last = CLIENT_INLINE_SLOTS * 2 - 1;
+  wide.Register(last, 5);
+  wide.AddLics(last, 4);
+  EXPECT_TRUE(wide.Registered(last));
+  EXPECT_EQ(wide.HeldLics(last), 4);
+  EXPECT_EQ(wide.HeldLics(0), 0);
+}
+
+#ifdef LICS_LOCK_PROFILE
+TEST_F(LicsServerTests, LockProfileReportsCallSites) {
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  getAuthAccess(&authReq,  &authResp);
+  EXPECT_EQ(totalClientNum(), 1);
+
+  std::string report = LockProfileReport();
+  EXPECT_NE(report.find("lics_lock_acquisitions_total{lock=\"exclusive_write_or_read_server_license\",site=\"getAuthAccess@server.cc:"), std::string::npos);
+  EXPECT_NE(report.find("lics_lock_site_hold_ns_count{lock=\"exclusive_write_or_read_server_license\",site=\"totalClientNum@server.cc:"), std::string::npos);
+  EXPECT_NE(report.find("lics_lock_contended_total{lock=\"exclusive_write_or_read_event\""), std::string::npos);
+}
+#endif
+
 // performance tests
 TEST_F(LicsServerTests, ShouldHave1000Clients) {
   std::thread t[TEST_MAX_CLIENT_NUM];
@@ -300,6 +1061,105 @@ TEST_F(LicsServerTests, 1000ClientCreateAndDelete10VideoLicsFor10Times) {
 
 }
 
+// client count per algorithm is tracked on registration, not by scanning clients.
+TEST_F(LicsServerTests, ClientNumByAlgoIDFollowsAuth) {
+  for (int clientIdx = 0; clientIdx < TEST_MAX_CLIENT_NUM; clientIdx++) {
+    GetAuthAccessRequest authReq;
+    GetAuthAccessResponse authResp;
+    AlgoLics* lics = authReq.add_lics();
+    lics->set_maxlimit(TEST_MAX_CLIENT_LIMIT);
+    lics->mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    lics->mutable_algo()->set_type(clientIdx % 2 ? TaskType::PICTURE : TaskType::VIDEO);
+    lics->mutable_algo()->set_algorithmid(clientIdx % 2 ? UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA : UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+    Status ret = getAuthAccess(&authReq,  &authResp);
+    EXPECT_TRUE(ret.ok());
+  }
+
+  EXPECT_EQ(clientNumByAlgoID(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OA), TEST_MAX_CLIENT_NUM / 2);
+  EXPECT_EQ(clientNumByAlgoID(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD), TEST_MAX_CLIENT_NUM / 2);
+  EXPECT_EQ(clientNumByAlgoID(UNIS_VAS_OA), 0);
+}
+
+// 1000 clients ask for twice the pool at the same time, the ledger must hand out exactly the pool.
+TEST_F(LicsServerTests, 1000ClientOversubscribeOdLicsNeverExceedTotal) {
+  std::thread t[TEST_MAX_CLIENT_NUM];
+  std::atomic<int> granted{0};
+  int expected = TEST_MAX_OD_LICS_NUM * 2 / TEST_MAX_CLIENT_NUM;
+
+  for (int tidx = 0; tidx < TEST_MAX_CLIENT_NUM; ++tidx) {
+      t[tidx] =  std::thread(&LicsServerTests::CreateOdLicAsMuchAsPossible, this, expected, &granted);
+  }  
+  for (int tidx = 0; tidx < TEST_MAX_CLIENT_NUM; ++tidx) {
+      t[tidx].join();
+  }
+
+  GetAuthAccessRequest authReq;
+  GetAuthAccessResponse authResp;
+  Status ret = getAuthAccess(&authReq,  &authResp);
+  EXPECT_TRUE(ret.ok());
+
+  int total, used;
+  licsQuery(authResp.token(), UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+  EXPECT_EQ(granted, TEST_MAX_OD_LICS_NUM);
+  EXPECT_EQ(used, TEST_MAX_OD_LICS_NUM);
+}
+
+// allocations run while other threads keep registering clients and heartbeating, which used to
+// serialize every grant behind the server license mutex. the ledger never hands out more than it
+// has and ends up where it started, throughput is BM_CreateDeleteLicsUnderAuthLoad.
+TEST_F(LicsServerTests, 1000ClientCreateAndDelete10VideoLicsUnderAuthLoad) {
+  std::vector<long> tokens;
+  for (int idx = 0; idx < TEST_MAX_CLIENT_NUM; ++idx) {
+    GetAuthAccessRequest authReq;
+    GetAuthAccessResponse authResp;
+    getAuthAccess(&authReq,  &authResp);
+    tokens.push_back(authResp.token());
+  }
+
+  std::thread noise[TEST_MAX_CLIENT_NUM / 10];
+  for (int tidx = 0; tidx < TEST_MAX_CLIENT_NUM / 10; ++tidx) {
+      noise[tidx] = std::thread(&LicsServerTests::AuthAndKeepAliveLoop, this, TEST_LOOP_CNT);
+  }
+
+  std::atomic<bool> done{false};
+  std::thread watcher([&]() {
+    while (!done) {
+      int total, used;
+      licsQuery(tokens[0], UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+      EXPECT_GE(used, 0);
+      EXPECT_LE(used, TEST_MAX_CLIENT_NUM * TEST_10_LICS);
+      EXPECT_EQ(total, TEST_MAX_OD_LICS_NUM);
+      usleep(1000);
+    }
+  });
+
+  std::thread t[TEST_MAX_CLIENT_NUM];
+  for (int tidx = 0; tidx < TEST_MAX_CLIENT_NUM; ++tidx) {
+      t[tidx] =  std::thread(&LicsServerTests::CreateAndDeleteOdLicLoop, this, tokens[tidx], TEST_LOOP_CNT);
+  }  
+  for (int tidx = 0; tidx < TEST_MAX_CLIENT_NUM; ++tidx) {
+      t[tidx].join();
+  }
+  for (int tidx = 0; tidx < TEST_MAX_CLIENT_NUM / 10; ++tidx) {
+      noise[tidx].join();
+  }
+  done = true;
+  watcher.join();
+
+  int total, used;
+  licsQuery(tokens[0], UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+  EXPECT_EQ(total, TEST_MAX_OD_LICS_NUM);
+  EXPECT_EQ(used, 0);
+  EXPECT_EQ(reservedLicsByAlgoID(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD), 0);
+  EXPECT_EQ(totalClientNum(), TEST_MAX_CLIENT_NUM + TEST_MAX_CLIENT_NUM / 10 * TEST_LOOP_CNT);
+
+  // every request was granted in full, none was turned down.
+  std::string algo = "{algo=\"" + std::to_string(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD) + "\"} ";
+  std::string text = MetricsText();
+  EXPECT_NE(text.find("lics_licenses_granted_total" + algo + std::to_string(TEST_MAX_CLIENT_NUM * TEST_LOOP_CNT * TEST_10_LICS) + "\n"), std::string::npos);
+  EXPECT_NE(text.find("lics_licenses_denied_total" + algo + "0\n"), std::string::npos);
+}
+
 TEST_F(LicsServerTests, 1000ClientFetchOaLics) {
   for (int clientIdx = 0; clientIdx < TEST_MAX_CLIENT_NUM; clientIdx++) {
     GetAuthAccessRequest authReq;
@@ -437,6 +1297,68 @@ TEST_F(LicsServerTests, 500ClientCreateOdAnd500ClientFetchOaLics) {
 }
 
 
+// only clients whose deadline came due are evicted, with their licenses. a due client heard from
+// in the meantime is re-armed instead. sweep cost against client number is BM_SweepEvictAll.
+TEST_F(LicsServerTests, SweepEvictsOnlyExpiredClients) {
+  long startAt = GetTimeSecsFromEpoch();
+  std::vector<long> early;
+  for (int idx = 0; idx < TEST_MAX_CLIENT_NUM / 2; ++idx) {
+    GetAuthAccessRequest authReq;
+    GetAuthAccessResponse authResp;
+    getAuthAccess(&authReq,  &authResp);
+    early.push_back(authResp.token());
+
+    CreateLicsRequest createReq;
+    CreateLicsResponse createResp;
+    createReq.set_token(authResp.token());
+    createReq.set_clientexpectedlicsnum(TEST_10_LICS);
+    createReq.mutable_algo()->set_vendor(Vendor::UNISINSIGHT);
+    createReq.mutable_algo()->set_type(TaskType::VIDEO);
+    createReq.mutable_algo()->set_algorithmid(UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD);
+    createLics(&createReq, &createResp);
+  }
+  long earlyAt = GetTimeSecsFromEpoch();
+
+  // later clients and heartbeats fall on later seconds of the wheel.
+  sleep(2);
+  for (int idx = 0; idx < TEST_MAX_CLIENT_NUM / 2; ++idx) {
+    GetAuthAccessRequest authReq;
+    GetAuthAccessResponse authResp;
+    getAuthAccess(&authReq,  &authResp);
+  }
+  int heard = TEST_MAX_CLIENT_NUM / 10;
+  for (int idx = 0; idx < heard; ++idx) {
+    KeepAliveRequest req;
+    KeepAliveResponse resp;
+    req.set_token(early[idx]);
+    keepAlive(&req, &resp);
+  }
+  EXPECT_EQ(totalClientNum(), TEST_MAX_CLIENT_NUM);
+
+  // nothing is due before the deadline of the early clients.
+  serverClearDeadClients(startAt + TEST_HEARTBEAT_TIMEOUT_SEC - 1);
+  EXPECT_EQ(totalClientNum(), TEST_MAX_CLIENT_NUM);
+  EXPECT_NE(MetricsText().find("lics_clients_evicted_total 0\n"), std::string::npos);
+
+  // the early clients come due, the ones heard from are re-armed.
+  serverClearDeadClients(earlyAt + TEST_HEARTBEAT_TIMEOUT_SEC);
+  int evicted = TEST_MAX_CLIENT_NUM / 2 - heard;
+  EXPECT_EQ(totalClientNum(), TEST_MAX_CLIENT_NUM - evicted);
+  EXPECT_NE(MetricsText().find("lics_clients_evicted_total " + std::to_string(evicted) + "\n"), std::string::npos);
+
+  int total, used;
+  licsQuery(early[0], UNIS_FACE_PERSON_VEHICLE_NONVEHICLE_OD, total, used);
+  EXPECT_EQ(used, heard * TEST_10_LICS);
+
+  // the same second again finds nothing new.
+  serverClearDeadClients(earlyAt + TEST_HEARTBEAT_TIMEOUT_SEC);
+  EXPECT_EQ(totalClientNum(), TEST_MAX_CLIENT_NUM - evicted);
+
+  serverClearDeadClients(GetTimeSecsFromEpoch() + TEST_HEARTBEAT_TIMEOUT_SEC + 1);
+  EXPECT_EQ(totalClientNum(), 0);
+  EXPECT_NE(MetricsText().find("lics_clients_evicted_total " + std::to_string(TEST_MAX_CLIENT_NUM) + "\n"), std::string::npos);
+}
+
 TEST_F(LicsServerTests, MakeClientTimeout) {
   GetAuthAccessRequest authReq;
   GetAuthAccessResponse authResp;